@@ -27,7 +27,7 @@ def initialize(model_or_path, *args, **kwargs):
         if _hutoken is None:
             raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or failed to import.")
         special_chars_file = args[0] if args else None
-        merges_file = args[6] if len(args) > 6 else None
+        merges_file = args[6] if len(args) > 6 else kwargs.get('merges_file_path', None)
         if special_chars_file and not os.path.isfile(special_chars_file):
             raise ValueError(f"Special characters file '{special_chars_file}' does not exist.")
 
@@ -39,7 +39,11 @@ def initialize(model_or_path, *args, **kwargs):
         token_id = kwargs.get('token_id', -1)
         regex_pattern = kwargs.get('pattern', None)
 
-        result = _hutoken.initialize(model_or_path, special_chars_file, prefix, is_byte_encoder, token_id, regex_pattern)
+        # A trained vocabulary has no special characters to map.
+        if special_chars_file is None:
+            special_chars_file = os.devnull
+
+        result = _hutoken.initialize(model_or_path, special_chars_file, prefix, is_byte_encoder, token_id, regex_pattern, merges_file)
         return result
     else:
         try:
@@ -110,8 +114,13 @@ def initialize(model_or_path, *args, **kwargs):
         if hasattr(hf_tokenizer, 'byte_encoder') and hf_tokenizer.byte_encoder is not None:
             is_byte_encoder = 1
 
+        vocab = hf_tokenizer.get_vocab()
+        special_tokens = [token for token in hf_tokenizer.all_special_tokens
+                          if token in vocab]
+
         try:
             result = _hutoken.initialize(vocab_file, special_chars_file, prefix, is_byte_encoder, merges_file_path=merges_file_path, *args, **kwargs)
+            _hutoken.add_special_tokens(special_tokens)
         except Exception as e:
             traceback.print_exc(file=sys.stderr)
             raise RuntimeError("An unexpected error occured during "
@@ -119,30 +128,203 @@ def initialize(model_or_path, *args, **kwargs):
 
         return result
 
-def encode(text):
+def add_special_tokens(tokens):
+    """
+    Registers tokens of the vocabulary, like `<|endoftext|>`, as special
+    tokens, which `encode` can recognize in the text and encode as their ids.
+    Initializing from a Hugging Face model registers its special tokens.
+    """
+    if _hutoken is None:
+        raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or failed to import.")
+    return _hutoken.add_special_tokens(list(tokens))
+
+def encode(text, num_threads=0, max_tokens=None, return_offsets=False,
+           allowed_special=(), disallowed_special="all"):
+    """
+    Encode a single text. Large texts are split at pretoken boundaries and
+    encoded on up to `num_threads` threads (0 means one per CPU), giving the
+    same tokens as a serial encode.
+
+    With `max_tokens`, encoding stops at the first pretoken whose tokens do
+    not fit in the budget, and a `(tokens, consumed)` tuple is returned,
+    where `consumed` is the number of UTF-8 bytes of `text` up to the end of
+    the last pretoken that was encoded.
+
+    With `return_offsets`, a `(tokens, offsets, word_ids)` tuple is returned
+    (followed by `consumed` if `max_tokens` is given). `offsets` holds the
+    start and end byte of every token in the UTF-8 encoded text, as a flat
+    `array('i')` of pairs, and `word_ids` the index of the pretoken every
+    token comes from.
+
+    Registered special tokens in `allowed_special` are encoded as their ids,
+    while those in `disallowed_special` raise a ValueError, as in tiktoken.
+    Either may be "all"; "all" disallowed means every one that is not
+    allowed. The others are encoded as ordinary text.
+    """
     if _hutoken is None:
         raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or failed to import.")
     try:
-        tokens = _hutoken.encode(text)
-        return tokens
+        kwargs = {"return_offsets": return_offsets,
+                  "allowed_special": allowed_special,
+                  "disallowed_special": disallowed_special}
+        if max_tokens is not None:
+            kwargs["max_tokens"] = max_tokens
+        return _hutoken.encode(text, num_threads, **kwargs)
+    except ValueError as e:
+        raise ValueError(f"hutoken: Error encoding text: {e}") from e
     except Exception as e:
         traceback.print_exc(file=sys.stderr)
         raise RuntimeError(f"hutoken: Error encoding text: {e}")
 
-def batch_encode(texts, num_threads=1):
+def batch_encode(texts, num_threads=1, max_tokens=None, return_offsets=False,
+                 allowed_special=(), disallowed_special="all"):
+    """
+    Encode a list of texts on `num_threads` threads. `max_tokens`,
+    `return_offsets` and the special token policies work like in `encode`;
+    with `max_tokens` or `return_offsets` the result is a tuple of lists with
+    one element per text.
+    """
     if _hutoken is None:
         raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or failed to import.")
     try:
-        return _hutoken.batch_encode(texts, num_threads)
+        kwargs = {"return_offsets": return_offsets,
+                  "allowed_special": allowed_special,
+                  "disallowed_special": disallowed_special}
+        if max_tokens is not None:
+            kwargs["max_tokens"] = max_tokens
+        return _hutoken.batch_encode(texts, num_threads, **kwargs)
+    except ValueError as e:
+        raise ValueError(f"hutoken: Error encoding texts: {e}") from e
     except Exception as e:
         traceback.print_exc(file=sys.stderr)
         raise RuntimeError(f"hutoken: Error encoding texts: {e}")
 
-def decode(tokens):
+def count_tokens(text, num_threads=0, max_tokens=None, allowed_special=(),
+                 disallowed_special="all"):
+    """
+    Returns the number of tokens `encode(text)` would produce, without
+    building the token list. With `max_tokens` counting stops at that many
+    tokens, which is enough to check whether a text fits a budget.
+    """
+    if _hutoken is None:
+        raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or failed to import.")
+    try:
+        kwargs = {"allowed_special": allowed_special,
+                  "disallowed_special": disallowed_special}
+        if max_tokens is not None:
+            kwargs["max_tokens"] = max_tokens
+        return _hutoken.count_tokens(text, num_threads, **kwargs)
+    except ValueError as e:
+        raise ValueError(f"hutoken: Error counting tokens: {e}") from e
+    except Exception as e:
+        traceback.print_exc(file=sys.stderr)
+        raise RuntimeError(f"hutoken: Error counting tokens: {e}")
+
+def batch_count_tokens(texts, num_threads=1, max_tokens=None,
+                       allowed_special=(), disallowed_special="all"):
+    if _hutoken is None:
+        raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or failed to import.")
+    try:
+        kwargs = {"allowed_special": allowed_special,
+                  "disallowed_special": disallowed_special}
+        if max_tokens is not None:
+            kwargs["max_tokens"] = max_tokens
+        return _hutoken.batch_count_tokens(texts, num_threads, **kwargs)
+    except ValueError as e:
+        raise ValueError(f"hutoken: Error counting tokens: {e}") from e
+    except Exception as e:
+        traceback.print_exc(file=sys.stderr)
+        raise RuntimeError(f"hutoken: Error counting tokens: {e}")
+
+class Encoder:
+    """
+    Incremental encoder for text that arrives in chunks, e.g. from a file or
+    a socket. `feed` accepts `str` or UTF-8 `bytes` and returns the tokens
+    which can no longer change; `finish` returns the rest.
+    """
+
+    def __init__(self):
+        if _hutoken is None:
+            raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or failed to import.")
+        self._encoder = _hutoken.Encoder()
+
+    def feed(self, chunk):
+        try:
+            return self._encoder.feed(chunk)
+        except Exception as e:
+            traceback.print_exc(file=sys.stderr)
+            raise RuntimeError(f"hutoken: Error encoding chunk: {e}")
+
+    def finish(self):
+        try:
+            return self._encoder.finish()
+        except Exception as e:
+            traceback.print_exc(file=sys.stderr)
+            raise RuntimeError(f"hutoken: Error encoding chunk: {e}")
+
+class Decoder:
+    """
+    Incremental decoder for tokens that arrive one at a time, e.g. while a
+    model generates text. `feed` accepts a token or a list of tokens and
+    returns the text they complete; bytes of a character that is not complete
+    yet are kept for the next call. `finish` returns what is left. `errors`
+    handles invalid UTF-8 as in `bytes.decode`.
+    """
+
+    def __init__(self, errors="strict"):
+        if _hutoken is None:
+            raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or failed to import.")
+        self._decoder = _hutoken.Decoder(errors)
+
+    def feed(self, tokens):
+        try:
+            return self._decoder.feed(tokens)
+        except ValueError:
+            raise
+        except Exception as e:
+            traceback.print_exc(file=sys.stderr)
+            raise RuntimeError(f"hutoken: Error decoding tokens: {e}")
+
+    def finish(self):
+        try:
+            return self._decoder.finish()
+        except ValueError:
+            raise
+        except Exception as e:
+            traceback.print_exc(file=sys.stderr)
+            raise RuntimeError(f"hutoken: Error decoding tokens: {e}")
+
+def encode_file(input_paths, output_prefix, doc_separator=None, eos_id=-1, num_threads=0, max_shard_tokens=0):
+    """
+    Encodes one or more text files into binary token shards,
+    `<output_prefix>_00000.bin` and so on, each with an `.idx` file holding
+    the token offsets of its documents. Documents are separated by
+    `doc_separator` (each file is one document if it is None), and `eos_id`
+    is appended after every document if it is not negative. A new shard is
+    started once one holds `max_shard_tokens` tokens (0 means no limit).
+    Returns a dict with the number of documents and tokens, the dtype of the
+    shards and their paths. A document containing a NUL byte raises a
+    ValueError, like `encode`.
+    """
+    if _hutoken is None:
+        raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or failed to import.")
+    try:
+        return _hutoken.encode_file(input_paths, output_prefix, doc_separator, eos_id, num_threads, max_shard_tokens)
+    except ValueError:
+        raise
+    except Exception as e:
+        traceback.print_exc(file=sys.stderr)
+        raise RuntimeError(f"hutoken: Error encoding files: {e}")
+
+def decode(tokens, num_threads=0):
+    """
+    Decode a sequence of tokens. Long sequences are split into pieces that
+    are decoded on up to `num_threads` threads (0 means one per CPU).
+    """
     if _hutoken is None:
         raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or failed to import.")
     try:
-        text = _hutoken.decode(tokens)
+        text = _hutoken.decode(tokens, num_threads)
         return text
     except ValueError as e:
         traceback.print_exc(file=sys.stderr)
@@ -151,11 +333,42 @@ def decode(tokens):
         traceback.print_exc(file=sys.stderr)
         raise RuntimeError(f"hutoken: Error decoding tokens: {e}")
 
-def batch_decode(tokens, num_threads=1):
+def decode_bytes(tokens, num_threads=0):
     if _hutoken is None:
         raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or failed to import.")
     try:
-        return _hutoken.batch_decode(tokens, num_threads)
+        return _hutoken.decode_bytes(tokens, num_threads)
+    except ValueError as e:
+        traceback.print_exc(file=sys.stderr)
+        raise ValueError(f"hutoken: Error decoding tokens: {e}")
+    except Exception as e:
+        traceback.print_exc(file=sys.stderr)
+        raise RuntimeError(f"hutoken: Error decoding tokens: {e}")
+
+def decode_into(tokens, buffer, num_threads=0):
+    if _hutoken is None:
+        raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or failed to import.")
+    try:
+        return _hutoken.decode_into(tokens, buffer, num_threads)
+    except ValueError as e:
+        traceback.print_exc(file=sys.stderr)
+        raise ValueError(f"hutoken: Error decoding tokens: {e}")
+    except Exception as e:
+        traceback.print_exc(file=sys.stderr)
+        raise RuntimeError(f"hutoken: Error decoding tokens: {e}")
+
+def batch_decode(tokens, num_threads=1, offsets=None, concat=False):
+    """
+    Decode a batch of token sequences into a list of strings. With `concat`,
+    a `DecodedBatch` is returned instead, holding all texts in one UTF-8
+    buffer: `batch.data` is the bytes, `batch.offsets` the int64 start of
+    every text and the end of the last one, and `batch[i]` creates the
+    string of text i.
+    """
+    if _hutoken is None:
+        raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or failed to import.")
+    try:
+        return _hutoken.batch_decode(tokens, num_threads, offsets, concat)
     except Exception as e:
         traceback.print_exc(file=sys.stderr)
         raise RuntimeError(f"hutoken: Error decoding tokens: {e}")
@@ -165,6 +378,16 @@ def bpe_train(*args, **kwargs):
         raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or does not provide 'bpe_train'.")
     return _hutoken.bpe_train(*args, **kwargs)
 
+def bpe_train_files(*args, **kwargs):
+    if _hutoken is None:
+        raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or does not provide 'bpe_train_files'.")
+    return _hutoken.bpe_train_files(*args, **kwargs)
+
+def bpe_train_iter(*args, **kwargs):
+    if _hutoken is None:
+        raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or does not provide 'bpe_train_iter'.")
+    return _hutoken.bpe_train_iter(*args, **kwargs)
+
 def bbpe_train(*args, **kwargs):
     if _hutoken is None:
         raise RuntimeError("hutoken: Native C extension '_hutoken' is not installed or does not provide 'bbpe_train'.")
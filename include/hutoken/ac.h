@@ -3,18 +3,60 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define AC_ALPHABET_SIZE 256
+#define AC_ROOT 0
 
+// A trie node while patterns are added. Its outgoing edges form a linked
+// list in the automaton's `edges`.
 struct ACNode {
-    struct ACNode* children[AC_ALPHABET_SIZE];
-    struct ACNode* failure_link;
+    int first_edge;  // -1: none
     int output_value;
     size_t pattern_len;
 };
 
+struct ACEdge {
+    unsigned char label;
+    int target;
+    int next;  // next edge of the same node, -1: none
+};
+
+// A node of the compiled automaton. The node's children are
+// `targets[first_edge]` up to `targets[first_edge + num_edges]`, sorted by
+// their labels in `labels`.
+struct ACState {
+    uint32_t first_edge;
+    uint32_t num_edges;
+    int32_t failure_link;
+    int32_t output_link;  // nearest state on the failure chain with an output
+    int32_t output_value;
+    uint32_t pattern_len;
+};
+
 struct ACAutomaton {
-    struct ACNode* root;
+    // The trie the patterns are added to. Node i becomes state i.
+    struct ACNode* nodes;
+    size_t num_nodes;
+    size_t nodes_capacity;
+    struct ACEdge* edges;
+    size_t num_edges;
+    size_t edges_capacity;
+    size_t max_pattern_len;
+
+    // The compiled automaton, built by `ac_automaton_build_failure_links` in
+    // a single allocation. NULL until then.
+    void* compiled;
+    const struct ACState* states;
+    const int32_t* root_next;  // transitions of the root for every byte
+    const int32_t* targets;
+    const unsigned char* labels;
+};
+
+struct ACMatch {
+    size_t start;
+    size_t len;
+    int output_value;
 };
 
 struct ACAutomaton* ac_automaton_create(void);
@@ -22,6 +64,14 @@ bool ac_automaton_add_string(struct ACAutomaton* automaton,
                              const char* pattern,
                              int output_value);
 void ac_automaton_build_failure_links(struct ACAutomaton* automaton);
+int32_t ac_automaton_next(const struct ACAutomaton* automaton,
+                          int32_t state,
+                          unsigned char byte);
+bool ac_automaton_find(const struct ACAutomaton* automaton,
+                       const char* text,
+                       size_t len,
+                       const unsigned char* enabled,
+                       struct ACMatch* match);
 void ac_automaton_free(struct ACAutomaton* automaton);
 
 #endif
@@ -1,12 +1,25 @@
 #ifndef HUTOKEN_BBPE_H
 #define HUTOKEN_BBPE_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hutoken/bpe.h"
+
 struct TokenPair {
     int id1;
     int id2;
-    int freq;
+    int64_t freq;
 };
 
-void bbpe_train(char* text, const int vocab_size, char* vocab_file_name);
+bool bbpe_train(char* text,
+                const struct VocabSizes* vocab_sizes,
+                const char* pattern,
+                char* vocab_file_name,
+                const char* merges_file_path,
+                const struct TrainCheckpoint* checkpoint,
+                struct TrainProgressHook* progress,
+                bool pretokenize,
+                int num_threads);
 
 #endif
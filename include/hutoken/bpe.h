@@ -1,8 +1,17 @@
 #ifndef HUTOKEN_BPE_H
 #define HUTOKEN_BPE_H
 
+#include <regex.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "hutoken/wordcount.h"
+
+// First line of a merges file whose tokens are written as hex bytes, as
+// training writes them.
+#define MERGES_HEX_HEADER "#format: hex"
+
 struct Token {
     char* key;
     int value;
@@ -21,9 +30,136 @@ int pair_compare(const void* lhs, const void* rhs);
 uint64_t token_hash(const void* item);
 int token_compare(const void* a, const void* b);
 
-void bpe_train(char* text,
-               const int vocab_size,
+struct Trainer;
+
+/*
+ * The vocabulary sizes to save during one training, in increasing order.
+ * Merges never change once learned, so the vocabulary of a size is the same
+ * as if training had stopped there. A single size is saved under the given
+ * file names, more of them as <name>_<size>.txt.
+ */
+struct VocabSizes {
+    int* sizes;
+    size_t count;
+};
+
+bool bpe_save_reached_vocabs(struct Trainer* trainer,
+                             const struct VocabSizes* vocab_sizes,
+                             const char* vocab_file_name,
+                             const char* merges_file_path,
+                             size_t* next,
+                             bool done);
+
+/*
+ * Checkpoints of a training run, written every `every` merges to `path`, and
+ * the checkpoint to resume a run from instead of counting its input again.
+ */
+struct TrainCheckpoint {
+    const char* path;
+    size_t every;
+    const char* resume_from;
+};
+
+// The progress of a training run, as reported to a `TrainProgressHook`.
+struct TrainProgress {
+    size_t num_merges;
+    size_t vocab_size;
+    int64_t pair_count;        // of the last merge
+    double elapsed_seconds;    // since training, or resuming, started
+    double merges_per_second;  // since the previous report
+    size_t memory_bytes;       // allocated by the trainer
+    bool done;
+};
+
+/*
+ * Reports the progress of training every `every` merges, and once it is
+ * done, to `report`. It returns false only if it fails, with a Python
+ * exception set, and training stops with that error. Training keeps its
+ * clock in the rest of the fields.
+ */
+struct TrainProgressHook {
+    bool (*report)(const struct TrainProgress* progress, void* data);
+    void* data;
+    size_t every;
+    double start_seconds;
+    double last_seconds;
+    size_t last_merges;
+};
+
+void bpe_start_progress(const struct Trainer* trainer,
+                        struct TrainProgressHook* progress);
+bool bpe_report_progress(const struct Trainer* trainer,
+                         struct TrainProgressHook* progress,
+                         bool done);
+
+bool bpe_save_checkpoint(const struct Trainer* trainer,
+                         const struct TrainCheckpoint* checkpoint);
+bool bpe_resume(struct Trainer* trainer, const char* path);
+size_t bpe_first_unsaved_size(const struct Trainer* trainer,
+                              const struct VocabSizes* vocab_sizes,
+                              const struct TrainCheckpoint* checkpoint);
+
+bool bpe_add_words(struct Trainer* trainer,
+                   const char* text,
+                   const char* pattern,
+                   int num_threads);
+bool bpe_train(char* text,
+               const struct VocabSizes* vocab_sizes,
                const char* pattern,
-               char* vocab_file_name);
+               char* vocab_file_name,
+               const char* merges_file_path,
+               const struct TrainCheckpoint* checkpoint,
+               struct TrainProgressHook* progress,
+               int num_threads);
+bool bpe_train_word_counts(struct WordCounts* counts,
+                           const struct VocabSizes* vocab_sizes,
+                           char* vocab_file_name,
+                           const char* merges_file_path,
+                           const struct TrainCheckpoint* checkpoint,
+                           struct TrainProgressHook* progress,
+                           int num_threads,
+                           int64_t* min_merge_count);
+
+/*
+ * Counts the pretokens of a corpus fed in chunks of any size, keeping only
+ * the counts and the text after the last position where a new pretoken is
+ * sure to start. With a custom pattern the text is counted up to the last
+ * line break instead, so matches never span lines.
+ */
+struct WordStream {
+    struct WordCounts counts;
+    regex_t regex;
+    bool has_regex;
+    int num_threads;
+    char* pending;  // bytes received but not counted yet
+    size_t pending_len;
+    size_t pending_capacity;
+};
+
+/*
+ * How much of the input files to count: blocks picked at random, the same
+ * ones for the same seed, with every file contributing in proportion to its
+ * size. Every byte is counted if `max_bytes` is 0.
+ */
+struct TrainSample {
+    size_t max_bytes;
+    uint64_t seed;
+    size_t total_bytes;    // of the input files
+    size_t sampled_bytes;  // read from them
+};
+
+bool word_stream_init(struct WordStream* stream,
+                      const char* pattern,
+                      int num_threads);
+bool word_stream_feed(struct WordStream* stream,
+                      const char* chunk,
+                      size_t chunk_len);
+bool word_stream_feed_file(struct WordStream* stream, const char* path);
+bool word_stream_finish(struct WordStream* stream);
+bool word_stream_sample_files(struct WordStream* stream,
+                              const char* const* paths,
+                              size_t num_paths,
+                              struct TrainSample* sample);
+void word_stream_free(struct WordStream* stream);
 
 #endif
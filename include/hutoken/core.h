@@ -8,8 +8,15 @@
 
 #include "hutoken/taskqueue.h"
 
+extern char* const ENCODE_DISALLOWED_SPECIAL_MSG;
+extern char* const ENCODE_NUL_CHARACTER_MSG;
+
 void encode(struct EncodeTask* task);
+size_t encode_find_split(const char* text, size_t length, size_t target);
+size_t encode_find_last_split(const char* text, size_t length);
+bool decode_build_table(struct DecodeContext* ctx);
 void decode(struct DecodeTask* task);
+void decode_measure(struct DecodeTask* task);
 #ifdef USE_FOMA
 PyObject* initialize_foma(void);
 PyObject* look_up_word(struct apply_handle* handle,
@@ -5,10 +5,16 @@
 
 #include "Python.h"
 
-PyObject* p_bpe_train(PyObject* self, PyObject* args);
-PyObject* p_bbpe_train(PyObject* self, PyObject* args);
-PyObject* p_encode(PyObject* self, PyObject* args);
-PyObject* p_batch_encode(PyObject* self, PyObject* args);
+PyObject* p_bpe_train(PyObject* self, PyObject* args, PyObject* kwargs);
+PyObject* p_bpe_train_files(PyObject* self, PyObject* args, PyObject* kwargs);
+PyObject* p_bpe_train_iter(PyObject* self, PyObject* args, PyObject* kwargs);
+PyObject* p_bbpe_train(PyObject* self, PyObject* args, PyObject* kwargs);
+PyObject* p_encode(PyObject* self, PyObject* args, PyObject* kwargs);
+PyObject* p_batch_encode(PyObject* self, PyObject* args, PyObject* kwargs);
+PyObject* p_count_tokens(PyObject* self, PyObject* args, PyObject* kwargs);
+PyObject* p_batch_count_tokens(PyObject* self,
+                               PyObject* args,
+                               PyObject* kwargs);
 PyMODINIT_FUNC PyInit__hutoken(void);
 PyObject* p_initialize_foma(PyObject* self);
 PyObject* p_look_up_word(PyObject* self, PyObject* args);
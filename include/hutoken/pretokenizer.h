@@ -17,8 +17,18 @@ char* pretokenizer_encode_arena(struct Arena* arena,
                                 const char** special_chars,
                                 const char* prefix,
                                 bool is_byte_encoder);
+void pretokenizer_source_offsets(const char* text,
+                                 const char** special_chars,
+                                 const char* prefix,
+                                 bool is_byte_encoder,
+                                 int starts[],
+                                 int ends[]);
 size_t pretokenizer_decode(const char* text,
                            const struct DecodeContext* ctx,
                            char* buffer);
+size_t pretokenizer_decode_n(const char* text,
+                             size_t text_len,
+                             const struct DecodeContext* ctx,
+                             char* buffer);
 
 #endif
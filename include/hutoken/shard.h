@@ -0,0 +1,30 @@
+#ifndef HUTOKEN_SHARD_H
+#define HUTOKEN_SHARD_H
+
+#include <stddef.h>
+
+#include "hutoken/taskqueue.h"
+
+struct ShardOptions {
+    const char* output_prefix;
+    const char* doc_separator;  // NULL: every input file is one document
+    size_t doc_separator_len;
+    int eos_id;  // appended after every document, negative: none
+    int num_threads;
+    size_t max_shard_tokens;
+};
+
+struct ShardStats {
+    size_t num_documents;
+    size_t num_tokens;
+    size_t num_shards;
+    size_t token_size;  // bytes per token in the shard files, 2 or 4
+};
+
+char* shard_encode_files(struct EncodeContext* ctx,
+                         const char* const* input_paths,
+                         size_t num_paths,
+                         const struct ShardOptions* options,
+                         struct ShardStats* stats);
+
+#endif
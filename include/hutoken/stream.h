@@ -0,0 +1,46 @@
+#ifndef HUTOKEN_STREAM_H
+#define HUTOKEN_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "hutoken/taskqueue.h"
+#include "hutoken/vector.h"
+
+struct StreamEncoder {
+    struct EncodeContext* ctx;
+    char* pending;  // bytes received but not encoded yet
+    size_t pending_len;
+    size_t pending_capacity;
+    bool started;  // part of the text has already been encoded
+};
+
+bool stream_encoder_init(struct StreamEncoder* stream,
+                         struct EncodeContext* ctx);
+void stream_encoder_release(struct StreamEncoder* stream);
+char* stream_encoder_feed(struct StreamEncoder* stream,
+                          const char* chunk,
+                          size_t chunk_len,
+                          struct IntVector* tokens);
+char* stream_encoder_finish(struct StreamEncoder* stream,
+                            struct IntVector* tokens);
+
+struct StreamDecoder {
+    struct DecodeContext* ctx;
+    char pending[4];  // incomplete UTF-8 sequence at the end of the output
+    size_t pending_len;
+    bool started;  // part of the tokens have already been decoded
+};
+
+void stream_decoder_init(struct StreamDecoder* stream,
+                         struct DecodeContext* ctx);
+char* stream_decoder_feed(struct StreamDecoder* stream,
+                          int tokens[],
+                          int num_tokens,
+                          char** text,
+                          size_t* text_len);
+void stream_decoder_finish(struct StreamDecoder* stream,
+                           char* text,
+                           size_t* text_len);
+
+#endif
@@ -3,11 +3,23 @@
 
 #if defined(_WIN32) || defined(_WIN64)
 #include <windows.h>
+typedef HANDLE thread_t;
+typedef DWORD WINAPI thread_return_t;
+typedef LPVOID thread_arg_t;
+#define THREAD_CREATE(thr, func, arg) \
+    *(thr) = CreateThread(NULL, 0, func, arg, 0, NULL)
+#define THREAD_JOIN(thr) WaitForSingleObject(thr, INFINITE)
 #else
 #include <pthread.h>
+typedef pthread_t thread_t;
+typedef void* thread_return_t;
+typedef void* thread_arg_t;
+#define THREAD_CREATE(thr, func, arg) pthread_create(thr, NULL, func, arg)
+#define THREAD_JOIN(thr) pthread_join(thr, NULL)
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "hutoken/ac.h"
 #include "hutoken/hashmap.h"
@@ -18,10 +30,36 @@ struct EncodeContext {
     struct HashMap* vocab_encode;
     size_t num_merge_rules;
     struct HashMap* merges_map;
+    bool merges_from_bytes;  // merges of bytes, not of UTF-8 characters
     char* pattern;
     char* special_chars[256];
     char* prefix;
     bool is_byte_encoder;
+    // Special tokens, matched in the text before pretokenization. The
+    // automaton's output values index the token strings and ids.
+    struct ACAutomaton* special_tokens_ac;
+    char** special_tokens;
+    int* special_token_ids;
+    size_t num_special_tokens;
+    bool special_tokens_contain_whitespace;
+};
+
+// How an encode call treats a registered special token found in the text.
+enum SpecialTokenPolicy {
+    SPECIAL_TOKEN_TEXT = 0,    // encoded like ordinary text
+    SPECIAL_TOKEN_ALLOWED,     // encoded as its id
+    SPECIAL_TOKEN_DISALLOWED,  // encoding fails
+};
+
+// The maxchar of a token whose decoded bytes are not complete, valid UTF-8,
+// e.g. part of a character split across tokens.
+#define DECODE_MAXCHAR_NOT_UTF8 UINT32_MAX
+
+// What a token's decoded bytes hold as text: the number of code points and
+// the largest of them, below 0x80 if they are ASCII.
+struct DecodedTokenInfo {
+    uint32_t num_chars;
+    uint32_t maxchar;
 };
 
 struct DecodeContext {
@@ -35,20 +73,50 @@ struct DecodeContext {
     struct HashMap* special_chars_map_decode;
     size_t max_special_char_len;
     struct ACAutomaton* ac;
+    // Decoded bytes of every token, with the special character and byte
+    // encoder mappings applied: token i is decoded_tokens[decoded_offsets[i]]
+    // up to decoded_offsets[i + 1].
+    char* decoded_tokens;
+    size_t* decoded_offsets;
+    struct DecodedTokenInfo* decoded_info;
 };
 
 struct EncodeTask {
     char* text;
+    size_t text_len;
+    bool continuation;  // text continues an already encoded one, no prefix
     struct EncodeContext* ctx;
-    struct IntVector* tokens;
+    struct IntVector* tokens;  // NULL: tokens are only counted
+    // Start and end byte of every token in text and the index of the pretoken
+    // it belongs to. Both NULL if not needed.
+    struct IntVector* offsets;
+    struct IntVector* word_ids;
+    size_t num_tokens;
+    size_t max_tokens;  // stop after this many tokens, 0: no limit
+    size_t consumed;    // end of the last encoded word in text
+    // End of the word or special token at which the budget ran out, 0 if it
+    // did not. Everything before it is encoded as in the full text.
+    size_t budget_end;
+    // SpecialTokenPolicy of every registered special token, NULL: all text.
+    const unsigned char* special_policy;
     char* error_msg;
 };
 
 struct DecodeTask {
     int* tokens;
     int* tokens_size;
+    bool continuation;  // tokens continue a decoded sequence, keep the prefix
     struct DecodeContext* ctx;
+    // Caller's buffer to decode into, without a terminating null byte, in
+    // place of a newly allocated result. NULL: allocate the result.
+    char* output;
+    size_t output_capacity;
     char* result;
+    size_t result_len;
+    // Code points in the result and the largest of them, or
+    // DECODE_MAXCHAR_NOT_UTF8 if the result may not be valid UTF-8.
+    size_t result_num_chars;
+    uint32_t result_maxchar;
     char* error_msg;
 };
 
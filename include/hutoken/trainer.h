@@ -0,0 +1,129 @@
+#ifndef HUTOKEN_TRAINER_H
+#define HUTOKEN_TRAINER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "hutoken/hashmap.h"
+#include "hutoken/vector.h"
+#include "hutoken/wordcount.h"
+
+#define TRAINER_NONE SIZE_MAX
+
+struct PositionList {
+    size_t* data;
+    size_t size;
+    size_t capacity;
+};
+
+// The occurrences of an adjacent pair of symbols, weighted by the frequency
+// of the words they are in.
+struct PairStats {
+    int left;
+    int right;
+    int64_t count;
+    struct PositionList positions;  // of the left symbols, some maybe stale
+    size_t touched;                 // the merge that last changed the count
+};
+
+struct PairHeapEntry {
+    int64_t count;
+    int left;
+    int right;
+};
+
+// A change to the count of a pair made by a merge, and where the pair occurs
+// if it gains an occurrence.
+struct PairUpdate {
+    int left;
+    int right;
+    int64_t delta;
+    size_t position;
+    size_t index;  // of the pair, TRAINER_NONE if it did not exist yet
+};
+
+struct PairUpdates {
+    struct PairUpdate* data;
+    size_t size;
+    size_t capacity;
+    bool oom;
+};
+
+struct TrainerMerge {
+    int left;
+    int right;
+    int id;
+    int64_t count;
+};
+
+/*
+ * Learns BPE merges over a corpus of words, each a sequence of symbols with
+ * a frequency, which may as well be a single word of the whole text. Pairs
+ * are only counted within words. The pair counts are kept up to date as
+ * pairs are merged, and every pair knows where it occurs, so a merge only
+ * touches the occurrences of the pair and their neighbours. The most
+ * frequent pair is taken from a max-heap whose outdated entries are skipped.
+ */
+struct Trainer {
+    // Symbols of every word, back to back, linked to their neighbours in the
+    // word. A merge keeps the left symbol and unlinks the right one, setting
+    // it to -1. Word i starts at word_starts[i].
+    int* symbols;
+    size_t* prev;
+    size_t* next;
+    int64_t* freqs;  // of the word each symbol is in
+    size_t num_symbols;
+    size_t symbols_capacity;
+    size_t* word_starts;
+    size_t num_words;
+    size_t words_capacity;
+
+    struct HashMap* pair_index;  // (left, right) -> index in pairs
+    struct PairStats* pairs;
+    size_t num_pairs;
+    size_t pairs_capacity;
+    struct PairHeapEntry* heap;
+    size_t heap_size;
+    size_t heap_capacity;
+    struct IntVector touched;     // pairs changed by the current merge
+    struct TrainerMerge* merges;  // learned so far, in order
+    size_t num_merges;
+    size_t merges_capacity;
+
+    // A merge rewrites runs of its occurrences on up to num_threads threads,
+    // each recording the changes to the counts in its own updates, which are
+    // then applied in order, so the merges do not depend on the threads.
+    int num_threads;
+    struct PairUpdates* updates;
+    size_t* new_pairs;  // pairs (x, id) by x, then (id, y) by y
+    size_t new_pairs_capacity;
+
+    // Bytes of every token, starting with the 256 single bytes, and the
+    // token ids by their bytes, as `save_vocab` expects them.
+    char** tokens;
+    size_t num_tokens;
+    size_t tokens_capacity;
+    struct HashMap* vocab;
+
+    bool oom;  // the last call failed for lack of memory
+};
+
+bool trainer_init(struct Trainer* trainer);
+bool trainer_add_word(struct Trainer* trainer,
+                      const char* bytes,
+                      size_t len,
+                      int64_t freq);
+bool trainer_add_word_counts(struct Trainer* trainer,
+                             struct WordCounts* counts);
+bool trainer_write_checkpoint(const struct Trainer* trainer, FILE* file);
+bool trainer_read_checkpoint(struct Trainer* trainer, FILE* file);
+bool trainer_count_pairs(struct Trainer* trainer);
+bool trainer_merge_next(struct Trainer* trainer,
+                        int64_t min_frequency,
+                        struct TrainerMerge* merge);
+size_t trainer_memory_usage(const struct Trainer* trainer);
+void trainer_free(struct Trainer* trainer);
+
+#endif
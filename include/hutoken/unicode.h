@@ -0,0 +1,39 @@
+#ifndef HUTOKEN_UNICODE_H
+#define HUTOKEN_UNICODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Code unit widths, matching the values of CPython's PyUnicode_*_KIND.
+enum UnicodeKind {
+    UNICODE_KIND_UCS1 = 1,
+    UNICODE_KIND_UCS2 = 2,
+    UNICODE_KIND_UCS4 = 4,
+};
+
+enum UnicodeError {
+    UNICODE_SUCCESS,
+    UNICODE_INVALID_ARGUMENT,
+    UNICODE_SURROGATE,
+    UNICODE_NUL_CHARACTER,
+    UNICODE_INVALID_UTF8,
+};
+
+enum UnicodeError unicode_utf8_len(const void* data,
+                                   size_t length,
+                                   enum UnicodeKind kind,
+                                   size_t* utf8_len);
+enum UnicodeError unicode_to_utf8(const void* data,
+                                  size_t length,
+                                  enum UnicodeKind kind,
+                                  char* buffer);
+enum UnicodeError unicode_utf8_scan(const char* text,
+                                    size_t len,
+                                    size_t* length,
+                                    uint32_t* maxchar);
+void unicode_from_utf8(const char* text,
+                       size_t len,
+                       enum UnicodeKind kind,
+                       void* data);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef HUTOKEN_WORDCOUNT_H
+#define HUTOKEN_WORDCOUNT_H
+
+#include <regex.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hutoken/hashmap.h"
+
+struct WordCount {
+    char* bytes;
+    size_t len;
+    int64_t count;
+};
+
+/*
+ * The distinct words of a corpus, split by the pretokenizer, with the number
+ * of times each occurs. Training on them instead of the text touches every
+ * distinct word once per merge, however often it occurs.
+ */
+struct WordCounts {
+    struct HashMap* words;
+    int64_t total;  // occurrences of all the words
+    bool oom;       // the last call failed for lack of memory
+};
+
+bool word_counts_init(struct WordCounts* counts);
+bool word_counts_add(struct WordCounts* counts,
+                     const char* bytes,
+                     size_t len,
+                     int64_t count);
+bool word_counts_add_text(struct WordCounts* counts,
+                          const char* text,
+                          size_t len,
+                          const regex_t* regex);
+bool word_counts_merge(struct WordCounts* counts, struct WordCounts* other);
+void word_counts_free(struct WordCounts* counts);
+
+#endif
@@ -39,7 +39,12 @@ sources = [
     "src/parser.c",
     "src/arena.c",
     "src/ac.c",
-    "src/vector.c"
+    "src/vector.c",
+    "src/unicode.c",
+    "src/stream.c",
+    "src/shard.c",
+    "src/trainer.c",
+    "src/wordcount.c"
 ]
 
 include_dirs = ["include"]
@@ -6,18 +6,22 @@
 
 #include "hutoken/helper.h"
 
-static struct ACNode* create_node(void);
-static void free_node(struct ACNode* node);
+static int add_node(struct ACAutomaton* automaton);
+static int find_child(const struct ACAutomaton* automaton,
+                      int node,
+                      unsigned char label);
+static int32_t compiled_child(const struct ACAutomaton* automaton,
+                              int32_t state,
+                              unsigned char label);
 
 struct ACAutomaton* ac_automaton_create(void) {
     struct ACAutomaton* automaton =
-        (struct ACAutomaton*)malloc(sizeof(struct ACAutomaton));
+        (struct ACAutomaton*)calloc(1, sizeof(struct ACAutomaton));
     if (!automaton) {
         log_debug("Error: Failed to allocate memory for ACAutomaton.");
         return NULL;
     }
-    automaton->root = create_node();
-    if (!automaton->root) {
+    if (add_node(automaton) != AC_ROOT) {
         free(automaton);
         return NULL;
     }
@@ -30,101 +34,279 @@ bool ac_automaton_add_string(struct ACAutomaton* automaton,
     if (!automaton || !pattern) {
         return false;
     }
-    struct ACNode* current = automaton->root;
+    int current = AC_ROOT;
     size_t len = strlen(pattern);
 
     for (size_t i = 0; i < len; ++i) {
-        unsigned char index = (unsigned char)pattern[i];
-        if (!current->children[index]) {
-            current->children[index] = create_node();
-            if (!current->children[index]) {
+        unsigned char label = (unsigned char)pattern[i];
+        int child = find_child(automaton, current, label);
+        if (child < 0) {
+            if (automaton->num_edges == automaton->edges_capacity) {
+                size_t capacity = automaton->edges_capacity
+                                      ? 2 * automaton->edges_capacity
+                                      : 64;
+                struct ACEdge* edges =
+                    realloc(automaton->edges, capacity * sizeof(struct ACEdge));
+                if (!edges) {
+                    log_debug("Error: Failed to allocate memory for AC edges.");
+                    return false;
+                }
+                automaton->edges = edges;
+                automaton->edges_capacity = capacity;
+            }
+            child = add_node(automaton);
+            if (child < 0) {
                 return false;
             }
+            int edge = (int)automaton->num_edges++;
+            automaton->edges[edge] =
+                (struct ACEdge){.label = label,
+                                .target = child,
+                                .next = automaton->nodes[current].first_edge};
+            automaton->nodes[current].first_edge = edge;
         }
-        current = current->children[index];
+        current = child;
+    }
+    automaton->nodes[current].output_value = output_value;
+    automaton->nodes[current].pattern_len = len;
+    if (len > automaton->max_pattern_len) {
+        automaton->max_pattern_len = len;
     }
-    current->output_value = output_value;
-    current->pattern_len = len;
     return true;
 }
 
+/*
+ * Compiles the trie into the automaton used for matching: every node's
+ * children sorted by label in two flat arrays, a full transition table for
+ * the root, and the failure and output links, all in one allocation. Has to
+ * be called again after adding patterns.
+ */
 void ac_automaton_build_failure_links(struct ACAutomaton* automaton) {
-    if (!automaton || !automaton->root) {
+    if (!automaton || !automaton->nodes) {
         return;
     }
 
-    struct ACNode* root = automaton->root;
-    root->failure_link = root;
-
-    struct ACNode** queue =
-        (struct ACNode**)malloc(sizeof(struct ACNode*) * AC_ALPHABET_SIZE * 4);
-    if (!queue) {
-        log_debug(
-            "Error: Failed to allocate memory for AC failure link build "
-            "queue.");
+    size_t num_states = automaton->num_nodes;
+    size_t num_edges = automaton->num_edges;
+    size_t size = num_states * sizeof(struct ACState) +
+                  (AC_ALPHABET_SIZE + num_edges) * sizeof(int32_t) + num_edges;
+    char* compiled = malloc(size);
+    int32_t* queue = malloc(num_states * sizeof(int32_t));
+    if (!compiled || !queue) {
+        log_debug("Error: Failed to allocate memory for the AC automaton.");
+        free(compiled);
+        free((void*)queue);
         return;
     }
-    int head = 0;
-    int tail = 0;
 
-    for (int i = 0; i < AC_ALPHABET_SIZE; ++i) {
-        if (root->children[i]) {
-            root->children[i]->failure_link = root;
-            queue[tail++] = root->children[i];
+    struct ACState* states = (struct ACState*)compiled;
+    int32_t* root_next = (int32_t*)(states + num_states);
+    int32_t* targets = root_next + AC_ALPHABET_SIZE;
+    unsigned char* labels = (unsigned char*)(targets + num_edges);
+
+    // Every node's children, sorted by placing its edges into a table over
+    // the whole alphabet.
+    uint32_t next_edge = 0;
+    for (size_t i = 0; i < num_states; ++i) {
+        const struct ACNode* node = &automaton->nodes[i];
+        int32_t children[AC_ALPHABET_SIZE];
+        uint32_t count = 0;
+
+        for (int e = node->first_edge; e >= 0; e = automaton->edges[e].next) {
+            count++;
         }
+        if (count > 0) {
+            memset(children, -1, sizeof(children));
+            for (int e = node->first_edge; e >= 0;
+                 e = automaton->edges[e].next) {
+                const struct ACEdge* edge = &automaton->edges[e];
+                children[edge->label] = edge->target;
+            }
+            uint32_t k = next_edge;
+            for (int c = 0; c < AC_ALPHABET_SIZE; ++c) {
+                if (children[c] >= 0) {
+                    labels[k] = (unsigned char)c;
+                    targets[k] = children[c];
+                    k++;
+                }
+            }
+        }
+
+        states[i] = (struct ACState){
+            .first_edge = next_edge,
+            .num_edges = count,
+            .failure_link = AC_ROOT,
+            .output_link = -1,
+            .output_value = node->output_value,
+            .pattern_len = (uint32_t)node->pattern_len};
+        next_edge += count;
     }
 
+    for (int c = 0; c < AC_ALPHABET_SIZE; ++c) {
+        root_next[c] = AC_ROOT;
+    }
+    size_t head = 0;
+    size_t tail = 0;
+    for (uint32_t k = 0; k < states[AC_ROOT].num_edges; ++k) {
+        int32_t child = targets[states[AC_ROOT].first_edge + k];
+        root_next[labels[states[AC_ROOT].first_edge + k]] = child;
+        queue[tail++] = child;
+    }
+
+    free(automaton->compiled);
+    automaton->compiled = compiled;
+    automaton->states = states;
+    automaton->root_next = root_next;
+    automaton->targets = targets;
+    automaton->labels = labels;
+
+    // Breadth first, so the failure links of shallower states are final.
     while (head < tail) {
-        struct ACNode* current = queue[head++];
-
-        for (int i = 0; i < AC_ALPHABET_SIZE; ++i) {
-            struct ACNode* child = current->children[i];
-            if (child) {
-                struct ACNode* failure_node = current->failure_link;
-                while (failure_node != root && !failure_node->children[i]) {
-                    failure_node = failure_node->failure_link;
-                }
+        int32_t current = queue[head++];
+        const struct ACState* state = &states[current];
 
-                if (failure_node->children[i]) {
-                    child->failure_link = failure_node->children[i];
-                } else {
-                    child->failure_link = root;
-                }
+        for (uint32_t k = 0; k < state->num_edges; ++k) {
+            int32_t child = targets[state->first_edge + k];
+            unsigned char label = labels[state->first_edge + k];
 
-                queue[tail++] = child;
-            }
+            int32_t failure = ac_automaton_next(
+                automaton, state->failure_link, label);
+            states[child].failure_link = failure;
+            // The root's output, the empty pattern, never matches.
+            states[child].output_link =
+                failure != AC_ROOT && states[failure].output_value >= 0
+                    ? failure
+                    : states[failure].output_link;
+            queue[tail++] = child;
         }
     }
     free((void*)queue);
 }
 
+/*
+ * The state after reading `byte` in `state`, following failure links where
+ * `state` has no such child.
+ */
+int32_t ac_automaton_next(const struct ACAutomaton* automaton,
+                          int32_t state,
+                          unsigned char byte) {
+    while (state != AC_ROOT) {
+        int32_t child = compiled_child(automaton, state, byte);
+        if (child >= 0) {
+            return child;
+        }
+        state = automaton->states[state].failure_link;
+    }
+    return automaton->root_next[byte];
+}
+
+/*
+ * Finds the leftmost occurrence of a pattern in `text`, the longest one if
+ * several start there, in a single pass over the text. Only patterns whose
+ * output value has a non-zero entry in `enabled` are considered, NULL enables
+ * all of them. The automaton must have been built. Returns false if there is
+ * no occurrence.
+ */
+bool ac_automaton_find(const struct ACAutomaton* automaton,
+                       const char* text,
+                       size_t len,
+                       const unsigned char* enabled,
+                       struct ACMatch* match) {
+    if (!automaton || !automaton->states) {
+        return false;
+    }
+
+    const struct ACState* states = automaton->states;
+    int32_t state = AC_ROOT;
+    bool found = false;
+
+    for (size_t i = 0; i < len; ++i) {
+        // Nothing starting at or before the match found so far ends here.
+        if (found && i >= match->start + automaton->max_pattern_len) {
+            break;
+        }
+
+        state = ac_automaton_next(automaton, state, (unsigned char)text[i]);
+
+        int32_t out = states[state].output_value >= 0
+                          ? state
+                          : states[state].output_link;
+        for (; out > AC_ROOT; out = states[out].output_link) {
+            const struct ACState* s = &states[out];
+            if (enabled && !enabled[s->output_value]) {
+                continue;
+            }
+            size_t start = i + 1 - s->pattern_len;
+            if (!found || start < match->start ||
+                (start == match->start && s->pattern_len > match->len)) {
+                match->start = start;
+                match->len = s->pattern_len;
+                match->output_value = s->output_value;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
 void ac_automaton_free(struct ACAutomaton* automaton) {
     if (!automaton) {
         return;
     }
-    free_node(automaton->root);
+    free(automaton->nodes);
+    free(automaton->edges);
+    free(automaton->compiled);
     free(automaton);
 }
 
-static struct ACNode* create_node(void) {
-    struct ACNode* node = (struct ACNode*)malloc(sizeof(struct ACNode));
-    if (!node) {
-        log_debug("Error: Failed to allocate memory for ACNode.");
-        return NULL;
+static int add_node(struct ACAutomaton* automaton) {
+    if (automaton->num_nodes == automaton->nodes_capacity) {
+        size_t capacity =
+            automaton->nodes_capacity ? 2 * automaton->nodes_capacity : 64;
+        struct ACNode* nodes =
+            realloc(automaton->nodes, capacity * sizeof(struct ACNode));
+        if (!nodes) {
+            log_debug("Error: Failed to allocate memory for ACNode.");
+            return -1;
+        }
+        automaton->nodes = nodes;
+        automaton->nodes_capacity = capacity;
     }
-    memset((void*)node->children, 0, sizeof(node->children));
-    node->failure_link = NULL;
-    node->output_value = -1;
-    node->pattern_len = 0;
+    int node = (int)automaton->num_nodes++;
+    automaton->nodes[node] = (struct ACNode){
+        .first_edge = -1, .output_value = -1, .pattern_len = 0};
     return node;
 }
 
-static void free_node(struct ACNode* node) {
-    if (!node) {
-        return;
+static int find_child(const struct ACAutomaton* automaton,
+                      int node,
+                      unsigned char label) {
+    for (int e = automaton->nodes[node].first_edge; e >= 0;
+         e = automaton->edges[e].next) {
+        if (automaton->edges[e].label == label) {
+            return automaton->edges[e].target;
+        }
+    }
+    return -1;
+}
+
+static int32_t compiled_child(const struct ACAutomaton* automaton,
+                              int32_t state,
+                              unsigned char label) {
+    const struct ACState* s = &automaton->states[state];
+    const unsigned char* labels = automaton->labels + s->first_edge;
+    uint32_t lo = 0;
+    uint32_t hi = s->num_edges;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (labels[mid] < label) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    for (int i = 0; i < AC_ALPHABET_SIZE; ++i) {
-        free_node(node->children[i]);
+    if (lo < s->num_edges && labels[lo] == label) {
+        return automaton->targets[s->first_edge + lo];
     }
-    free(node);
+    return -1;
 }
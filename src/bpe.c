@@ -1,3 +1,8 @@
+// fseeko and ftello, with a 64-bit off_t, have to be asked for before the
+// first header includes the C library's feature settings.
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
 #include "hutoken/bpe.h"
 
 #include "Python.h"
@@ -9,11 +14,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "hutoken/core.h"
 #include "hutoken/hash.h"
 #include "hutoken/hashmap.h"
 #include "hutoken/helper.h"
-#include "hutoken/parser.h"
+#include "hutoken/taskqueue.h"
+#include "hutoken/trainer.h"
+#include "hutoken/wordcount.h"
 
 uint64_t token_hash(const void* item) {
     const struct Token* token = item;
@@ -47,217 +56,916 @@ int pair_compare(const void* lhs, const void* rhs) {
              item_a->right_id == item_b->right_id);
 }
 
-void create_words(char* text,
-                  const char* pattern,
-                  struct Boundary token_boundaries[],
-                  size_t token_num) {
-    regex_t regex;
-    struct ParserState parser;
+#if defined(_WIN32) || defined(_WIN64)
+#define FILE_SEEK(file, offset) _fseeki64(file, (__int64)(offset), SEEK_SET)
+#define FILE_SIZE(file) \
+    (_fseeki64(file, 0, SEEK_END) == 0 ? _ftelli64(file) : -1)
+#else
+#define FILE_SEEK(file, offset) fseeko(file, (off_t)(offset), SEEK_SET)
+#define FILE_SIZE(file) (fseeko(file, 0, SEEK_END) == 0 ? ftello(file) : -1)
+#endif
+
+// Texts are pretokenized in pieces of at least this size on separate threads.
+static const size_t PARALLEL_COUNT_MIN_PIECE = (size_t)1024 * 1024;
+
+struct TextPiece {
+    const char* text;
+    size_t len;
+};
+
+struct CountWork {
+    struct WordCounts counts;
+    const struct TextPiece* pieces;
+    size_t num_pieces;
+    bool ok;
+};
+
+static thread_return_t count_worker(thread_arg_t arg) {
+    struct CountWork* work = arg;
+    work->ok = word_counts_init(&work->counts);
+    for (size_t i = 0; work->ok && i < work->num_pieces; i++) {
+        work->ok = word_counts_add_text(&work->counts, work->pieces[i].text,
+                                        work->pieces[i].len, NULL);
+    }
+    return 0;
+}
 
-    if (pattern != NULL) {
-        if (regcomp(&regex, pattern, REG_EXTENDED) == true) {
-            (void)fputs("Regex could not be compiled.", stderr);
-            PyErr_SetString(PyExc_RuntimeError, "Regex could not be compiled.");
-            return;
+/*
+ * Counts the pretokens of every piece, each piece a text of its own, on up
+ * to `num_threads` threads taking a run of consecutive pieces each. The
+ * counts of the runs are merged in order.
+ */
+static bool count_pieces(struct WordCounts* counts,
+                         const struct TextPiece* pieces,
+                         size_t num_pieces,
+                         int num_threads) {
+    size_t num_works = num_pieces;
+    if (num_works > (size_t)num_threads) {
+        num_works = num_threads;
+    }
+    struct CountWork* works = NULL;
+    thread_t* threads = NULL;
+    if (num_works > 1) {
+        works = calloc(num_works, sizeof(struct CountWork));
+        threads = malloc(num_works * sizeof(thread_t));
+    }
+    if (!works || !threads) {
+        free(works);
+        free(threads);
+        for (size_t i = 0; i < num_pieces; i++) {
+            if (!word_counts_add_text(counts, pieces[i].text, pieces[i].len,
+                                      NULL)) {
+                return false;
+            }
         }
-    } else {
-        parser = parser_init(text);
+        return true;
     }
 
-    regmatch_t match;
-    char* cursor = text;
-    int i = 0;
-    struct TokenSlice word;
+    size_t start = 0;
+    for (size_t i = 0; i < num_works; i++) {
+        size_t end = num_pieces * (i + 1) / num_works;
+        works[i] = (struct CountWork){.pieces = pieces + start,
+                                      .num_pieces = end - start};
+        start = end;
+    }
 
-    while (true) {
-        int word_start = 0;
-        int word_end = 0;
-        if (pattern != NULL) {
-            if (regexec(&regex, cursor, 1, &match, 0) != 0) {
-                break;
-            }
+    for (size_t i = 0; i < num_works; i++) {
+        THREAD_CREATE(&threads[i], count_worker, &works[i]);
+    }
+    for (size_t i = 0; i < num_works; i++) {
+        THREAD_JOIN(threads[i]);
+    }
 
-            word_start = match.rm_so;
-            word_end = match.rm_eo;
-        } else {
-            if (parser_next_token(&parser, &word) == false) {
-                break;
-            }
+    bool ok = true;
+    for (size_t i = 0; i < num_works; i++) {
+        ok = ok && works[i].ok && word_counts_merge(counts, &works[i].counts);
+        word_counts_free(&works[i].counts);
+    }
+    free(works);
+    free(threads);
+    return ok;
+}
 
-            word_start = word.start - cursor;
-            word_end = word_start + word.length;
-        }
+/*
+ * Counts the pretokens of the text, split at the positions returned by
+ * `encode_find_split` into pieces that are counted on up to `num_threads`
+ * threads. The counts of the pieces add up to the counts of the whole text.
+ */
+static bool count_words(struct WordCounts* counts,
+                        const char* text,
+                        size_t len,
+                        int num_threads) {
+    size_t num_pieces = len / PARALLEL_COUNT_MIN_PIECE;
+    if (num_pieces > (size_t)num_threads) {
+        num_pieces = num_threads;
+    }
+    if (num_pieces <= 1) {
+        return word_counts_add_text(counts, text, len, NULL);
+    }
 
-        for (char* ptr = cursor + word_start; ptr < cursor + word_end; ptr++) {
-            char* start = ptr;
-            char* end = ptr;
+    struct TextPiece* pieces = malloc(num_pieces * sizeof(struct TextPiece));
+    if (!pieces) {
+        return word_counts_add_text(counts, text, len, NULL);
+    }
 
-            struct Boundary token_boundary = {.start = start, .end = end};
+    size_t piece_size = len / num_pieces;
+    size_t start = 0;
+    size_t count = 0;
+    while (start < len && count < num_pieces) {
+        size_t end = count == num_pieces - 1
+                         ? len
+                         : encode_find_split(text, len, start + piece_size);
+        pieces[count] = (struct TextPiece){.text = text + start,
+                                           .len = end - start};
+        start = end;
+        count++;
+    }
 
-            token_boundaries[i] = token_boundary;
-            i += 1;
-        }
-        cursor += word_end;
+    bool ok = count_pieces(counts, pieces, count, num_threads);
+    free(pieces);
+    return ok;
+}
+
+/*
+ * Counts the distinct pretokens of the text, the matches of `pattern` if
+ * there is one, and adds them to the trainer as words weighted by their
+ * count, so pairs are never counted across them.
+ */
+bool bpe_add_words(struct Trainer* trainer,
+                   const char* text,
+                   const char* pattern,
+                   int num_threads) {
+    regex_t regex;
+    if (pattern != NULL && regcomp(&regex, pattern, REG_EXTENDED) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Regex could not be compiled.");
+        return false;
+    }
+
+    struct WordCounts counts;
+    size_t len = strlen(text);
+    bool ok = word_counts_init(&counts) &&
+              (pattern != NULL
+                   ? word_counts_add_text(&counts, text, len, &regex)
+                   : count_words(&counts, text, len, num_threads)) &&
+              trainer_add_word_counts(trainer, &counts);
+    if (!ok) {
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to collect the words to train on.");
     }
+    log_debug("Training on %zu distinct words out of %lld.",
+              trainer->num_words, (long long)counts.total);
 
+    word_counts_free(&counts);
     if (pattern != NULL) {
         regfree(&regex);
     }
+    return ok;
 }
 
-void bpe_train_core(struct HashMap* vocab,
-                    char* text,
-                    struct Boundary token_boundaries[],
-                    size_t token_num,
-                    size_t vocab_size) {
-    size_t token_n = token_num;
-    struct Token prev_common_pair = {.key = NULL, .value = -1};
-    struct Token most_common_pair = {.key = NULL, .value = -1};
+/*
+ * Writes the merges learned so far to `path` in the order they were learned,
+ * which is their rank, one per line as the hex bytes of the left and the
+ * right token, like the keys of a saved vocabulary. The first line tells the
+ * loader that the tokens are hex.
+ */
+static bool save_merges(const struct Trainer* trainer, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return false;
+    }
+
+    (void)fprintf(file, "%s\n", MERGES_HEX_HEADER);
+    for (size_t i = 0; i < trainer->num_merges; i++) {
+        const struct TrainerMerge* merge = &trainer->merges[i];
+        const char* sides[2] = {trainer->tokens[merge->left],
+                                trainer->tokens[merge->right]};
+        for (int side = 0; side < 2; side++) {
+            const char* ptr = sides[side];
+            if (*ptr == '\0') {
+                (void)fprintf(file, "0x00");
+            }
+            for (; *ptr != '\0'; ptr++) {
+                (void)fprintf(file, "0x%02X", (unsigned char)*ptr);
+            }
+            (void)fputc(side == 0 ? ' ' : '\n', file);
+        }
+    }
 
-    while (vocab->count < vocab_size) {
-        struct HashMap* stats = hashmap_new(token_n, sizeof(struct Token),
-                                            token_hash, token_compare);
+    bool ok = !ferror(file);
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    }
+    return ok;
+}
 
-        // This check prevents undefined behavior. If the number of tokens is
-        // reduced to < 2, the next loop iteration would attempt to declare
-        // a zero-sized VLA, which is illegal in C.
-        if (token_n < 2) {
+// Returns `name` with _<size> inserted before its extension, if it has one,
+// or NULL with a MemoryError set.
+static char* sized_file_name(const char* name, int size) {
+    const char* base = strrchr(name, '/');
+    const char* dot = strrchr(base ? base : name, '.');
+    size_t stem_len = dot ? (size_t)(dot - name) : strlen(name);
+    size_t len = strlen(name) + 32;
+    char* file_name = malloc(len);
+    if (!file_name) {
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to allocate memory for the file name.");
+        return NULL;
+    }
+    (void)snprintf(file_name, len, "%.*s_%d%s", (int)stem_len, name, size,
+                   dot ? dot : "");
+    return file_name;
+}
+
+/*
+ * Saves the vocabulary, and the merges if `merges_file_path` is not NULL,
+ * for every size from `*next` on that the trainer has reached, or for all of
+ * them once training is `done`, since no more merges are coming. A size that
+ * was not reached then gets the vocabulary training ended with, and a
+ * RuntimeWarning tells its actual size. Advances `*next` past the saved
+ * sizes.
+ */
+bool bpe_save_reached_vocabs(struct Trainer* trainer,
+                             const struct VocabSizes* vocab_sizes,
+                             const char* vocab_file_name,
+                             const char* merges_file_path,
+                             size_t* next,
+                             bool done) {
+    for (; *next < vocab_sizes->count; ++*next) {
+        int size = vocab_sizes->sizes[*next];
+        if (!done && trainer->num_tokens < (size_t)size) {
             break;
         }
+        if (trainer->num_tokens < (size_t)size &&
+            PyErr_WarnFormat(PyExc_RuntimeWarning, 1,
+                             "The corpus ran out of pairs to merge at %zu "
+                             "tokens, vocabulary size %d was not reached.",
+                             trainer->num_tokens, size) < 0) {
+            return false;
+        }
+        if (vocab_sizes->count == 1) {
+            if (save_vocab(trainer->vocab, (char*)vocab_file_name) !=
+                    EXIT_SUCCESS ||
+                (merges_file_path && !save_merges(trainer, merges_file_path))) {
+                return false;
+            }
+            continue;
+        }
 
-        // find most common pair -> next token
+        char* file_name = sized_file_name(vocab_file_name, size);
+        if (!file_name) {
+            return false;
+        }
+        bool saved = save_vocab(trainer->vocab, file_name) == EXIT_SUCCESS;
+        free(file_name);
+        if (!saved) {
+            return false;
+        }
+
+        if (merges_file_path) {
+            file_name = sized_file_name(merges_file_path, size);
+            bool ok = file_name && save_merges(trainer, file_name);
+            free(file_name);
+            if (!ok) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
 
-        for (size_t i = 0; i < token_num - 1; i++) {
-            char* s1 = token_boundaries[i].start;
-            char* e1 = token_boundaries[i].end;
-            ptrdiff_t l1 = (e1 - s1) + 1;
+static double progress_clock(void) {
+    struct timespec now;
+    if (timespec_get(&now, TIME_UTC) != TIME_UTC) {
+        return 0.0;
+    }
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
 
-            char* s2 = token_boundaries[i + 1].start;
-            char* e2 = token_boundaries[i + 1].end;
-            ptrdiff_t l2 = (e2 - s2) + 1;
+// Starts the clock of the progress reports, if there is a hook.
+void bpe_start_progress(const struct Trainer* trainer,
+                        struct TrainProgressHook* progress) {
+    if (!progress || !progress->report) {
+        return;
+    }
+    progress->start_seconds = progress_clock();
+    progress->last_seconds = progress->start_seconds;
+    progress->last_merges = trainer->num_merges;
+}
 
-            ptrdiff_t len = l1 + l2;
-            char pair[len + 1];
+/*
+ * Reports the progress to the hook every `every` merges, and once training
+ * is `done`. Without a hook nothing is measured. Returns false if the hook
+ * fails, which stops training with the hook's error set.
+ */
+bool bpe_report_progress(const struct Trainer* trainer,
+                         struct TrainProgressHook* progress,
+                         bool done) {
+    if (!progress || !progress->report) {
+        return true;
+    }
+    if (!done && (progress->every == 0 ||
+                  trainer->num_merges % progress->every != 0)) {
+        return true;
+    }
 
-            strncpy(pair, s1, l1);
-            strncpy(pair + l1, s2, l2);
-            pair[len] = '\0';
+    double now = progress_clock();
+    double interval = now - progress->last_seconds;
+    size_t merges = trainer->num_merges - progress->last_merges;
+    struct TrainProgress report = {
+        .num_merges = trainer->num_merges,
+        .vocab_size = trainer->num_tokens,
+        .pair_count = trainer->num_merges > 0
+                          ? trainer->merges[trainer->num_merges - 1].count
+                          : 0,
+        .elapsed_seconds = now - progress->start_seconds,
+        .merges_per_second = interval > 0.0 ? (double)merges / interval : 0.0,
+        .memory_bytes = trainer_memory_usage(trainer),
+        .done = done};
+    progress->last_seconds = now;
+    progress->last_merges = trainer->num_merges;
+    return progress->report(&report, progress->data);
+}
 
-            struct Token* found =
-                hashmap_get(stats, &(struct Token){.key = pair});
-            if (found != NULL) {
-                found->value++;
-            } else {
-                hashmap_set(stats,
-                            &(struct Token){.key = strdup(pair), .value = 1});
-            }
+/*
+ * Writes a checkpoint of the trainer every `checkpoint->every` merges, if
+ * there is a checkpoint path. It is written next to the path first and then
+ * renamed, so a run stopped while writing leaves the previous one intact.
+ */
+bool bpe_save_checkpoint(const struct Trainer* trainer,
+                         const struct TrainCheckpoint* checkpoint) {
+    if (!checkpoint || !checkpoint->path || checkpoint->every == 0 ||
+        trainer->num_merges % checkpoint->every != 0) {
+        return true;
+    }
 
-            struct Token* current_pair =
-                hashmap_get(stats, &(struct Token){.key = pair});
+    size_t len = strlen(checkpoint->path) + sizeof(".tmp");
+    char* tmp_path = malloc(len);
+    if (!tmp_path) {
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to allocate memory for the file name.");
+        return false;
+    }
+    (void)snprintf(tmp_path, len, "%s.tmp", checkpoint->path);
 
-            if (current_pair && current_pair->value > most_common_pair.value) {
-                if (most_common_pair.key != NULL) {
-                    free(most_common_pair.key);
-                }
-                most_common_pair.value = current_pair->value;
-                most_common_pair.key = strdup(current_pair->key);
-            }
+    FILE* file = fopen(tmp_path, "wb");
+    bool ok = file != NULL && trainer_write_checkpoint(trainer, file);
+    if (file != NULL && fclose(file) != 0) {
+        ok = false;
+    }
+#if defined(_WIN32) || defined(_WIN64)
+    if (ok) {
+        (void)remove(checkpoint->path);
+    }
+#endif
+    if (ok && rename(tmp_path, checkpoint->path) == 0) {
+        log_debug("Checkpoint of %zu merges saved to %s.", trainer->num_merges,
+                  checkpoint->path);
+    } else {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, tmp_path);
+        ok = false;
+    }
+    free(tmp_path);
+    return ok;
+}
+
+// Restores the trainer from a checkpoint instead of adding words to it.
+bool bpe_resume(struct Trainer* trainer, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return false;
+    }
+    bool ok = trainer_read_checkpoint(trainer, file);
+    if (!ok && trainer->oom) {
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to allocate memory for the checkpoint.");
+    } else if (!ok && ferror(file)) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    } else if (!ok) {
+        PyErr_Format(PyExc_ValueError, "'%s' is not a valid checkpoint.",
+                     path);
+    } else {
+        log_debug("Resuming from %zu merges and %zu words of %s.",
+                  trainer->num_merges, trainer->num_words, path);
+    }
+    (void)fclose(file);
+    return ok;
+}
+
+/*
+ * The index of the first size a training resumed by `checkpoint` has to
+ * save. The run that wrote it has saved the sizes it had reached.
+ */
+size_t bpe_first_unsaved_size(const struct Trainer* trainer,
+                              const struct VocabSizes* vocab_sizes,
+                              const struct TrainCheckpoint* checkpoint) {
+    size_t next = 0;
+    if (checkpoint && checkpoint->resume_from) {
+        while (next < vocab_sizes->count &&
+               (size_t)vocab_sizes->sizes[next] <= trainer->num_tokens) {
+            next++;
         }
+    }
+    return next;
+}
 
-        // WARNING: vocab->count is a size_t. If it exceeds INT_MAX, this
-        // assignment will overflow, causing token to become negative. The
-        // Token.value field should ideally be changed to size_t to
-        // support larger vocabs.
-        int token = (int)(vocab->count + 1);
+// Merges the most frequent pairs of the words added to the trainer until the
+// largest vocabulary is full or no pair is left, saving the vocabulary at
+// every size on the way, along with its merges if `merges_file_path` is not
+// NULL, checkpoints as `checkpoint` asks, and reports its progress to the
+// hook, if there is one. The count of the last merge, the smallest one, is
+// stored in `min_merge_count`.
+static bool train_words(struct Trainer* trainer,
+                        const struct VocabSizes* vocab_sizes,
+                        char* vocab_file_name,
+                        const char* merges_file_path,
+                        const struct TrainCheckpoint* checkpoint,
+                        struct TrainProgressHook* progress,
+                        int64_t* min_merge_count) {
+    if (!trainer_count_pairs(trainer)) {
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to allocate memory for training.");
+        return false;
+    }
 
-        // add new token
+    size_t max_size = vocab_sizes->sizes[vocab_sizes->count - 1];
+    size_t next = bpe_first_unsaved_size(trainer, vocab_sizes, checkpoint);
+    struct TrainerMerge merge;
+    *min_merge_count = trainer->num_merges > 0
+                           ? trainer->merges[trainer->num_merges - 1].count
+                           : 0;
+    bpe_start_progress(trainer, progress);
+    bool ok = bpe_save_reached_vocabs(trainer, vocab_sizes, vocab_file_name,
+                                      merges_file_path, &next, false);
+    while (ok && trainer->num_tokens < max_size &&
+           trainer_merge_next(trainer, 1, &merge)) {
+        *min_merge_count = merge.count;
+        ok = bpe_save_reached_vocabs(trainer, vocab_sizes, vocab_file_name,
+                                     merges_file_path, &next, false) &&
+             bpe_save_checkpoint(trainer, checkpoint) &&
+             bpe_report_progress(trainer, progress, false);
+    }
+    if (trainer->oom) {
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to allocate memory for training.");
+        return false;
+    }
 
-        hashmap_set(vocab, &(struct Token){.key = most_common_pair.key,
-                                           .value = token});
+    return ok &&
+           bpe_save_reached_vocabs(trainer, vocab_sizes, vocab_file_name,
+                                   merges_file_path, &next, true) &&
+           bpe_report_progress(trainer, progress, true);
+}
 
-        // merge that most common pair in all tokens, i.e.
-        // update token boundaries for the new token everywhere
+bool bpe_train(char* text,
+               const struct VocabSizes* vocab_sizes,
+               const char* pattern,
+               char* vocab_file_name,
+               const char* merges_file_path,
+               const struct TrainCheckpoint* checkpoint,
+               struct TrainProgressHook* progress,
+               int num_threads) {
+    struct Trainer trainer;
+
+    if (!trainer_init(&trainer)) {
+        trainer_free(&trainer);
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to allocate memory for training.");
+        return false;
+    }
+    trainer.num_threads = num_threads;
+    int64_t min_merge_count = 0;
+    bool ok = (checkpoint && checkpoint->resume_from
+                   ? bpe_resume(&trainer, checkpoint->resume_from)
+                   : bpe_add_words(&trainer, text, pattern, num_threads)) &&
+              train_words(&trainer, vocab_sizes, vocab_file_name,
+                          merges_file_path, checkpoint, progress,
+                          &min_merge_count);
+
+    trainer_free(&trainer);
+    return ok;
+}
+
+// Trains on words already counted, e.g. by a `WordStream`, or on the words
+// of the checkpoint to resume from, if there is one.
+bool bpe_train_word_counts(struct WordCounts* counts,
+                           const struct VocabSizes* vocab_sizes,
+                           char* vocab_file_name,
+                           const char* merges_file_path,
+                           const struct TrainCheckpoint* checkpoint,
+                           struct TrainProgressHook* progress,
+                           int num_threads,
+                           int64_t* min_merge_count) {
+    struct Trainer trainer;
+
+    if (!trainer_init(&trainer)) {
+        trainer_free(&trainer);
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to allocate memory for training.");
+        return false;
+    }
+    if (checkpoint && checkpoint->resume_from) {
+        if (!bpe_resume(&trainer, checkpoint->resume_from)) {
+            trainer_free(&trainer);
+            return false;
+        }
+    } else if (!trainer_add_word_counts(&trainer, counts)) {
+        trainer_free(&trainer);
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to allocate memory for training.");
+        return false;
+    } else {
+        log_debug("Training on %zu distinct words out of %lld.",
+                  trainer.num_words, (long long)counts->total);
+    }
+    trainer.num_threads = num_threads;
+    bool ok = train_words(&trainer, vocab_sizes, vocab_file_name,
+                          merges_file_path, checkpoint, progress,
+                          min_merge_count);
 
-        int j = 0;
-        struct Boundary new_token_boundaries[token_n];
+    trainer_free(&trainer);
+    return ok;
+}
 
-        for (size_t i = 0; i < token_n - 1; i++) {
-            char* s1 = token_boundaries[i].start;
-            char* e1 = token_boundaries[i].end;
-            ptrdiff_t l1 = (e1 - s1) + 1;
+static const size_t WORD_STREAM_INITIAL_CAPACITY = 4096;
 
-            char* s2 = token_boundaries[i + 1].start;
-            char* e2 = token_boundaries[i + 1].end;
-            ptrdiff_t l2 = (e2 - s2) + 1;
+bool word_stream_init(struct WordStream* stream,
+                      const char* pattern,
+                      int num_threads) {
+    *stream = (struct WordStream){.num_threads = num_threads};
+    if (pattern != NULL) {
+        if (regcomp(&stream->regex, pattern, REG_EXTENDED) != 0) {
+            PyErr_SetString(PyExc_RuntimeError, "Regex could not be compiled.");
+            return false;
+        }
+        stream->has_regex = true;
+    }
 
-            ptrdiff_t len = l1 + l2;
-            char pair[len + 1];
+    stream->pending = malloc(WORD_STREAM_INITIAL_CAPACITY);
+    if (!stream->pending || !word_counts_init(&stream->counts)) {
+        word_stream_free(stream);
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to allocate memory for counting words.");
+        return false;
+    }
+    stream->pending_capacity = WORD_STREAM_INITIAL_CAPACITY;
+    stream->pending[0] = '\0';
+    return true;
+}
 
-            strncpy(pair, s1, l1);
-            strncpy(pair + l1, s2, l2);
-            pair[len] = '\0';
+void word_stream_free(struct WordStream* stream) {
+    word_counts_free(&stream->counts);
+    if (stream->has_regex) {
+        regfree(&stream->regex);
+    }
+    free(stream->pending);
+    *stream = (struct WordStream){0};
+}
 
-            if (most_common_pair.key != NULL &&
-                strcmp(pair, most_common_pair.key) == 0) {
-                struct Boundary new_token_boundary = {.start = s1, .end = e2};
-                new_token_boundaries[j] = new_token_boundary;
-                j++;
-                i++;
-            } else {
-                new_token_boundaries[j] = token_boundaries[i];
-                j++;
-            }
+// Counts the first `len` pending bytes and drops them from the buffer.
+static bool count_pending(struct WordStream* stream, size_t len) {
+    char* text = stream->pending;
+    bool ok = false;
+    if (stream->has_regex) {
+        char saved = text[len];
+        text[len] = '\0';
+        ok = word_counts_add_text(&stream->counts, text, len, &stream->regex);
+        text[len] = saved;
+    } else {
+        ok = count_words(&stream->counts, text, len, stream->num_threads);
+    }
+    if (!ok) {
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to allocate memory for counting words.");
+        return false;
+    }
+
+    stream->pending_len -= len;
+    memmove(text, text + len, stream->pending_len);
+    text[stream->pending_len] = '\0';
+    return true;
+}
+
+/*
+ * Appends a chunk and counts everything up to the last position where a new
+ * pretoken is sure to start, or the last line break with a custom pattern.
+ * The pending text never holds such a position past its first byte, so only
+ * the new bytes are searched.
+ */
+bool word_stream_feed(struct WordStream* stream,
+                      const char* chunk,
+                      size_t chunk_len) {
+    size_t needed = stream->pending_len + chunk_len + 1;
+    if (needed > stream->pending_capacity) {
+        size_t new_capacity = stream->pending_capacity * 2;
+        if (new_capacity < needed) {
+            new_capacity = needed;
+        }
+        char* new_pending = realloc(stream->pending, new_capacity);
+        if (!new_pending) {
+            PyErr_SetString(PyExc_MemoryError,
+                            "Failed to grow the word stream buffer.");
+            return false;
         }
+        stream->pending = new_pending;
+        stream->pending_capacity = new_capacity;
+    }
+
+    size_t start = stream->pending_len;
+    memcpy(stream->pending + start, chunk, chunk_len);
+    stream->pending_len += chunk_len;
+    stream->pending[stream->pending_len] = '\0';
 
-        for (int k = 0; k < j; k++) {
-            token_boundaries[k] = new_token_boundaries[k];
+    size_t split = 0;
+    if (stream->has_regex) {
+        for (size_t i = stream->pending_len; i > start; --i) {
+            if (stream->pending[i - 1] == '\n') {
+                split = i;
+                break;
+            }
         }
-        token_n = j;
+    } else {
+        size_t base = start > 0 ? start - 1 : 0;
+        split = encode_find_last_split(stream->pending + base,
+                                       stream->pending_len - base);
+        split = split > 0 ? base + split : 0;
+    }
+    if (split == 0) {
+        return true;
+    }
+    return count_pending(stream, split);
+}
+
+// Counts whatever is left, the end of the text. The stream can be fed a new
+// text afterwards, whose words are added to the same counts.
+bool word_stream_finish(struct WordStream* stream) {
+    if (stream->pending_len == 0) {
+        return true;
+    }
+    return count_pending(stream, stream->pending_len);
+}
 
-        visualize_bpe_train(most_common_pair, token_n);
+/*
+ * Feeds the file in blocks of a piece per thread and finishes it, so no word
+ * spans two files. Only a block and the pending text are held in memory,
+ * however large the file is.
+ */
+bool word_stream_feed_file(struct WordStream* stream, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return false;
+    }
 
-        hashmap_free(stats);
+    int num_threads = stream->num_threads > 0 ? stream->num_threads : 1;
+    size_t block_size = PARALLEL_COUNT_MIN_PIECE * num_threads;
+    char* block = malloc(block_size);
+    if (!block) {
+        fclose(file);
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to allocate memory for reading the file.");
+        return false;
+    }
 
-        if (prev_common_pair.key != NULL &&
-            strcmp(prev_common_pair.key, most_common_pair.key) == 0) {
-            break;
+    bool ok = true;
+    size_t read = 0;
+    while (ok && (read = fread(block, 1, block_size, file)) > 0) {
+        ok = word_stream_feed(stream, block, read);
+    }
+    if (ok && ferror(file)) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        ok = false;
+    }
+    ok = ok && word_stream_finish(stream);
+    log_debug("Counted %s, %lld words so far.", path,
+              (long long)stream->counts.total);
+
+    free(block);
+    fclose(file);
+    return ok;
+}
+
+// Blocks of this size are the unit of sampling, read a piece per thread at a
+// time.
+static const size_t SAMPLE_BLOCK_SIZE = (size_t)64 * 1024;
+
+static uint64_t sample_next(uint64_t* state) {
+    uint64_t x = (*state += 0x9e3779b97f4a7c15);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+static bool file_size(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return false;
+    }
+    int64_t end = FILE_SIZE(file);
+    fclose(file);
+    if (end < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return false;
+    }
+    *size = (size_t)end;
+    return true;
+}
+
+/*
+ * Trims a block read from the middle of a file to the text between the first
+ * and the last position where a new pretoken is sure to start, or between
+ * line breaks with a custom pattern, so no word is cut in two. Returns false
+ * if nothing is left.
+ */
+static bool trim_block(const struct WordStream* stream,
+                       char* block,
+                       size_t len,
+                       bool file_start,
+                       bool file_end,
+                       struct TextPiece* piece) {
+    size_t start = 0;
+    size_t end = len;
+    if (stream->has_regex) {
+        if (!file_start) {
+            const char* line_end = memchr(block, '\n', len);
+            start = line_end ? (size_t)(line_end - block) + 1 : len;
+        }
+        while (!file_end && end > start && block[end - 1] != '\n') {
+            end--;
+        }
+    } else {
+        if (!file_start) {
+            start = encode_find_split(block, len, 0);
+        }
+        if (!file_end) {
+            end = encode_find_last_split(block, len);
         }
+    }
+    if (start >= end) {
+        return false;
+    }
 
-        prev_common_pair.key = most_common_pair.key;
-        prev_common_pair.value = most_common_pair.value;
+    block[end] = '\0';
+    *piece = (struct TextPiece){.text = block + start, .len = end - start};
+    return true;
+}
 
-        most_common_pair.value = -1;
-        most_common_pair.key = NULL;
+static bool count_sampled(struct WordStream* stream,
+                          const struct TextPiece* pieces,
+                          size_t num_pieces) {
+    bool ok = true;
+    if (stream->has_regex) {
+        for (size_t i = 0; ok && i < num_pieces; i++) {
+            ok = word_counts_add_text(&stream->counts, pieces[i].text,
+                                      pieces[i].len, &stream->regex);
+        }
+    } else {
+        ok = count_pieces(&stream->counts, pieces, num_pieces,
+                          stream->num_threads);
+    }
+    if (!ok) {
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to allocate memory for counting words.");
     }
+    return ok;
 }
 
-void bpe_train(char* text,
-               const int vocab_size,
-               const char* pattern,
-               char* vocab_file_name) {
-    char* k = NULL;
-    struct HashMap* vocab = hashmap_new(vocab_size, sizeof(struct Token),
-                                        token_hash, token_compare);
+/*
+ * Picks `num_sampled` of the blocks of the file uniformly at random, in file
+ * order, and counts them in batches of `batch_size` blocks. The blocks that
+ * are not picked are never read.
+ */
+static bool sample_file(struct WordStream* stream,
+                        const char* path,
+                        size_t size,
+                        size_t num_sampled,
+                        uint64_t seed,
+                        char* buffer,
+                        struct TextPiece* pieces,
+                        size_t batch_size,
+                        size_t* sampled_bytes) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return false;
+    }
 
-    // add tokens for each individual byte value
-    for (int i = 0; i < 256; i++) {
-        char key[2];
-        key[0] = (char)i;  // store ascii character
-        key[1] = '\0';
+    size_t num_blocks = (size + SAMPLE_BLOCK_SIZE - 1) / SAMPLE_BLOCK_SIZE;
+    size_t num_pieces = 0;
+    size_t num_read = 0;
+    bool ok = true;
+    for (size_t b = 0; ok && b < num_blocks && num_sampled > 0; b++) {
+        // Selection sampling, every block is picked with the same chance.
+        double u = (double)(sample_next(&seed) >> 11) * 0x1.0p-53;
+        if ((double)(num_blocks - b) * u >= (double)num_sampled) {
+            continue;
+        }
+        num_sampled--;
+
+        char* block = buffer + num_read * (SAMPLE_BLOCK_SIZE + 1);
+        size_t offset = b * SAMPLE_BLOCK_SIZE;
+        size_t len = 0;
+        if (FILE_SEEK(file, offset) == 0) {
+            len = fread(block, 1, SAMPLE_BLOCK_SIZE, file);
+        }
+        if (len == 0 || ferror(file)) {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+            ok = false;
+            break;
+        }
+        *sampled_bytes += len;
+        num_read++;
+        if (trim_block(stream, block, len, offset == 0, offset + len >= size,
+                       &pieces[num_pieces])) {
+            num_pieces++;
+        }
 
-        k = strdup(key);
-        hashmap_set(vocab, &(struct Token){.key = k, .value = i});
+        if (num_read == batch_size) {
+            ok = count_sampled(stream, pieces, num_pieces);
+            num_pieces = 0;
+            num_read = 0;
+        }
     }
+    ok = ok && count_sampled(stream, pieces, num_pieces);
 
-    size_t token_num = strlen(text);
-    struct Boundary token_boundaries[token_num];
+    fclose(file);
+    return ok;
+}
 
-    create_words(text, pattern, token_boundaries, token_num);
+/*
+ * Counts a sample of about `sample->max_bytes` bytes of the files, every file
+ * sampled at the same rate, so the counts are those of the whole input scaled
+ * down. Files whose share covers all of their blocks are counted whole.
+ */
+bool word_stream_sample_files(struct WordStream* stream,
+                              const char* const* paths,
+                              size_t num_paths,
+                              struct TrainSample* sample) {
+    size_t* sizes = malloc((num_paths > 0 ? num_paths : 1) * sizeof(size_t));
+    if (!sizes) {
+        PyErr_NoMemory();
+        return false;
+    }
+    sample->total_bytes = 0;
+    sample->sampled_bytes = 0;
+    for (size_t i = 0; i < num_paths; i++) {
+        if (!file_size(paths[i], &sizes[i])) {
+            free(sizes);
+            return false;
+        }
+        sample->total_bytes += sizes[i];
+    }
 
-    bpe_train_core(vocab, text, token_boundaries, token_num, vocab_size);
+    bool sampled = sample->max_bytes > 0 &&
+                   sample->max_bytes < sample->total_bytes;
+    int num_threads = stream->num_threads > 0 ? stream->num_threads : 1;
+    size_t batch_size = (size_t)num_threads * PARALLEL_COUNT_MIN_PIECE /
+                        SAMPLE_BLOCK_SIZE;
+    char* buffer =
+        sampled ? malloc(batch_size * (SAMPLE_BLOCK_SIZE + 1)) : NULL;
+    struct TextPiece* pieces =
+        sampled ? malloc(batch_size * sizeof(struct TextPiece)) : NULL;
+    if (sampled && (!buffer || !pieces)) {
+        free(sizes);
+        free(buffer);
+        free(pieces);
+        PyErr_NoMemory();
+        return false;
+    }
 
-    save_vocab(vocab, vocab_file_name);
+    // The share of each file is rounded so that the shares add up to the
+    // budget.
+    double rate = sampled ? (double)sample->max_bytes /
+                                (double)sample->total_bytes
+                          : 1.0;
+    double wanted = 0.0;
+    size_t picked = 0;
+    bool ok = true;
+    for (size_t i = 0; ok && i < num_paths; i++) {
+        size_t num_blocks =
+            (sizes[i] + SAMPLE_BLOCK_SIZE - 1) / SAMPLE_BLOCK_SIZE;
+        wanted += rate * (double)num_blocks;
+        size_t share = (size_t)(wanted + 0.5) - picked;
+        picked += share;
+        if (share >= num_blocks) {
+            ok = word_stream_feed_file(stream, paths[i]);
+            sample->sampled_bytes += sizes[i];
+        } else {
+            uint64_t seed = sample->seed ^ (i * 0xd1b54a32d192ed03);
+            ok = sample_file(stream, paths[i], sizes[i], share, seed, buffer,
+                             pieces, batch_size, &sample->sampled_bytes);
+        }
+    }
+    log_debug("Sampled %zu bytes out of %zu.", sample->sampled_bytes,
+              sample->total_bytes);
 
-    hashmap_free(vocab);
-    free(k);
+    free(sizes);
+    free(buffer);
+    free(pieces);
+    return ok;
 }
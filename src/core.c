@@ -15,6 +15,7 @@
 #include <string.h>
 #include <time.h>
 
+#include "hutoken/ac.h"
 #include "hutoken/arena.h"
 #include "hutoken/hashmap.h"
 #include "hutoken/helper.h"
@@ -22,10 +23,19 @@
 #include "hutoken/pretokenizer.h"
 #include "hutoken/queue.h"
 #include "hutoken/taskqueue.h"
+#include "hutoken/unicode.h"
 #include "hutoken/vector.h"
 
 static const size_t FIXED_ARENA_SIZE = (size_t)16 * 1024 * 1024;
 static const size_t BPE_ARENA_MULTIPLIER = 64;
+// Decoded tokens up to this length are copied with a fixed-size memcpy.
+static const size_t DECODE_OVERCOPY = 16;
+static char* const BPE_ALLOC_ERROR_MSG =
+    "Memory allocation failed while encoding a word.";
+char* const ENCODE_DISALLOWED_SPECIAL_MSG =
+    "Encountered text corresponding to a disallowed special token.";
+// The message of Python's own ValueError for such strings.
+char* const ENCODE_NUL_CHARACTER_MSG = "embedded null character";
 
 struct TokenNode {
     int prev;
@@ -63,7 +73,9 @@ static int get_pair_rank_from_ids(const struct HashMap* merges_map,
                                   const int left_id,
                                   const int right_id);
 
-void bpe_encode_arena_string(struct Arena* arena,
+// `tokens` may be NULL, then only `token_num` is updated and the vocabulary
+// lookups of the final tokens are skipped.
+bool bpe_encode_arena_string(struct Arena* arena,
                              struct HashMap* vocab,
                              struct Boundary token_boundaries[],
                              int tokens[],
@@ -71,7 +83,7 @@ void bpe_encode_arena_string(struct Arena* arena,
     struct MinPQ pq;
     if (min_pq_init_arena(arena, &pq, *token_num) != MIN_PQ_SUCCESS) {
         log_debug("Failed to initialize priority queue.");
-        return;
+        return false;
     }
 
     // Before using the min-priority queue, we use a linked list to track the
@@ -83,7 +95,7 @@ void bpe_encode_arena_string(struct Arena* arena,
     bool* consumed = arena_alloc(arena, *token_num * sizeof(bool));
     if (!nodes || !consumed) {
         log_debug("Failed to allocate memory for token nodes.");
-        return;
+        return false;
     }
 
     memset(consumed, 0, *token_num * sizeof(bool));
@@ -103,7 +115,7 @@ void bpe_encode_arena_string(struct Arena* arena,
 
             if (min_pq_push_arena(arena, &pq, candidate) != MIN_PQ_SUCCESS) {
                 log_debug("Failed to push to queue.");
-                return;
+                return false;
             }
         }
     }
@@ -175,11 +187,21 @@ void bpe_encode_arena_string(struct Arena* arena,
         }
     }
 
+    // Only the number of tokens is needed when counting.
+    if (tokens == NULL) {
+        int final_token_count = 0;
+        for (int i = 0; i < *token_num; ++i) {
+            final_token_count += !consumed[i];
+        }
+        *token_num = final_token_count;
+        return true;
+    }
+
     struct Boundary* final_boundaries =
         arena_alloc(arena, *token_num * sizeof(struct Boundary));
     if (!final_boundaries) {
         log_debug("Failed to allocate memory for final boundaries.");
-        return;
+        return false;
     }
 
     int final_token_count = 0;
@@ -206,16 +228,21 @@ void bpe_encode_arena_string(struct Arena* arena,
             hashmap_get(vocab, &(struct Token){.key = token_str});
         tokens[i] = (found_token != NULL) ? found_token->value : -1;
     }
+
+    return true;
 }
 
-void bpe_encode_arena_ids(struct Arena* arena,
+// If `positions` is not NULL, it receives the index of the first initial
+// token of every final token.
+bool bpe_encode_arena_ids(struct Arena* arena,
                           struct HashMap* merges_map,
                           int tokens[],
+                          int positions[],
                           int* token_num) {
     struct MinPQ pq;
     if (min_pq_init_arena(arena, &pq, *token_num) != MIN_PQ_SUCCESS) {
         log_debug("Failed to initialize priority queue.");
-        return;
+        return false;
     }
 
     // Before using the min-priority queue, we use a linked list to track the
@@ -227,7 +254,7 @@ void bpe_encode_arena_ids(struct Arena* arena,
     bool* consumed = arena_alloc(arena, *token_num * sizeof(bool));
     if (!nodes || !consumed) {
         log_debug("Failed to allocate memory for token nodes.");
-        return;
+        return false;
     }
 
     memset(consumed, 0, *token_num * sizeof(bool));
@@ -247,7 +274,7 @@ void bpe_encode_arena_ids(struct Arena* arena,
 
             if (min_pq_push_arena(arena, &pq, candidate) != MIN_PQ_SUCCESS) {
                 log_debug("Failed to push to queue.");
-                return;
+                return false;
             }
         }
     }
@@ -329,14 +356,99 @@ void bpe_encode_arena_ids(struct Arena* arena,
     int final_token_count = 0;
     for (int i = 0; i < *token_num; ++i) {
         if (!consumed[i]) {
+            if (positions) {
+                positions[final_token_count] = i;
+            }
             tokens[final_token_count++] = tokens[i];
         }
     }
 
     *token_num = final_token_count;
+
+    return true;
+}
+
+/*
+ * Appends the tokens of a word, and their offsets if the task asks for them.
+ * Encoded words are never cut: if the tokens do not all fit in the task's
+ * token budget, nothing is appended and false is returned. Tokens that are
+ * only counted are counted up to the budget.
+ */
+static bool emit_tokens(struct EncodeTask* task,
+                        const int tokens[],
+                        const int spans[],
+                        int word_offset,
+                        int word_id,
+                        int count) {
+    size_t num = (size_t)count;
+    if (task->max_tokens > 0 && task->num_tokens + num > task->max_tokens) {
+        if (task->tokens) {
+            return false;
+        }
+        num = task->max_tokens - task->num_tokens;
+    }
+
+    if (task->tokens) {
+        vector_append_array(task->tokens, tokens, num);
+    }
+    task->num_tokens += num;
+
+    // Spans are relative to the word. Without spans, the tokens do not come
+    // from the text (the prefix) and get an empty span at the word's start.
+    if (task->offsets) {
+        for (size_t i = 0; i < num; ++i) {
+            vector_push(task->offsets,
+                        word_offset + (spans ? spans[2 * i] : 0));
+            vector_push(task->offsets,
+                        word_offset + (spans ? spans[2 * i + 1] : 0));
+            vector_push(task->word_ids, word_id);
+        }
+    }
+
+    return true;
+}
+
+// Removes the last `count` tokens appended by `emit_tokens`.
+static void unemit_tokens(struct EncodeTask* task, int count) {
+    task->num_tokens -= count;
+    if (task->tokens) {
+        task->tokens->size -= count;
+    }
+    if (task->offsets) {
+        task->offsets->size -= 2 * (size_t)count;
+        task->word_ids->size -= count;
+    }
+}
+
+static bool budget_used(const struct EncodeTask* task) {
+    return task->max_tokens > 0 && task->num_tokens >= task->max_tokens;
+}
+
+/*
+ * Finds the next special token at or after `from` that the task does not
+ * treat as ordinary text.
+ */
+static bool find_special_token(const struct EncodeTask* task,
+                               size_t from,
+                               struct ACMatch* match) {
+    if (!task->special_policy || task->ctx->num_special_tokens == 0) {
+        return false;
+    }
+    if (!ac_automaton_find(task->ctx->special_tokens_ac, task->text + from,
+                           task->text_len - from, task->special_policy,
+                           match)) {
+        return false;
+    }
+    match->start += from;
+    return true;
 }
 
 void encode(struct EncodeTask* task) {
+    task->error_msg = NULL;
+    task->num_tokens = 0;
+    task->consumed = 0;
+    task->budget_end = 0;
+
     struct Arena arena;
     if (!arena_create(&arena, FIXED_ARENA_SIZE)) {
         log_debug("Error: Failed to create arena for encoding.");
@@ -344,8 +456,8 @@ void encode(struct EncodeTask* task) {
         return;
     }
 
-    log_debug("Starting encode function with text: %s and pattern: %s",
-              task->text, task->ctx->pattern);
+    log_debug("Starting encode function with text: %.*s and pattern: %s",
+              (int)task->text_len, task->text, task->ctx->pattern);
 
     regex_t regex;
     struct ParserState parser;
@@ -357,23 +469,57 @@ void encode(struct EncodeTask* task) {
             arena_destroy(&arena);
             return;
         }
-    } else {
-        parser = parser_init(task->text);
     }
 
     const char* cursor = task->text;
-    bool add_prefix = cursor[0] != ' ';
-    bool add_prefix_token = !add_prefix;
+    const char* text_end = task->text + task->text_len;
+    bool add_prefix =
+        !task->continuation && (task->text_len == 0 || cursor[0] != ' ');
+    bool add_prefix_token = !task->continuation && !add_prefix;
+    bool budget_reached = false;
+    int word_id = 0;
+
+    // Special tokens split the text into segments, which are pretokenized
+    // separately. The special token after a segment is emitted as its id.
+    struct ACMatch special;
+    bool has_special = false;
+    bool next_segment = true;
+    const char* segment_end = text_end;
 
     while (true) {
         struct TokenSlice word_slice;
         bool has_token = false;
 
+        if (next_segment) {
+            has_special =
+                find_special_token(task, cursor - task->text, &special);
+            if (has_special && task->special_policy[special.output_value] ==
+                                   SPECIAL_TOKEN_DISALLOWED) {
+                task->error_msg = ENCODE_DISALLOWED_SPECIAL_MSG;
+                break;
+            }
+            segment_end = has_special ? task->text + special.start : text_end;
+            if (!use_regex) {
+                parser = parser_init_n(cursor, segment_end - cursor);
+            }
+            next_segment = false;
+        }
+
         if (use_regex) {
+#ifdef REG_STARTEND
+            regmatch_t match = {.rm_so = 0, .rm_eo = segment_end - cursor};
+            const int eflags = REG_STARTEND;
+#else
             regmatch_t match;
-            if (regexec(&regex, cursor, 1, &match, 0) == 0) {
+            const int eflags = 0;
+#endif
+            if (regexec(&regex, cursor, 1, &match, eflags) == 0 &&
+                cursor + match.rm_so < segment_end) {
                 word_slice.start = cursor + match.rm_so;
                 word_slice.length = match.rm_eo - match.rm_so;
+                if (word_slice.start + word_slice.length > segment_end) {
+                    word_slice.length = segment_end - word_slice.start;
+                }
                 has_token = true;
             }
         } else {
@@ -382,20 +528,43 @@ void encode(struct EncodeTask* task) {
             }
         }
 
-        if (!has_token) {
-            break;
-        }
-
         // If the regex finds a zero-length match, word_len will be 0.
         // This would lead to calling `bpe_encode` with unitialized arrays, or
         // the `cursor` not advancing to the next step.
-        if (word_slice.length == 0) {
-            if (*(word_slice.start) == '\0') {
+        if (has_token && word_slice.length == 0) {
+            if (word_slice.start >= segment_end ||
+                *(word_slice.start) == '\0') {
+                has_token = false;
+            } else {
+                if (use_regex) {
+                    cursor = word_slice.start + 1;
+                }
+                continue;
+            }
+        }
+
+        if (!has_token) {
+            if (!has_special) {
+                break;
+            }
+            const int special_span[2] = {0, (int)special.len};
+            log_debug("Appending special token of length %zu.", special.len);
+            if (!emit_tokens(
+                    task, &task->ctx->special_token_ids[special.output_value],
+                    special_span, (int)special.start, word_id, 1)) {
+                budget_reached = true;
+                task->budget_end = special.start + special.len;
                 break;
             }
-            if (use_regex) {
-                cursor = word_slice.start + 1;
+            task->consumed = special.start + special.len;
+            word_id++;
+            if (budget_used(task)) {
+                budget_reached = true;
+                task->budget_end = task->consumed;
+                break;
             }
+            cursor = task->text + task->consumed;
+            next_segment = true;
             continue;
         }
 
@@ -406,17 +575,22 @@ void encode(struct EncodeTask* task) {
             break;
         }
 
-        if (arena.current_offset + estimated_needed > arena.total_size) {
-            log_debug("Resetting arena before processing word of length %zu",
-                      word_slice.length);
-            arena_reset(&arena);
-        }
+        // Nothing allocated for the previous word is needed anymore. Starting
+        // every word from an empty arena also keeps the available memory, and
+        // so the result, independent of where the text was split.
+        arena_reset(&arena);
 
         char* word = arena_alloc(&arena, word_slice.length + 1);
         memcpy(word, word_slice.start, word_slice.length);
         word[word_slice.length] = '\0';
         log_debug("Matched word: length=%zu, word='%s'", word_slice.length,
                   word);
+        const int word_offset = (int)(word_slice.start - task->text);
+        const size_t word_end =
+            (word_slice.start + word_slice.length) - task->text;
+        // Prefix tokens emitted for this word, taken back if the word does
+        // not fit in the budget.
+        int prefix_count = 0;
 
         if (add_prefix_token && task->ctx->prefix) {
             log_debug("Adding encoded prefix to tokens");
@@ -436,29 +610,78 @@ void encode(struct EncodeTask* task) {
                 prefix_boundaries[pcount++] = b;
             }
 
-            bpe_encode_arena_string(&arena, task->ctx->vocab_encode,
-                                    prefix_boundaries, prefix_tokens, &pcount);
+            if (!bpe_encode_arena_string(
+                    &arena, task->ctx->vocab_encode, prefix_boundaries,
+                    task->tokens ? prefix_tokens : NULL, &pcount)) {
+                task->error_msg = BPE_ALLOC_ERROR_MSG;
+                break;
+            }
 
-            vector_append_array(task->tokens, prefix_tokens, pcount);
+            add_prefix_token = false;
             log_debug("Encoded %d prefix tokens.", pcount);
 
-            add_prefix_token = false;
+            if (!emit_tokens(task, prefix_tokens, NULL, word_offset, word_id,
+                             pcount)) {
+                budget_reached = true;
+                task->budget_end = word_end;
+                break;
+            }
+            prefix_count = pcount;
         }
 
+        const char* word_prefix = add_prefix ? task->ctx->prefix : NULL;
         char* encoded_word = pretokenizer_encode_arena(
-            &arena, word, (const char**)task->ctx->special_chars,
-            add_prefix ? task->ctx->prefix : NULL, task->ctx->is_byte_encoder);
+            &arena, word, (const char**)task->ctx->special_chars, word_prefix,
+            task->ctx->is_byte_encoder);
         add_prefix = false;
 
         size_t encoded_len = strlen(encoded_word);
         int word_tokens[encoded_len > 0 ? encoded_len : 1];
         int word_tokens_num = 0;
 
+        // For offsets: where every byte of the encoded word comes from in
+        // the word, and the resulting span of every token.
+        int* source_starts = NULL;
+        int* source_ends = NULL;
+        int* token_spans = NULL;
+        if (task->offsets) {
+            source_starts =
+                arena_alloc(&arena, (encoded_len + 1) * sizeof(int));
+            source_ends = arena_alloc(&arena, (encoded_len + 1) * sizeof(int));
+            token_spans =
+                arena_alloc(&arena, 2 * (encoded_len + 1) * sizeof(int));
+            if (!source_starts || !source_ends || !token_spans) {
+                task->error_msg = BPE_ALLOC_ERROR_MSG;
+                break;
+            }
+            pretokenizer_source_offsets(
+                word, (const char**)task->ctx->special_chars, word_prefix,
+                task->ctx->is_byte_encoder, source_starts, source_ends);
+        }
+
         if (task->ctx->merges_map != NULL) {
             log_debug("Using ID-based BPE encoding path.");
 
+            int* unit_starts = NULL;
+            int* positions = NULL;
+            if (task->offsets) {
+                unit_starts =
+                    arena_alloc(&arena, (encoded_len + 1) * sizeof(int));
+                positions =
+                    arena_alloc(&arena, (encoded_len + 1) * sizeof(int));
+                if (!unit_starts || !positions) {
+                    task->error_msg = BPE_ALLOC_ERROR_MSG;
+                    break;
+                }
+            }
+
             for (char* ptr = encoded_word; *ptr != '\0';) {
-                int char_len = utf8_char_length((unsigned char*)ptr);
+                if (unit_starts) {
+                    unit_starts[word_tokens_num] = (int)(ptr - encoded_word);
+                }
+                int char_len = task->ctx->merges_from_bytes
+                                   ? 1
+                                   : utf8_char_length((unsigned char*)ptr);
                 char temp_char[char_len + 1];
                 memcpy(temp_char, ptr, char_len);
                 temp_char[char_len] = '\0';
@@ -473,8 +696,21 @@ void encode(struct EncodeTask* task) {
                 ptr += char_len;
             }
 
-            bpe_encode_arena_ids(&arena, task->ctx->merges_map, word_tokens,
-                                 &word_tokens_num);
+            if (!bpe_encode_arena_ids(&arena, task->ctx->merges_map,
+                                      word_tokens, positions,
+                                      &word_tokens_num)) {
+                task->error_msg = BPE_ALLOC_ERROR_MSG;
+                break;
+            }
+
+            for (int i = 0; token_spans && i < word_tokens_num; ++i) {
+                const int first = unit_starts[positions[i]];
+                const int next = i + 1 < word_tokens_num
+                                     ? unit_starts[positions[i + 1]]
+                                     : (int)encoded_len;
+                token_spans[2 * i] = source_starts[first];
+                token_spans[2 * i + 1] = source_ends[next - 1];
+            }
         } else {
             log_debug("Using string-based BPE encoding path.");
             struct Boundary
@@ -487,97 +723,368 @@ void encode(struct EncodeTask* task) {
                 ptr += token_len;
             }
 
-            bpe_encode_arena_string(&arena, task->ctx->vocab_encode,
-                                    word_token_boundaries, word_tokens,
-                                    &word_tokens_num);
+            if (!bpe_encode_arena_string(
+                    &arena, task->ctx->vocab_encode, word_token_boundaries,
+                    task->tokens ? word_tokens : NULL, &word_tokens_num)) {
+                task->error_msg = BPE_ALLOC_ERROR_MSG;
+                break;
+            }
+
+            for (int i = 0; token_spans && i < word_tokens_num; ++i) {
+                const struct Boundary* b = &word_token_boundaries[i];
+                token_spans[2 * i] = source_starts[b->start - encoded_word];
+                token_spans[2 * i + 1] = source_ends[b->end - encoded_word];
+            }
         }
 
-        vector_append_array(task->tokens, word_tokens, word_tokens_num);
-        log_debug("Appended %d word tokens.", word_tokens_num);
+        log_debug("Appending %d word tokens.", word_tokens_num);
+
+        if (!emit_tokens(task, word_tokens, token_spans, word_offset, word_id,
+                         word_tokens_num)) {
+            unemit_tokens(task, prefix_count);
+            budget_reached = true;
+            task->budget_end = word_end;
+            break;
+        }
+        task->consumed = word_end;
+        word_id++;
+        if (budget_used(task)) {
+            budget_reached = true;
+            task->budget_end = word_end;
+            break;
+        }
 
         if (use_regex) {
             cursor = word_slice.start + word_slice.length;
         }
     }
 
-    task->error_msg = NULL;
+    if (!budget_reached && !task->error_msg) {
+        task->consumed = task->text_len;
+    }
 
     if (use_regex) {
         regfree(&regex);
     }
-    log_debug("Completed encode function. Total tokens: %lu",
-              task->tokens->size);
+    log_debug("Completed encode function. Total tokens: %zu",
+              task->num_tokens);
     arena_destroy(&arena);
 }
 
-void decode(struct DecodeTask* task) {
-    log_debug("Entered decode function");
+static inline bool is_pretoken_boundary(const char* text, size_t i) {
+    const char c = text[i];
+    if (c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f') {
+        return true;
+    }
+    return c == ' ' && text[i - 1] != ' ';
+}
 
+/*
+ * Finds the first position at or after `target` where the built-in
+ * pretokenizer starts a new token regardless of the text before it: a
+ * whitespace control character, which always forms a token of its own, or a
+ * space following a non-space byte, since no token class consumes a space
+ * after its first byte. Encoding the pieces between such positions separately
+ * gives exactly the tokens of the whole text. Returns `length` if there is no
+ * such position.
+ */
+size_t encode_find_split(const char* text, size_t length, size_t target) {
+    for (size_t i = target > 0 ? target : 1; i < length; ++i) {
+        if (is_pretoken_boundary(text, i)) {
+            return i;
+        }
+    }
+    return length;
+}
+
+// Same as `encode_find_split`, but finds the last such position before
+// `length`. Returns 0 if there is none.
+size_t encode_find_last_split(const char* text, size_t length) {
+    for (size_t i = length; i-- > 1;) {
+        if (is_pretoken_boundary(text, i)) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+static struct DecodedTokenInfo decoded_token_info(const char* text,
+                                                  size_t len) {
+    size_t num_chars = 0;
+    uint32_t maxchar = 0;
+    if (unicode_utf8_scan(text, len, &num_chars, &maxchar) !=
+            UNICODE_SUCCESS ||
+        num_chars > UINT32_MAX) {
+        return (struct DecodedTokenInfo){0, DECODE_MAXCHAR_NOT_UTF8};
+    }
+    return (struct DecodedTokenInfo){(uint32_t)num_chars, maxchar};
+}
+
+/*
+ * Precomputes the decoded bytes of every token, so that `decode` only has to
+ * concatenate them. Decoding never makes a token longer, so the raw lengths
+ * bound the size of the table. The table is followed by DECODE_OVERCOPY
+ * bytes of padding, which lets `decode` copy short tokens with a fixed-size
+ * memcpy. The code points of every token are counted as well, so that a
+ * decoded text can be turned into a string without validating it again.
+ */
+bool decode_build_table(struct DecodeContext* ctx) {
+    size_t vocab_size = (size_t)ctx->vocab_size_decode;
+    size_t raw_size = 0;
+    for (size_t i = 0; i < vocab_size; ++i) {
+        if (ctx->vocab_decode[i]) {
+            raw_size += ctx->vocab_decode_lens[i];
+        }
+    }
+
+    ctx->decoded_offsets = malloc((vocab_size + 1) * sizeof(size_t));
+    ctx->decoded_tokens = calloc(raw_size + DECODE_OVERCOPY, 1);
+    ctx->decoded_info = malloc(vocab_size * sizeof(struct DecodedTokenInfo));
+    if (!ctx->decoded_offsets || !ctx->decoded_tokens || !ctx->decoded_info) {
+        log_debug("Error: Failed to allocate memory for the decode table.");
+        free(ctx->decoded_offsets);
+        free(ctx->decoded_tokens);
+        free(ctx->decoded_info);
+        ctx->decoded_offsets = NULL;
+        ctx->decoded_tokens = NULL;
+        ctx->decoded_info = NULL;
+        return false;
+    }
+
+    size_t size = 0;
+    for (size_t i = 0; i < vocab_size; ++i) {
+        ctx->decoded_offsets[i] = size;
+        // Ids missing from the vocabulary decode to nothing.
+        if (ctx->vocab_decode[i]) {
+            size += pretokenizer_decode_n(ctx->vocab_decode[i],
+                                          ctx->vocab_decode_lens[i], ctx,
+                                          ctx->decoded_tokens + size);
+        }
+        ctx->decoded_info[i] =
+            decoded_token_info(ctx->decoded_tokens + ctx->decoded_offsets[i],
+                               size - ctx->decoded_offsets[i]);
+    }
+    ctx->decoded_offsets[vocab_size] = size;
+
+    log_debug("Built decode table of %zu bytes for %zu tokens.", size,
+              vocab_size);
+    return true;
+}
+
+/*
+ * The prefix is only removed at the start of the text, so the first token is
+ * decoded from its raw form if it starts with the prefix. Returns the size of
+ * the buffer `decode_unprefixed_first` needs for it, or 0 if the first token
+ * is decoded like any other.
+ */
+static size_t unprefixed_first_size(const struct DecodeTask* task) {
+    const struct DecodeContext* ctx = task->ctx;
+    if (*task->tokens_size == 0 || !ctx->prefix || task->continuation) {
+        return 0;
+    }
+
+    int token_id = task->tokens[0];
+    if (token_id < 0 || token_id >= ctx->vocab_size_decode ||
+        !ctx->vocab_decode[token_id]) {
+        return 0;
+    }
+
+    size_t prefix_len = strlen(ctx->prefix);
+    if (strncmp(ctx->vocab_decode[token_id], ctx->prefix, prefix_len) != 0) {
+        return 0;
+    }
+    return ctx->vocab_decode_lens[token_id] - prefix_len + 1;
+}
+
+// Decodes the first token without the prefix into `first`, returns its length.
+static size_t decode_unprefixed_first(const struct DecodeTask* task,
+                                      char* first) {
+    const struct DecodeContext* ctx = task->ctx;
+    const char* word = ctx->vocab_decode[task->tokens[0]];
+    size_t word_len = ctx->vocab_decode_lens[task->tokens[0]];
+    size_t prefix_len = strlen(ctx->prefix);
+
+    return pretokenizer_decode_n(word + prefix_len, word_len - prefix_len, ctx,
+                                 first);
+}
+
+/*
+ * Computes the length and code points of the text `decode` would produce for
+ * the task, from the decode table alone, without writing it. Splitting a
+ * long decode uses it to find where every piece goes in the output.
+ */
+void decode_measure(struct DecodeTask* task) {
+    const struct DecodeContext* ctx = task->ctx;
     int token_num = *task->tokens_size;
-    log_debug("Number of tokens to decode: %d", token_num);
 
-    size_t total_size = 0;
-    for (int i = 0; i < token_num; ++i) {
+    task->result = NULL;
+    task->error_msg = NULL;
+
+    size_t size = 0;
+    size_t num_chars = 0;
+    uint32_t maxchar = 0;
+    int i = 0;
+
+    const size_t first_size = unprefixed_first_size(task);
+    if (first_size > 0) {
+        char first[first_size];
+        size = decode_unprefixed_first(task, first);
+        struct DecodedTokenInfo info = decoded_token_info(first, size);
+        num_chars = info.num_chars;
+        maxchar = info.maxchar;
+        i = 1;
+    }
+
+    for (; i < token_num; ++i) {
         int token_id = task->tokens[i];
-        if (token_id < 0 || token_id >= task->ctx->vocab_size_decode) {
-            log_debug("Token value %d is out of bounds (vocab size = %d).",
-                      token_id, task->ctx->vocab_size_decode);
+        if (token_id < 0 || token_id >= ctx->vocab_size_decode) {
             task->error_msg =
                 "Element must be non-negative and less than vocab size.";
-            task->result = NULL;
             return;
         }
-        total_size += task->ctx->vocab_decode_lens[token_id];
+        size += ctx->decoded_offsets[token_id + 1] -
+                ctx->decoded_offsets[token_id];
+        const struct DecodedTokenInfo info = ctx->decoded_info[token_id];
+        num_chars += info.num_chars;
+        if (info.maxchar > maxchar) {
+            maxchar = info.maxchar;
+        }
+    }
+
+    task->result_len = size;
+    task->result_num_chars = num_chars;
+    task->result_maxchar = maxchar;
+}
+
+// Makes room for `needed` more bytes after `size` bytes of decoded text. A
+// caller's buffer never grows.
+static bool decode_reserve(char** text,
+                           size_t* capacity,
+                           bool growable,
+                           size_t size,
+                           size_t needed) {
+    if (size + needed <= *capacity) {
+        return true;
+    }
+    if (!growable) {
+        return false;
     }
-    log_debug("Calculated total size for decoded string: %zu", total_size);
+    size_t new_capacity = 2 * (size + needed) + DECODE_OVERCOPY;
+    char* grown = (char*)realloc(*text, new_capacity);
+    if (!grown) {
+        return false;
+    }
+    *text = grown;
+    *capacity = new_capacity;
+    return true;
+}
 
-    char* text = (char*)malloc(total_size + 1);
+void decode(struct DecodeTask* task) {
+    log_debug("Entered decode function");
+
+    const struct DecodeContext* ctx = task->ctx;
+    int token_num = *task->tokens_size;
+    log_debug("Number of tokens to decode: %d", token_num);
 
+    task->result = NULL;
+    task->result_len = 0;
+    task->result_num_chars = 0;
+    task->result_maxchar = 0;
+    task->error_msg = NULL;
+
+    // An allocated result grows as needed and is null-terminated.
+    const bool growable = task->output == NULL;
+    const size_t terminator = growable ? 1 : 0;
+    char* const no_room_msg = growable
+                                  ? "Failed to allocate memory for text buffer"
+                                  : "Output buffer is too small.";
+
+    size_t capacity = growable
+                          ? (size_t)token_num * 4 + DECODE_OVERCOPY + 1
+                          : task->output_capacity;
+    char* text = growable ? (char*)malloc(capacity) : task->output;
     if (!text) {
         log_debug("Error: Memory allocation failed for text buffer");
         task->error_msg = "Failed to allocate memory for text buffer";
-        task->result = NULL;
         return;
     }
 
-    text[0] = '\0';
-    log_debug("Allocated final buffer of size %zu bytes", total_size + 1);
-
-    char* write_ptr = text;
+    size_t size = 0;
+    size_t num_chars = 0;
+    uint32_t maxchar = 0;
+    int i = 0;
+
+    const size_t first_size = unprefixed_first_size(task);
+    if (first_size > 0) {
+        char first[first_size];
+        size = decode_unprefixed_first(task, first);
+        if (!decode_reserve(&text, &capacity, growable, 0,
+                            size + terminator)) {
+            if (growable) {
+                free(text);
+            }
+            task->error_msg = no_room_msg;
+            return;
+        }
+        memcpy(text, first, size);
+        struct DecodedTokenInfo info = decoded_token_info(first, size);
+        num_chars = info.num_chars;
+        maxchar = info.maxchar;
+        i = 1;
+    }
 
-    for (int i = 0; i < token_num; i++) {
-        log_debug("Processing token at index %d", i);
+    for (; i < token_num; ++i) {
+        int token_id = task->tokens[i];
+        if (token_id < 0 || token_id >= ctx->vocab_size_decode) {
+            log_debug("Token value %d is out of bounds (vocab size = %d).",
+                      token_id, ctx->vocab_size_decode);
+            if (growable) {
+                free(text);
+            }
+            task->error_msg =
+                "Element must be non-negative and less than vocab size.";
+            return;
+        }
 
-        int item = task->tokens[i];
-        const char* word = task->ctx->vocab_decode[item];
+        const size_t start = ctx->decoded_offsets[token_id];
+        const size_t len = ctx->decoded_offsets[token_id + 1] - start;
 
-        size_t word_len = strlen(word);
-        memcpy(write_ptr, word, word_len);
-        write_ptr += word_len;
+        if (!decode_reserve(&text, &capacity, growable, size,
+                            len + terminator)) {
+            if (growable) {
+                free(text);
+            }
+            task->error_msg = no_room_msg;
+            return;
+        }
 
-        log_debug("Copied word '%s' to buffer.", word);
+        // Short tokens are copied with a fixed size where there is room for
+        // it, which is all but the end of a caller's buffer.
+        if (len <= DECODE_OVERCOPY && size + DECODE_OVERCOPY <= capacity) {
+            memcpy(text + size, ctx->decoded_tokens + start, DECODE_OVERCOPY);
+        } else {
+            memcpy(text + size, ctx->decoded_tokens + start, len);
+        }
+        size += len;
+
+        // Tokens that are not valid UTF-8 on their own have the largest
+        // maxchar, which marks the whole text.
+        const struct DecodedTokenInfo info = ctx->decoded_info[token_id];
+        num_chars += info.num_chars;
+        if (info.maxchar > maxchar) {
+            maxchar = info.maxchar;
+        }
     }
 
-    *write_ptr = '\0';
-    log_debug("Final raw decoded string: '%s'", text);
-
-    char* decoded_text = (char*)malloc(total_size + 1);
-    if (!decoded_text) {
-        log_debug(
-            "Error: Memory allocation failed for final decoded_text buffer");
-        task->error_msg = "Failed to allocate memory for final text buffer";
-        task->result = NULL;
-        free(text);
-        return;
+    if (growable) {
+        text[size] = '\0';
     }
+    log_debug("Decoded %d tokens into %zu bytes.", token_num, size);
 
-    size_t final_len = pretokenizer_decode(text, task->ctx, decoded_text);
-    log_debug("Final decoded text: %s, Length: %zu", decoded_text, final_len);
-
-    free(text);
-
-    task->result = decoded_text;
-    task->error_msg = NULL;
+    task->result = text;
+    task->result_len = size;
+    task->result_num_chars = num_chars;
+    task->result_maxchar = maxchar;
 }
 
 #ifdef USE_FOMA
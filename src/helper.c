@@ -10,7 +10,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
 
 #include "hutoken/hashmap.h"
 
@@ -62,23 +61,6 @@ void visualize(int arr[], char* text, int n) {
     }
 }
 
-void visualize_bpe_train(struct Token current_token, size_t value) {
-    if (VISUALIZE) {
-        (void)printf("Most common pair: '%s', rank: %d\n", current_token.key,
-                     current_token.value);
-        (void)printf("New token '%s', value: %ld\n\n", current_token.key,
-                     value);
-    }
-}
-
-void visualize_bbpe_train(struct TokenPair current_token, size_t value) {
-    if (VISUALIZE) {
-        (void)printf("Most common pair: (%d, %d), freq: %d\n",
-                     current_token.id1, current_token.id2, current_token.freq);
-        (void)printf("New token id: %zu\n\n", value);
-    }
-}
-
 void hex_str_to_ascii(const char* hex_str,
                       char* ascii_str,
                       size_t ascii_str_size) {
@@ -127,44 +109,15 @@ void hex_str_to_ascii(const char* hex_str,
     log_debug("Completed hex_str_to_ascii. Result: %s", ascii_str);
 }
 
-int save_vocab(struct HashMap* vocab, char* file_name) {
-    const char* home_dir = getenv("HOME");  // NOLINT: concurrency-mt-unsafe
-
-    if (home_dir == NULL) {
-        (void)fputs("Unable to get HOME environment variable.", stderr);
-        return EXIT_FAILURE;
-    }
-
-    char dir_path[1024];
-    (void)snprintf(dir_path, sizeof(dir_path), "%s/config", home_dir);
-
-    struct stat st = {0};
-    if (stat(dir_path, &st) == -1) {
-        if (mkdir(dir_path, 0700) == 0) {
-            (void)printf("Directory created: %s\n", dir_path);
-        } else {
-            (void)fputs("Error creating directory.", stderr);
-            (void)fputs("Failed to save vocab.", stderr);
-            return -1;
-        }
-    } else {
-        (void)printf("Directory already exists: %s\n", dir_path);
-    }
-
-    size_t file_path_len = strlen(dir_path) + 1 + strlen(file_name) + 1;
-    char* file_path = malloc(file_path_len);
-    if (!file_path) {
-        PyErr_SetString(PyExc_MemoryError,
-                        "Cannot allocate memory for file path");
-        return EXIT_FAILURE;
-    }
-
-    (void)snprintf(file_path, file_path_len, "%s/%s", dir_path, file_name);
-
+/*
+ * Writes the vocabulary to `file_path`, every token as hex bytes followed by
+ * its id. Returns EXIT_FAILURE with an OSError set if the file cannot be
+ * written.
+ */
+int save_vocab(struct HashMap* vocab, char* file_path) {
     FILE* file = fopen(file_path, "w");
     if (file == NULL) {
-        free(file_path);
-        perror("Error creating file.\n");
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, file_path);
         return EXIT_FAILURE;
     }
 
@@ -181,11 +134,16 @@ int save_vocab(struct HashMap* vocab, char* file_name) {
         (void)fprintf(file, " == %d\n", token->value);
     }
 
-    (void)fclose(file);
-
-    (void)printf("Vocab saved to: %s\n", file_path);
+    bool ok = !ferror(file);
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, file_path);
+        return EXIT_FAILURE;
+    }
 
-    free(file_path);
+    log_debug("Vocab saved to: %s", file_path);
 
     return EXIT_SUCCESS;
 }
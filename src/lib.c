@@ -6,7 +6,9 @@
 #endif
 
 #include <limits.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,33 +18,23 @@
 #include "hutoken/core.h"
 #include "hutoken/hashmap.h"
 #include "hutoken/helper.h"
+#include "hutoken/shard.h"
+#include "hutoken/stream.h"
 #include "hutoken/string.h"
 #include "hutoken/taskqueue.h"
+#include "hutoken/unicode.h"
 #include "modsupport.h"
 #include "object.h"
 #include "pyerrors.h"
 
 #if defined(_WIN32) || defined(_WIN64)
-#include <windows.h>
-typedef HANDLE thread_t;
-typedef DWORD WINAPI thread_return_t;
-typedef LPVOID thread_arg_t;
-#define THREAD_CREATE(thr, func, arg) \
-    *(thr) = CreateThread(NULL, 0, func, arg, 0, NULL)
-#define THREAD_JOIN(thr) WaitForSingleObject(thr, INFINITE)
-
 // Wrapper for POSIX-style function
 DWORD WINAPI encode_wrapper(LPVOID arg) {
     encode(arg);
     return 0;
 }
 #else
-#include <pthread.h>
-typedef pthread_t thread_t;
-typedef void* thread_return_t;
-typedef void* thread_arg_t;
-#define THREAD_CREATE(thr, func, arg) pthread_create(thr, NULL, func, arg)
-#define THREAD_JOIN(thr) pthread_join(thr, NULL)
+#include <unistd.h>
 #endif
 
 thread_return_t encode_wrapper(thread_arg_t arg) {
@@ -67,62 +59,825 @@ thread_return_t decode_wrapper(thread_arg_t arg) {
     return 0;
 }
 
+thread_return_t decode_measure_wrapper(thread_arg_t arg) {
+    DecodeQueue* q = (DecodeQueue*)arg;
+    struct DecodeTask* task = NULL;
+
+    while ((task = decodequeue_get(q)) != NULL) {
+        decode_measure(task);
+    }
+
+    return 0;
+}
+
 static char* pattern = NULL;
 #define MAX_LINE_LENGTH 10000
 
+// Documents below this size are encoded on the calling thread, holding the
+// GIL, since splitting them costs more than it saves.
+static const size_t PARALLEL_ENCODE_THRESHOLD = (size_t)1024 * 1024;
+static const size_t PARALLEL_ENCODE_MIN_PIECE = (size_t)256 * 1024;
+// The same for decoding, in tokens.
+static const int PARALLEL_DECODE_THRESHOLD = 256 * 1024;
+static const int PARALLEL_DECODE_MIN_PIECE = 64 * 1024;
+// Characters of a non-ASCII text transcoded per token of a token budget at
+// first, and at least, before trying again with twice as many.
+static const Py_ssize_t BUDGET_CHARS_PER_TOKEN = 8;
+static const Py_ssize_t MIN_BUDGET_CHARS = 4096;
+
+static int cpu_count(void) {
+#if defined(_WIN32) || defined(_WIN64)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
 struct EncodeContext* global_encode_context;
 struct DecodeContext* global_decode_context;
 
-PyObject* p_bpe_train(PyObject* self, PyObject* args) {
-    char* data = NULL;
-    char* vocab_file_name = NULL;
-    int vocab_size = 256;
+/*
+ * Returns the text of a Python string as NUL-terminated UTF-8 without
+ * calling `PyUnicode_AsUTF8`, which caches a UTF-8 copy on the object for its
+ * whole lifetime. ASCII strings are already valid UTF-8 and are returned in
+ * place. Every other kind (Latin-1, UCS-2, UCS-4) is transcoded into a private
+ * buffer, and `owned` is set to signal that the caller has to free it.
+ * `len` receives the length of the text in bytes.
+ *
+ * Only the first `limit` characters of a non-ASCII string are transcoded, and
+ * `complete` tells whether that was all of it.
+ */
+static char* unicode_prefix_as_utf8(PyObject* obj,
+                                    Py_ssize_t limit,
+                                    size_t* len,
+                                    bool* owned,
+                                    bool* complete) {
+    *owned = false;
+    *complete = true;
+
+    if (!PyUnicode_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "Expected a string.");
+        return NULL;
+    }
 
-    if (!PyArg_ParseTuple(args, "sis", &data, &vocab_size, &vocab_file_name)) {
+#if PY_VERSION_HEX < 0x030C0000
+    if (PyUnicode_READY(obj) == -1) {
         return NULL;
     }
+#endif
 
-    if (vocab_size < 256) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "vocab_size must be at least 256 to encode all bytes.");
+    Py_ssize_t length = PyUnicode_GET_LENGTH(obj);
+    void* data = PyUnicode_DATA(obj);
+
+    if (PyUnicode_IS_ASCII(obj)) {
+        if (memchr(data, '\0', length) != NULL) {
+            PyErr_SetString(PyExc_ValueError, "embedded null character");
+            return NULL;
+        }
+        *len = (size_t)length;
+        return (char*)data;
+    }
+
+    if (length > limit) {
+        length = limit;
+        *complete = false;
+    }
+
+    enum UnicodeKind kind = (enum UnicodeKind)PyUnicode_KIND(obj);
+    size_t utf8_len = 0;
+    enum UnicodeError err = unicode_utf8_len(data, length, kind, &utf8_len);
+    if (err == UNICODE_NUL_CHARACTER) {
+        PyErr_SetString(PyExc_ValueError, "embedded null character");
+        return NULL;
+    }
+    if (err == UNICODE_SURROGATE) {
+        PyErr_SetString(PyExc_UnicodeError,
+                        "Text contains surrogates, which cannot be encoded.");
+        return NULL;
+    }
+
+    char* text = malloc(utf8_len + 1);
+    if (!text) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    (void)unicode_to_utf8(data, length, kind, text);
+    *len = utf8_len;
+    *owned = true;
+
+    log_debug("Transcoded string of kind %d into %zu UTF-8 bytes.", kind,
+              utf8_len);
+
+    return text;
+}
+
+static char* unicode_as_utf8(PyObject* obj, size_t* len, bool* owned) {
+    bool complete = true;
+    return unicode_prefix_as_utf8(obj, PY_SSIZE_T_MAX, len, owned, &complete);
+}
+
+static PyObject* tokens_to_list(const struct IntVector* tokens) {
+    PyObject* list = PyList_New((Py_ssize_t)tokens->size);
+    if (!list) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < tokens->size; i++) {
+        PyObject* item = PyLong_FromLong(tokens->data[i]);
+        if (!item) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+
+    return list;
+}
+
+// Returns the values as an `array.array` of C ints, which stores them
+// compactly instead of as one Python object per value.
+static PyObject* vector_to_array(const struct IntVector* vec) {
+    PyObject* array_module = PyImport_ImportModule("array");
+    if (!array_module) {
         return NULL;
     }
+
+    PyObject* data = PyBytes_FromStringAndSize(
+        (const char*)vec->data, (Py_ssize_t)(vec->size * sizeof(int)));
+    if (!data) {
+        Py_DECREF(array_module);
+        return NULL;
+    }
+
+    PyObject* array =
+        PyObject_CallMethod(array_module, "array", "sO", "i", data);
+    Py_DECREF(data);
+    Py_DECREF(array_module);
+
+    return array;
+}
+
+// Tokens to decode, either in the caller's buffer of 32-bit integers or
+// converted from its items into an array of our own.
+struct TokenArray {
+    int* tokens;
+    Py_ssize_t len;
+    Py_buffer view;
+    bool has_view;
+    bool owned;
+};
+
+// Whether `view` is a one dimensional buffer of integers in native byte
+// order, and if so whether they are signed.
+static bool buffer_holds_ints(const Py_buffer* view, bool* is_signed) {
+    const char* format = view->format ? view->format : "B";
+    if (*format == '@' || *format == '=') {
+        format++;
+    } else if (*format == '<' || *format == '>' || *format == '!') {
+        if (view->itemsize > 1 && (*format == '<') != PY_LITTLE_ENDIAN) {
+            return false;
+        }
+        format++;
+    }
+    if (view->ndim != 1 || format[0] == '\0' || format[1] != '\0' ||
+        !strchr("bBhHiIlLqQnN", format[0])) {
+        return false;
+    }
+    if (view->itemsize != 1 && view->itemsize != 2 && view->itemsize != 4 &&
+        view->itemsize != 8) {
+        return false;
+    }
+    *is_signed = format[0] >= 'a';
+    return true;
+}
+
+// Reads a buffer item as a token id. Values that are no token id of any
+// vocabulary become -1, which `decode` rejects.
+static int buffer_token_at(const char* item,
+                           Py_ssize_t itemsize,
+                           bool is_signed) {
+    int64_t value = 0;
+    switch (itemsize) {
+        case 1:
+            value = is_signed ? *(const int8_t*)item : *(const uint8_t*)item;
+            break;
+        case 2: {
+            uint16_t raw = 0;
+            memcpy(&raw, item, sizeof(raw));
+            value = is_signed ? (int16_t)raw : raw;
+            break;
+        }
+        case 4: {
+            uint32_t raw = 0;
+            memcpy(&raw, item, sizeof(raw));
+            value = is_signed ? (int32_t)raw : (int64_t)raw;
+            break;
+        }
+        default: {
+            uint64_t raw = 0;
+            memcpy(&raw, item, sizeof(raw));
+            value = is_signed || raw <= INT64_MAX ? (int64_t)raw : -1;
+            break;
+        }
+    }
+    return value >= 0 && value <= INT_MAX ? (int)value : -1;
+}
+
+static void token_array_release(struct TokenArray* array) {
+    if (array->owned) {
+        free(array->tokens);
+    }
+    if (array->has_view) {
+        PyBuffer_Release(&array->view);
+    }
+    *array = (struct TokenArray){0};
+}
+
+/*
+ * Collects the tokens of `obj`, a sequence of ints or an object supporting
+ * the buffer protocol such as `array.array`, a numpy array or a memoryview.
+ * A contiguous buffer of 32-bit integers is used in place, without reading
+ * each item as a Python int. Release with `token_array_release`.
+ */
+static bool token_array_from_object(PyObject* obj, struct TokenArray* array) {
+    *array = (struct TokenArray){0};
+
+    if (PyObject_CheckBuffer(obj)) {
+        if (PyObject_GetBuffer(obj, &array->view, PyBUF_RECORDS_RO) < 0) {
+            return false;
+        }
+        array->has_view = true;
+
+        bool is_signed = false;
+        if (!buffer_holds_ints(&array->view, &is_signed)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "Token buffer must be a one dimensional buffer "
+                            "of integers.");
+            token_array_release(array);
+            return false;
+        }
+
+        const Py_buffer* view = &array->view;
+        array->len = view->shape ? view->shape[0] : view->len / view->itemsize;
+        if (array->len > INT_MAX) {
+            PyErr_SetString(PyExc_ValueError, "Too many tokens.");
+            token_array_release(array);
+            return false;
+        }
+        Py_ssize_t stride = view->strides ? view->strides[0] : view->itemsize;
+
+        // Unsigned values above INT_MAX read as negative, which `decode`
+        // rejects the same way.
+        if (view->itemsize == sizeof(int) && stride == sizeof(int)) {
+            array->tokens = (int*)view->buf;
+            return true;
+        }
+
+        array->tokens = malloc((array->len > 0 ? array->len : 1) * sizeof(int));
+        if (!array->tokens) {
+            token_array_release(array);
+            PyErr_NoMemory();
+            return false;
+        }
+        array->owned = true;
+        for (Py_ssize_t i = 0; i < array->len; i++) {
+            array->tokens[i] = buffer_token_at(
+                (const char*)view->buf + i * stride, view->itemsize, is_signed);
+        }
+        return true;
+    }
+
+    PyObject* seq = PySequence_Fast(obj, "Tokens must be a sequence of ints.");
+    if (!seq) {
+        return false;
+    }
+    array->len = PySequence_Fast_GET_SIZE(seq);
+    if (array->len > INT_MAX) {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_ValueError, "Too many tokens.");
+        return false;
+    }
+    array->tokens = malloc((array->len > 0 ? array->len : 1) * sizeof(int));
+    if (!array->tokens) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return false;
+    }
+    array->owned = true;
+    for (Py_ssize_t i = 0; i < array->len; i++) {
+        long value = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+        if (value == -1 && PyErr_Occurred()) {
+            Py_DECREF(seq);
+            token_array_release(array);
+            return false;
+        }
+        array->tokens[i] = value >= 0 && value <= INT_MAX ? (int)value : -1;
+    }
+    Py_DECREF(seq);
+
+    return true;
+}
+
+static int compare_ints(const void* a, const void* b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// Merges between checkpoints, if training is given a checkpoint path.
+static const Py_ssize_t DEFAULT_CHECKPOINT_EVERY = 1000;
+
+static bool parse_checkpoint_args(const char* path,
+                                  Py_ssize_t every,
+                                  const char* resume_from,
+                                  struct TrainCheckpoint* checkpoint) {
+    if (every <= 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "checkpoint_every must be a positive number.");
+        return false;
+    }
+    *checkpoint = (struct TrainCheckpoint){
+        .path = path, .every = (size_t)every, .resume_from = resume_from};
+    return true;
+}
+
+// Merges between progress reports, if training is given a callback.
+static const Py_ssize_t DEFAULT_PROGRESS_EVERY = 1000;
+
+// Passes the progress of training to the Python callable in `data`. What it
+// returns is ignored; only an exception from it stops training.
+static bool report_train_progress(const struct TrainProgress* progress,
+                                  void* data) {
+    PyObject* info = Py_BuildValue(
+        "{s:n,s:n,s:L,s:d,s:d,s:n,s:O}", "num_merges",
+        (Py_ssize_t)progress->num_merges, "vocab_size",
+        (Py_ssize_t)progress->vocab_size, "pair_count",
+        (long long)progress->pair_count, "elapsed_seconds",
+        progress->elapsed_seconds, "merges_per_second",
+        progress->merges_per_second, "memory_bytes",
+        (Py_ssize_t)progress->memory_bytes, "done",
+        progress->done ? Py_True : Py_False);
+    if (!info) {
+        return false;
+    }
+    PyObject* result =
+        PyObject_CallFunctionObjArgs((PyObject*)data, info, NULL);
+    Py_DECREF(info);
+    if (!result) {
+        return false;
+    }
+    Py_DECREF(result);
+    return true;
+}
+
+static bool parse_progress_args(PyObject* callback,
+                                Py_ssize_t every,
+                                struct TrainProgressHook* progress) {
+    *progress = (struct TrainProgressHook){0};
+    if (callback == NULL || callback == Py_None) {
+        return true;
+    }
+    if (!PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "progress must be callable.");
+        return false;
+    }
+    if (every <= 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "progress_every must be a positive number.");
+        return false;
+    }
+    progress->report = report_train_progress;
+    progress->data = callback;
+    progress->every = (size_t)every;
+    return true;
+}
+
+/*
+ * Reads `vocab_size`, a single size or a list of sizes to save the
+ * vocabulary at, into `vocab_sizes` in increasing order without repeats.
+ * The sizes have to be freed by the caller.
+ */
+static bool parse_train_args(PyObject* vocab_size,
+                             const char* vocab_file_name,
+                             struct VocabSizes* vocab_sizes) {
     size_t len = strlen(vocab_file_name);
     if (len < 4 || strcmp(vocab_file_name + (len - 4), ".txt") != 0) {
         PyErr_SetString(PyExc_RuntimeError,
                         "vocab_file_name file extension must be .txt.");
+        return false;
+    }
+
+    PyObject* seq = PyLong_Check(vocab_size)
+                        ? PyTuple_Pack(1, vocab_size)
+                        : PySequence_Fast(vocab_size,
+                                          "vocab_size must be an int or a "
+                                          "list of ints.");
+    if (!seq) {
+        return false;
+    }
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+    if (count == 0) {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_ValueError, "vocab_size must not be empty.");
+        return false;
+    }
+    vocab_sizes->sizes = malloc(count * sizeof(int));
+    if (!vocab_sizes->sizes) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return false;
+    }
+
+    for (Py_ssize_t i = 0; i < count; i++) {
+        long size = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+        if (size == -1 && PyErr_Occurred()) {
+            Py_DECREF(seq);
+            free(vocab_sizes->sizes);
+            return false;
+        }
+        if (size < 256 || size > INT_MAX) {
+            Py_DECREF(seq);
+            free(vocab_sizes->sizes);
+            PyErr_SetString(
+                PyExc_RuntimeError,
+                "vocab_size must be at least 256 to encode all bytes.");
+            return false;
+        }
+        vocab_sizes->sizes[i] = (int)size;
+    }
+    Py_DECREF(seq);
+
+    qsort(vocab_sizes->sizes, count, sizeof(int), compare_ints);
+    vocab_sizes->count = 1;
+    for (Py_ssize_t i = 1; i < count; i++) {
+        if (vocab_sizes->sizes[i] != vocab_sizes->sizes[i - 1]) {
+            vocab_sizes->sizes[vocab_sizes->count++] = vocab_sizes->sizes[i];
+        }
+    }
+    return true;
+}
+
+PyObject* p_bpe_train(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"text",
+                             "vocab_size",
+                             "vocab_file_name",
+                             "num_threads",
+                             "merges_file_path",
+                             "checkpoint_path",
+                             "checkpoint_every",
+                             "resume_from",
+                             "progress",
+                             "progress_every",
+                             NULL};
+    char* data = NULL;
+    char* vocab_file_name = NULL;
+    char* merges_file_path = NULL;
+    char* checkpoint_path = NULL;
+    char* resume_from = NULL;
+    PyObject* vocab_size = NULL;
+    int num_threads = 0;
+    Py_ssize_t checkpoint_every = DEFAULT_CHECKPOINT_EVERY;
+    PyObject* progress_callback = NULL;
+    Py_ssize_t progress_every = DEFAULT_PROGRESS_EVERY;
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kwargs, "sOs|izznzOn", kwlist, &data, &vocab_size,
+            &vocab_file_name, &num_threads, &merges_file_path,
+            &checkpoint_path, &checkpoint_every, &resume_from,
+            &progress_callback, &progress_every)) {
+        return NULL;
+    }
+    if (num_threads <= 0) {
+        num_threads = cpu_count();
+    }
+
+    struct TrainCheckpoint checkpoint;
+    struct TrainProgressHook progress;
+    if (!parse_checkpoint_args(checkpoint_path, checkpoint_every, resume_from,
+                               &checkpoint) ||
+        !parse_progress_args(progress_callback, progress_every, &progress)) {
+        return NULL;
+    }
+    struct VocabSizes vocab_sizes;
+    if (!parse_train_args(vocab_size, vocab_file_name, &vocab_sizes)) {
         return NULL;
     }
 
-    bpe_train(data, vocab_size, pattern, vocab_file_name);
+    bool ok = bpe_train(data, &vocab_sizes, pattern, vocab_file_name,
+                        merges_file_path, &checkpoint, &progress,
+                        num_threads);
+    free(vocab_sizes.sizes);
+    if (!ok) {
+        return NULL;
+    }
 
-    return Py_None;
+    Py_RETURN_NONE;
 }
 
-PyObject* p_bbpe_train(PyObject* self, PyObject* args) {
+PyObject* p_bbpe_train(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"text",
+                             "vocab_size",
+                             "vocab_file_name",
+                             "pretokenize",
+                             "num_threads",
+                             "merges_file_path",
+                             "checkpoint_path",
+                             "checkpoint_every",
+                             "resume_from",
+                             "progress",
+                             "progress_every",
+                             NULL};
     char* data = NULL;
     char* vocab_file_name = NULL;
-    int vocab_size = 256;
+    char* merges_file_path = NULL;
+    char* checkpoint_path = NULL;
+    char* resume_from = NULL;
+    PyObject* vocab_size = NULL;
+    int pretokenize = 0;
+    int num_threads = 0;
+    Py_ssize_t checkpoint_every = DEFAULT_CHECKPOINT_EVERY;
+    PyObject* progress_callback = NULL;
+    Py_ssize_t progress_every = DEFAULT_PROGRESS_EVERY;
 
-    if (!PyArg_ParseTuple(args, "sis", &data, &vocab_size, &vocab_file_name)) {
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kwargs, "sOs|pizznzOn", kwlist, &data, &vocab_size,
+            &vocab_file_name, &pretokenize, &num_threads, &merges_file_path,
+            &checkpoint_path, &checkpoint_every, &resume_from,
+            &progress_callback, &progress_every)) {
         return NULL;
     }
+    if (num_threads <= 0) {
+        num_threads = cpu_count();
+    }
 
-    if (vocab_size < 256) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "vocab_size must be at least 256 to encode all bytes.");
+    struct TrainCheckpoint checkpoint;
+    struct TrainProgressHook progress;
+    if (!parse_checkpoint_args(checkpoint_path, checkpoint_every, resume_from,
+                               &checkpoint) ||
+        !parse_progress_args(progress_callback, progress_every, &progress)) {
         return NULL;
     }
-    size_t len = strlen(vocab_file_name);
-    if (len < 4 || strcmp(vocab_file_name + (len - 4), ".txt") != 0) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "vocab_file_name file extension must be .txt.");
+    struct VocabSizes vocab_sizes;
+    if (!parse_train_args(vocab_size, vocab_file_name, &vocab_sizes)) {
+        return NULL;
+    }
+
+    bool ok = bbpe_train(data, &vocab_sizes, pattern, vocab_file_name,
+                         merges_file_path, &checkpoint, &progress,
+                         pretokenize, num_threads);
+    free(vocab_sizes.sizes);
+    if (!ok) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * The statistics of a training on files. The count of the last merge, the
+ * smallest one, decides how reliable the sampled counts are: its relative
+ * standard error is about sqrt((1 - f) / count) when a fraction f of the
+ * input is read, taking the occurrences to be sampled independently.
+ */
+static PyObject* train_sample_to_dict(const struct TrainSample* sample,
+                                      const struct WordCounts* counts,
+                                      int64_t min_merge_count) {
+    double rate = sample->total_bytes > 0 ? (double)sample->sampled_bytes /
+                                                (double)sample->total_bytes
+                                          : 1.0;
+    double count_error = 0.0;
+    if (rate < 1.0 && min_merge_count > 0) {
+        count_error = sqrt((1.0 - rate) / (double)min_merge_count);
+    }
+
+    return Py_BuildValue(
+        "{s:n,s:n,s:n,s:L,s:L,s:d}", "total_bytes",
+        (Py_ssize_t)sample->total_bytes, "sampled_bytes",
+        (Py_ssize_t)sample->sampled_bytes, "num_words",
+        (Py_ssize_t)counts->words->count, "total_words",
+        (long long)counts->total, "min_merge_count",
+        (long long)min_merge_count, "count_error", count_error);
+}
+
+PyObject* p_bpe_train_files(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"input_paths",
+                             "vocab_size",
+                             "vocab_file_name",
+                             "num_threads",
+                             "sample_bytes",
+                             "seed",
+                             "merges_file_path",
+                             "checkpoint_path",
+                             "checkpoint_every",
+                             "resume_from",
+                             "progress",
+                             "progress_every",
+                             NULL};
+    PyObject* py_paths = NULL;
+    char* vocab_file_name = NULL;
+    char* merges_file_path = NULL;
+    char* checkpoint_path = NULL;
+    char* resume_from = NULL;
+    PyObject* vocab_size = NULL;
+    int num_threads = 0;
+    Py_ssize_t sample_bytes = 0;
+    unsigned long long seed = 0;
+    Py_ssize_t checkpoint_every = DEFAULT_CHECKPOINT_EVERY;
+    PyObject* progress_callback = NULL;
+    Py_ssize_t progress_every = DEFAULT_PROGRESS_EVERY;
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kwargs, "OOs|inKzznzOn", kwlist, &py_paths, &vocab_size,
+            &vocab_file_name, &num_threads, &sample_bytes, &seed,
+            &merges_file_path, &checkpoint_path, &checkpoint_every,
+            &resume_from, &progress_callback, &progress_every)) {
+        return NULL;
+    }
+    if (num_threads <= 0) {
+        num_threads = cpu_count();
+    }
+    struct TrainCheckpoint checkpoint;
+    struct TrainProgressHook progress;
+    if (!parse_checkpoint_args(checkpoint_path, checkpoint_every, resume_from,
+                               &checkpoint) ||
+        !parse_progress_args(progress_callback, progress_every, &progress)) {
+        return NULL;
+    }
+
+    // A single path is accepted as well as a list of them.
+    PyObject* paths = NULL;
+    if (PyUnicode_Check(py_paths) || PyBytes_Check(py_paths) ||
+        PyObject_HasAttrString(py_paths, "__fspath__")) {
+        paths = PyTuple_Pack(1, py_paths);
+    } else {
+        paths = PySequence_Tuple(py_paths);
+    }
+    if (!paths) {
+        return NULL;
+    }
+    struct VocabSizes vocab_sizes;
+    if (!parse_train_args(vocab_size, vocab_file_name, &vocab_sizes)) {
+        Py_DECREF(paths);
+        return NULL;
+    }
+
+    Py_ssize_t num_paths = PyTuple_GET_SIZE(paths);
+    PyObject** encoded_paths = calloc(num_paths > 0 ? num_paths : 1,
+                                      sizeof(PyObject*));
+    const char** input_paths =
+        malloc((num_paths > 0 ? num_paths : 1) * sizeof(char*));
+    if (!encoded_paths || !input_paths) {
+        free(encoded_paths);
+        free(input_paths);
+        free(vocab_sizes.sizes);
+        Py_DECREF(paths);
+        return PyErr_NoMemory();
+    }
+
+    Py_ssize_t converted = 0;
+    for (; converted < num_paths; converted++) {
+        if (!PyUnicode_FSConverter(PyTuple_GET_ITEM(paths, converted),
+                                   &encoded_paths[converted])) {
+            break;
+        }
+        input_paths[converted] = PyBytes_AS_STRING(encoded_paths[converted]);
+    }
+
+    PyObject* result = NULL;
+    struct WordStream stream;
+    if (converted == num_paths &&
+        word_stream_init(&stream, pattern, num_threads)) {
+        struct TrainSample sample = {
+            .max_bytes = sample_bytes > 0 ? (size_t)sample_bytes : 0,
+            .seed = seed};
+        int64_t min_merge_count = 0;
+        // A resumed run has counted its words before, and reads nothing.
+        if ((resume_from != NULL ||
+             word_stream_sample_files(&stream, input_paths, num_paths,
+                                      &sample)) &&
+            bpe_train_word_counts(&stream.counts, &vocab_sizes,
+                                  vocab_file_name, merges_file_path,
+                                  &checkpoint, &progress, num_threads,
+                                  &min_merge_count)) {
+            result =
+                train_sample_to_dict(&sample, &stream.counts, min_merge_count);
+        }
+        word_stream_free(&stream);
+    }
+
+    for (Py_ssize_t i = 0; i < converted; i++) {
+        Py_DECREF(encoded_paths[i]);
+    }
+    free(encoded_paths);
+    free(input_paths);
+    free(vocab_sizes.sizes);
+    Py_DECREF(paths);
+
+    return result;
+}
+
+PyObject* p_bpe_train_iter(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"texts",
+                             "vocab_size",
+                             "vocab_file_name",
+                             "num_threads",
+                             "merges_file_path",
+                             "checkpoint_path",
+                             "checkpoint_every",
+                             "resume_from",
+                             "progress",
+                             "progress_every",
+                             NULL};
+    PyObject* texts = NULL;
+    char* vocab_file_name = NULL;
+    char* merges_file_path = NULL;
+    char* checkpoint_path = NULL;
+    char* resume_from = NULL;
+    PyObject* vocab_size = NULL;
+    int num_threads = 0;
+    Py_ssize_t checkpoint_every = DEFAULT_CHECKPOINT_EVERY;
+    PyObject* progress_callback = NULL;
+    Py_ssize_t progress_every = DEFAULT_PROGRESS_EVERY;
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kwargs, "OOs|izznzOn", kwlist, &texts, &vocab_size,
+            &vocab_file_name, &num_threads, &merges_file_path,
+            &checkpoint_path, &checkpoint_every, &resume_from,
+            &progress_callback, &progress_every)) {
+        return NULL;
+    }
+    if (num_threads <= 0) {
+        num_threads = cpu_count();
+    }
+    struct TrainCheckpoint checkpoint;
+    struct TrainProgressHook progress;
+    if (!parse_checkpoint_args(checkpoint_path, checkpoint_every, resume_from,
+                               &checkpoint) ||
+        !parse_progress_args(progress_callback, progress_every, &progress)) {
+        return NULL;
+    }
+
+    PyObject* iter = PyObject_GetIter(texts);
+    if (!iter) {
+        return NULL;
+    }
+    struct VocabSizes vocab_sizes;
+    if (!parse_train_args(vocab_size, vocab_file_name, &vocab_sizes)) {
+        Py_DECREF(iter);
+        return NULL;
+    }
+    struct WordStream stream;
+    if (!word_stream_init(&stream, pattern, num_threads)) {
+        free(vocab_sizes.sizes);
+        Py_DECREF(iter);
         return NULL;
     }
 
-    bbpe_train(data, vocab_size, vocab_file_name);
+    // The chunks are parts of one text, like the ones fed to an `Encoder`.
+    // A resumed run has counted its words before, and reads nothing.
+    // Every byte fed is counted, so the sample is the whole text.
+    struct TrainSample sample = {0};
+    bool ok = true;
+    PyObject* item = NULL;
+    while (ok && resume_from == NULL && (item = PyIter_Next(iter)) != NULL) {
+        char* chunk = NULL;
+        size_t chunk_len = 0;
+        bool owns_chunk = false;
+        if (PyUnicode_Check(item)) {
+            chunk = unicode_as_utf8(item, &chunk_len, &owns_chunk);
+        } else if (PyBytes_Check(item)) {
+            chunk = PyBytes_AS_STRING(item);
+            chunk_len = (size_t)PyBytes_GET_SIZE(item);
+        } else {
+            PyErr_SetString(PyExc_TypeError,
+                            "texts must yield str or bytes objects.");
+        }
+        ok = chunk != NULL && word_stream_feed(&stream, chunk, chunk_len);
+        sample.total_bytes += chunk_len;
+        sample.sampled_bytes += chunk_len;
+        if (owns_chunk) {
+            free(chunk);
+        }
+        Py_DECREF(item);
+    }
+    int64_t min_merge_count = 0;
+    ok = ok && !PyErr_Occurred() && word_stream_finish(&stream) &&
+         bpe_train_word_counts(&stream.counts, &vocab_sizes, vocab_file_name,
+                               merges_file_path, &checkpoint, &progress,
+                               num_threads, &min_merge_count);
+
+    PyObject* result =
+        ok ? train_sample_to_dict(&sample, &stream.counts, min_merge_count)
+           : NULL;
+    word_stream_free(&stream);
+    free(vocab_sizes.sizes);
+    Py_DECREF(iter);
 
-    return Py_None;
+    return result;
 }
 
 int initialize_context(void) {
@@ -150,6 +905,7 @@ int initialize_context(void) {
     global_encode_context->pattern = pattern;
     global_encode_context->num_merge_rules = 0;
     global_encode_context->merges_map = NULL;
+    global_encode_context->merges_from_bytes = false;
 
     global_encode_context->vocab_encode =
         hashmap_new(256, sizeof(struct Token), token_hash, token_compare);
@@ -342,7 +1098,9 @@ static PyObject* p_initialize(PyObject* self,
         hex_str_to_ascii(string_c_str(&hex_buffer), ascii_str,
                          sizeof(ascii_str));
 
-        if (ascii_str[0] == '\0') {
+        // A trained vocabulary has the NUL byte as the empty token 0x00.
+        if (ascii_str[0] == '\0' &&
+            strcmp(string_c_str(&hex_buffer), "0x00") != 0) {
             log_debug("Error: Failed to convert hex string to ASCII: %s",
                       string_c_str(&hex_buffer));
             (void)fclose(file);
@@ -389,8 +1147,8 @@ static PyObject* p_initialize(PyObject* self,
 
     global_encode_context->initialized_encode = true;
 
-    global_decode_context->vocab_decode = (char**)malloc(
-        global_decode_context->vocab_size_decode * sizeof(char*));
+    global_decode_context->vocab_decode = (char**)calloc(
+        global_decode_context->vocab_size_decode, sizeof(char*));
     if (!global_decode_context->vocab_decode) {
         (void)fclose(file);
         hashmap_free(global_encode_context->vocab_encode);
@@ -403,7 +1161,7 @@ static PyObject* p_initialize(PyObject* self,
     }
 
     global_decode_context->vocab_decode_lens =
-        malloc(global_decode_context->vocab_size_decode * sizeof(size_t));
+        calloc(global_decode_context->vocab_size_decode, sizeof(size_t));
 
     if (!global_decode_context->vocab_decode_lens) {
         (void)fclose(file);
@@ -570,6 +1328,12 @@ static PyObject* p_initialize(PyObject* self,
 
     (void)fclose(special_chars_file);
 
+    if (!decode_build_table(global_decode_context)) {
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to allocate memory for the decode table.");
+        return NULL;
+    }
+
     if (merges_file_path != NULL) {
         log_debug("Loading merge rules from %s.", merges_file_path);
         FILE* merges_file = fopen(merges_file_path, "r");
@@ -584,6 +1348,15 @@ static PyObject* p_initialize(PyObject* self,
 
         size_t line_count = 0;
         char line_buffer[MAX_LINE_LENGTH];
+        // Merges written by training hold hex bytes, which are also what
+        // the ID path splits words into.
+        bool hex_merges = false;
+        if (fgets(line_buffer, sizeof(line_buffer), merges_file)) {
+            line_buffer[strcspn(line_buffer, "\r\n")] = 0;
+            hex_merges = strcmp(line_buffer, MERGES_HEX_HEADER) == 0;
+        }
+        global_encode_context->merges_from_bytes = hex_merges;
+        (void)fseek(merges_file, 0L, SEEK_SET);
         while (fgets(line_buffer, sizeof(line_buffer), merges_file)) {
             if (line_buffer[0] != '#' && strchr(line_buffer, ' ') != NULL) {
                 line_count++;
@@ -617,6 +1390,15 @@ static PyObject* p_initialize(PyObject* self,
                 if (!left_str || !right_str) {
                     continue;
                 }
+                char left_bytes[MAX_LINE_LENGTH];
+                char right_bytes[MAX_LINE_LENGTH];
+                if (hex_merges) {
+                    hex_str_to_ascii(left_str, left_bytes, sizeof(left_bytes));
+                    hex_str_to_ascii(right_str, right_bytes,
+                                     sizeof(right_bytes));
+                    left_str = left_bytes;
+                    right_str = right_bytes;
+                }
 
                 const struct Token* left =
                     hashmap_get(global_encode_context->vocab_encode,
@@ -665,8 +1447,50 @@ static PyObject* p_initialize(PyObject* self,
     Py_RETURN_NONE;
 }
 
-PyObject* p_encode(PyObject* self, PyObject* args) {
+/*
+ * Appends a special token to the registry of `ctx`. The automaton's failure
+ * links have to be rebuilt afterwards.
+ */
+static bool register_special_token(struct EncodeContext* ctx,
+                                   const char* token,
+                                   int id) {
+    for (size_t i = 0; i < ctx->num_special_tokens; i++) {
+        if (strcmp(ctx->special_tokens[i], token) == 0) {
+            ctx->special_token_ids[i] = id;
+            return true;
+        }
+    }
+
+    size_t n = ctx->num_special_tokens;
+    char** tokens = realloc(ctx->special_tokens, (n + 1) * sizeof(char*));
+    if (!tokens) {
+        return false;
+    }
+    ctx->special_tokens = tokens;
+    int* ids = realloc(ctx->special_token_ids, (n + 1) * sizeof(int));
+    if (!ids) {
+        return false;
+    }
+    ctx->special_token_ids = ids;
+
+    ctx->special_tokens[n] = strdup(token);
+    if (!ctx->special_tokens[n] ||
+        !ac_automaton_add_string(ctx->special_tokens_ac, token, (int)n)) {
+        free(ctx->special_tokens[n]);
+        return false;
+    }
+    ctx->special_token_ids[n] = id;
+    ctx->num_special_tokens++;
+
+    if (strpbrk(token + 1, " \t\n\r\v\f") != NULL) {
+        ctx->special_tokens_contain_whitespace = true;
+    }
+    return true;
+}
+
+static PyObject* p_add_special_tokens(PyObject* self, PyObject* args) {
     struct EncodeContext* ctx = global_encode_context;
+    PyObject* tokens = NULL;
 
     if (!ctx || !ctx->initialized_encode) {
         PyErr_SetString(PyExc_RuntimeError,
@@ -675,424 +1499,1939 @@ PyObject* p_encode(PyObject* self, PyObject* args) {
         return NULL;
     }
 
-    char* text = NULL;
-
-    if (!PyArg_ParseTuple(args, "s", &text)) {
+    if (!PyArg_ParseTuple(args, "O", &tokens)) {
         return NULL;
     }
 
-    if (!text) {
-        PyErr_SetString(PyExc_ValueError, "Text is empty.");
+    PyObject* seq =
+        PySequence_Fast(tokens, "Expected a list of special token strings.");
+    if (!seq) {
         return NULL;
     }
 
-    struct IntVector tokens_vec;
-    vector_init(&tokens_vec, 256);
-
-    encode(&(struct EncodeTask){
-        .text = text,
-        .ctx = ctx,
-        .tokens = &tokens_vec,
-        .error_msg = NULL,
-    });
-
-    PyObject* list = PyList_New(tokens_vec.size);
-    if (!list) {
-        PyErr_NoMemory();
-        vector_free(&tokens_vec);
-        return NULL;
+    // Every token has to be in the vocabulary before any is registered.
+    Py_ssize_t num_tokens = PySequence_Fast_GET_SIZE(seq);
+    int* ids = malloc((num_tokens > 0 ? num_tokens : 1) * sizeof(int));
+    if (!ids) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
     }
-
-    for (size_t i = 0; i < tokens_vec.size; i++) {
-        PyObject* item = PyLong_FromLong(tokens_vec.data[i]);
-        if (!item) {
-            vector_free(&tokens_vec);
-            Py_DECREF(list);  // cleanup in case of error
-            PyErr_NoMemory();
+    for (Py_ssize_t i = 0; i < num_tokens; i++) {
+        PyObject* item = PySequence_Fast_GET_ITEM(seq, i);
+        const char* token =
+            PyUnicode_Check(item) ? PyUnicode_AsUTF8(item) : NULL;
+        if (!token) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_TypeError,
+                                "Special tokens must be strings.");
+            }
+            free(ids);
+            Py_DECREF(seq);
             return NULL;
         }
-        PyList_SetItem(list, i, item);
+        const struct Token* found = hashmap_get(
+            ctx->vocab_encode, &(struct Token){.key = (char*)token});
+        if (token[0] == '\0' || !found) {
+            PyErr_Format(PyExc_ValueError,
+                         "Special token '%s' is not in the vocabulary.",
+                         token);
+            free(ids);
+            Py_DECREF(seq);
+            return NULL;
+        }
+        ids[i] = found->value;
+    }
+
+    if (!ctx->special_tokens_ac) {
+        ctx->special_tokens_ac = ac_automaton_create();
+    }
+    bool ok = ctx->special_tokens_ac != NULL;
+    for (Py_ssize_t i = 0; ok && i < num_tokens; i++) {
+        const char* token = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+        ok = register_special_token(ctx, token, ids[i]);
+        log_debug("Registered special token '%s' with id %d.", token, ids[i]);
+    }
+    free(ids);
+    Py_DECREF(seq);
+
+    if (ctx->special_tokens_ac) {
+        ac_automaton_build_failure_links(ctx->special_tokens_ac);
+    }
+    if (!ok) {
+        PyErr_SetString(PyExc_MemoryError,
+                        "Failed to allocate memory for special tokens.");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+// Errors caused by the input rather than by hutoken are ValueErrors.
+static PyObject* encode_error_type(const char* error_msg) {
+    if (error_msg == ENCODE_DISALLOWED_SPECIAL_MSG ||
+        error_msg == ENCODE_NUL_CHARACTER_MSG) {
+        return PyExc_ValueError;
+    }
+    return PyExc_RuntimeError;
+}
+
+/*
+ * Sets the policy of the special tokens named by `names` to `value`. `names`
+ * is None, the string "all", which only applies to the tokens that have no
+ * policy yet, or an iterable of strings. Unregistered names are ignored.
+ */
+static bool apply_special_policy(const struct EncodeContext* ctx,
+                                 PyObject* names,
+                                 unsigned char value,
+                                 unsigned char* policy) {
+    if (names == Py_None) {
+        return true;
+    }
+
+    if (PyUnicode_Check(names)) {
+        if (PyUnicode_CompareWithASCIIString(names, "all") != 0) {
+            PyErr_SetString(PyExc_TypeError,
+                            "Expected 'all' or a collection of special "
+                            "tokens.");
+            return false;
+        }
+        for (size_t i = 0; i < ctx->num_special_tokens; i++) {
+            if (policy[i] == SPECIAL_TOKEN_TEXT) {
+                policy[i] = value;
+            }
+        }
+        return true;
+    }
+
+    PyObject* iter = PyObject_GetIter(names);
+    if (!iter) {
+        return false;
+    }
+
+    PyObject* item = NULL;
+    while ((item = PyIter_Next(iter)) != NULL) {
+        const char* name =
+            PyUnicode_Check(item) ? PyUnicode_AsUTF8(item) : NULL;
+        if (!name) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_TypeError,
+                                "Special tokens must be strings.");
+            }
+            Py_DECREF(item);
+            Py_DECREF(iter);
+            return false;
+        }
+        for (size_t i = 0; i < ctx->num_special_tokens; i++) {
+            if (strcmp(ctx->special_tokens[i], name) == 0) {
+                policy[i] = value;
+                break;
+            }
+        }
+        Py_DECREF(item);
+    }
+    Py_DECREF(iter);
+
+    return !PyErr_Occurred();
+}
+
+/*
+ * Builds the special token policy of an encode call from its
+ * `allowed_special` and `disallowed_special` arguments, as in tiktoken:
+ * allowed special tokens are encoded as their ids, disallowed ones make the
+ * encode fail, and the others are encoded as text. By default none are
+ * allowed and all are disallowed. `*policy` is set to NULL if every special
+ * token is treated as text.
+ */
+static bool special_policy_from_args(const struct EncodeContext* ctx,
+                                     PyObject* allowed,
+                                     PyObject* disallowed,
+                                     unsigned char** policy) {
+    *policy = NULL;
+    if (ctx->num_special_tokens == 0) {
+        return true;
+    }
+
+    unsigned char* result = calloc(ctx->num_special_tokens, 1);
+    if (!result) {
+        PyErr_NoMemory();
+        return false;
+    }
+
+    PyObject* all = PyUnicode_FromString("all");
+    bool ok = all != NULL &&
+              apply_special_policy(ctx, allowed ? allowed : Py_None,
+                                   SPECIAL_TOKEN_ALLOWED, result) &&
+              apply_special_policy(ctx, disallowed ? disallowed : all,
+                                   SPECIAL_TOKEN_DISALLOWED, result);
+    Py_XDECREF(all);
+    if (!ok) {
+        free(result);
+        return false;
+    }
+
+    for (size_t i = 0; i < ctx->num_special_tokens; i++) {
+        if (result[i] != SPECIAL_TOKEN_TEXT) {
+            *policy = result;
+            return true;
+        }
+    }
+    free(result);
+    return true;
+}
+
+/*
+ * Encodes a single document, described by the text, context, tokens and
+ * token budget of `task`. Texts of at least PARALLEL_ENCODE_THRESHOLD bytes
+ * are encoded with the GIL released and, when the built-in pretokenizer is
+ * used and there is no token budget, split at the positions returned by
+ * `encode_find_split` into pieces that are encoded on up to `num_threads`
+ * threads. The pieces' tokens are concatenated in order, which gives the same
+ * result as a serial encode. On return `task` holds the number of tokens, the
+ * consumed length and the error message of the first failing piece, as if it
+ * had been passed to `encode` directly.
+ */
+static void encode_document(struct EncodeTask* task, int num_threads) {
+    size_t text_len = task->text_len;
+
+    if (text_len < PARALLEL_ENCODE_THRESHOLD) {
+        encode(task);
+        return;
+    }
+
+    size_t num_pieces = 1;
+    // Splitting at a space is only safe if no special token contains one.
+    bool specials_split = task->special_policy != NULL &&
+                          task->ctx->special_tokens_contain_whitespace;
+    if (task->ctx->pattern == NULL && task->max_tokens == 0 &&
+        !specials_split && num_threads > 1) {
+        num_pieces = text_len / PARALLEL_ENCODE_MIN_PIECE;
+        if (num_pieces > (size_t)num_threads) {
+            num_pieces = num_threads;
+        }
+    }
+
+    if (num_pieces <= 1) {
+        Py_BEGIN_ALLOW_THREADS
+
+            encode(task);
+
+        Py_END_ALLOW_THREADS
+
+            return;
+    }
+
+    struct EncodeTask* tasks = malloc(num_pieces * sizeof(struct EncodeTask));
+    // Tokens, offsets and word ids of every piece.
+    struct IntVector* piece_vecs =
+        calloc(3 * num_pieces, sizeof(struct IntVector));
+    thread_t* threads = malloc(num_pieces * sizeof(thread_t));
+    if (!tasks || !piece_vecs || !threads) {
+        free(tasks);
+        free(piece_vecs);
+        free(threads);
+        task->error_msg = "Failed to allocate memory for parallel encoding.";
+        return;
+    }
+
+    size_t piece_size = text_len / num_pieces;
+    size_t start = 0;
+    int count = 0;
+    while (start < text_len && (size_t)count < num_pieces) {
+        size_t end =
+            (size_t)count == num_pieces - 1
+                ? text_len
+                : encode_find_split(task->text, text_len, start + piece_size);
+
+        struct IntVector* vecs = &piece_vecs[3 * count];
+        if (task->tokens) {
+            vector_init(&vecs[0], (end - start) / 2);
+        }
+        if (task->offsets) {
+            vector_init(&vecs[1], end - start);
+            vector_init(&vecs[2], (end - start) / 2);
+        }
+        tasks[count] = (struct EncodeTask){
+            .text = task->text + start,
+            .text_len = end - start,
+            .continuation = start > 0,
+            .ctx = task->ctx,
+            .tokens = task->tokens ? &vecs[0] : NULL,
+            .offsets = task->offsets ? &vecs[1] : NULL,
+            .word_ids = task->offsets ? &vecs[2] : NULL,
+            .special_policy = task->special_policy,
+            .error_msg = NULL};
+        start = end;
+        count++;
+    }
+
+    log_debug("Encoding document of %zu bytes in %d pieces.", text_len, count);
+
+    TaskQueue q;
+    taskqueue_init(&q, tasks, count);
+
+    Py_BEGIN_ALLOW_THREADS
+
+        for (int i = 0; i < count; i++) {
+        THREAD_CREATE(&threads[i], encode_wrapper, &q);
+    }
+
+    for (int i = 0; i < count; i++) {
+        THREAD_JOIN(threads[i]);
+    }
+
+    Py_END_ALLOW_THREADS
+
+        task->error_msg = NULL;
+    task->num_tokens = 0;
+    task->consumed = text_len;
+    int num_words = 0;
+    for (int i = 0; i < count; i++) {
+        struct IntVector* vecs = &piece_vecs[3 * i];
+        if (tasks[i].error_msg && !task->error_msg) {
+            task->error_msg = tasks[i].error_msg;
+        }
+        if (task->tokens) {
+            vector_append_array(task->tokens, vecs[0].data, vecs[0].size);
+        }
+        // Offsets and word ids are relative to the piece.
+        if (task->offsets) {
+            const int piece_start = (int)(tasks[i].text - task->text);
+            for (size_t j = 0; j < vecs[1].size; j++) {
+                vector_push(task->offsets, piece_start + vecs[1].data[j]);
+            }
+            for (size_t j = 0; j < vecs[2].size; j++) {
+                vector_push(task->word_ids, num_words + vecs[2].data[j]);
+            }
+            if (vecs[2].size > 0) {
+                num_words += vecs[2].data[vecs[2].size - 1] + 1;
+            }
+        }
+        for (int j = 0; j < 3; j++) {
+            vector_free(&vecs[j]);
+        }
+        task->num_tokens += tasks[i].num_tokens;
+    }
+
+    free(tasks);
+    free(piece_vecs);
+    free(threads);
+}
+
+/*
+ * Returns how many characters of a text to transcode for encoding `task`, all
+ * of them unless the task has a token budget. Special tokens and custom
+ * patterns may look further ahead than the end of a word, so with them the
+ * whole text is needed as well.
+ */
+static Py_ssize_t budget_prefix_chars(const struct EncodeTask* task) {
+    if (task->max_tokens == 0 || task->ctx->pattern != NULL ||
+        (task->special_policy && task->ctx->num_special_tokens > 0)) {
+        return PY_SSIZE_T_MAX;
+    }
+    if (task->max_tokens > (size_t)(PY_SSIZE_T_MAX / BUDGET_CHARS_PER_TOKEN)) {
+        return PY_SSIZE_T_MAX;
+    }
+    Py_ssize_t chars = (Py_ssize_t)task->max_tokens * BUDGET_CHARS_PER_TOKEN;
+    return chars > MIN_BUDGET_CHARS ? chars : MIN_BUDGET_CHARS;
+}
+
+/*
+ * Whether encoding a prefix of a text gave the same result as encoding all of
+ * it would: the budget ran out at a word that ends before the end of the
+ * prefix, so no later text could have changed it.
+ */
+static bool budget_prefix_encoded(const struct EncodeTask* task) {
+    return task->error_msg != NULL ||
+           (task->budget_end > 0 && task->budget_end < task->text_len);
+}
+
+/*
+ * Encodes the Python string `str` as the text of `task`, like
+ * `encode_document`. With a token budget only as much of a non-ASCII string
+ * is transcoded as the budget needs, starting from `budget_prefix_chars` and
+ * doubling, so that truncating a long document costs time in proportion to
+ * the budget rather than to the document. Text after the budget is not
+ * looked at. Tokens and offsets already in the task are replaced. Returns
+ * false with a Python exception set if the string cannot be transcoded.
+ */
+static bool encode_unicode(PyObject* str,
+                           struct EncodeTask* task,
+                           int num_threads) {
+    Py_ssize_t limit = budget_prefix_chars(task);
+
+    while (true) {
+        size_t text_len = 0;
+        bool owns_text = false;
+        bool complete = true;
+        char* text = unicode_prefix_as_utf8(str, limit, &text_len, &owns_text,
+                                            &complete);
+        if (!text) {
+            return false;
+        }
+
+        if (task->tokens) {
+            task->tokens->size = 0;
+        }
+        if (task->offsets) {
+            task->offsets->size = 0;
+            task->word_ids->size = 0;
+        }
+        task->text = text;
+        task->text_len = text_len;
+        encode_document(task, num_threads);
+        if (owns_text) {
+            free(text);
+        }
+        task->text = NULL;
+
+        if (complete || budget_prefix_encoded(task)) {
+            return true;
+        }
+
+        log_debug("Budget not reached in %zd characters, transcoding more.",
+                  limit);
+        limit = limit > PY_SSIZE_T_MAX / 2 ? PY_SSIZE_T_MAX : 2 * limit;
+    }
+}
+
+PyObject* p_encode(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"text",            "num_threads",
+                             "max_tokens",      "return_offsets",
+                             "allowed_special", "disallowed_special",
+                             NULL};
+    struct EncodeContext* ctx = global_encode_context;
+
+    if (!ctx || !ctx->initialized_encode) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Vocabulary is not initialized for encoding. "
+                        "Call 'initialize_encode' function first.");
+        return NULL;
+    }
+
+    PyObject* py_text = NULL;
+    int num_threads = 0;
+    Py_ssize_t max_tokens = -1;
+    int return_offsets = 0;
+    PyObject* allowed_special = NULL;
+    PyObject* disallowed_special = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|inpOO", kwlist,
+                                     &py_text, &num_threads, &max_tokens,
+                                     &return_offsets, &allowed_special,
+                                     &disallowed_special)) {
+        return NULL;
+    }
+
+    unsigned char* special_policy = NULL;
+    if (!special_policy_from_args(ctx, allowed_special, disallowed_special,
+                                  &special_policy)) {
+        return NULL;
+    }
+
+    if (num_threads <= 0) {
+        num_threads = cpu_count();
+    }
+
+    struct IntVector tokens_vec;
+    struct IntVector offsets_vec = {0};
+    struct IntVector word_ids_vec = {0};
+    vector_init(&tokens_vec, 256);
+    if (return_offsets) {
+        vector_init(&offsets_vec, 512);
+        vector_init(&word_ids_vec, 256);
+    }
+
+    struct EncodeTask task = {.text = NULL,
+                              .text_len = 0,
+                              .continuation = false,
+                              .ctx = ctx,
+                              .tokens = &tokens_vec,
+                              .offsets = return_offsets ? &offsets_vec : NULL,
+                              .word_ids = return_offsets ? &word_ids_vec : NULL,
+                              .max_tokens = max_tokens > 0 ? max_tokens : 0,
+                              .special_policy = special_policy,
+                              .error_msg = NULL};
+    bool transcoded =
+        max_tokens == 0 || encode_unicode(py_text, &task, num_threads);
+    free(special_policy);
+
+    PyObject* list = NULL;
+    PyObject* offsets = NULL;
+    PyObject* word_ids = NULL;
+
+    if (transcoded && task.error_msg) {
+        log_debug("Error occurred during encoding: %s", task.error_msg);
+        PyErr_SetString(encode_error_type(task.error_msg), task.error_msg);
+    } else if (transcoded) {
+        list = tokens_to_list(&tokens_vec);
+        if (list && return_offsets) {
+            offsets = vector_to_array(&offsets_vec);
+            word_ids = offsets ? vector_to_array(&word_ids_vec) : NULL;
+            if (!word_ids) {
+                Py_CLEAR(offsets);
+                Py_CLEAR(list);
+            }
+        }
     }
 
     vector_free(&tokens_vec);
+    vector_free(&offsets_vec);
+    vector_free(&word_ids_vec);
+
+    if (!list) {
+        return NULL;
+    }
+
+    // Offsets and the consumed length are only returned when asked for.
+    if (return_offsets && max_tokens >= 0) {
+        return Py_BuildValue("(NNNn)", list, offsets, word_ids,
+                             (Py_ssize_t)task.consumed);
+    }
+    if (return_offsets) {
+        return Py_BuildValue("(NNN)", list, offsets, word_ids);
+    }
+    if (max_tokens >= 0) {
+        return Py_BuildValue("(Nn)", list, (Py_ssize_t)task.consumed);
+    }
 
     return list;
 }
 
-PyObject* p_batch_encode(PyObject* self, PyObject* args) {
+PyObject* p_count_tokens(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"text",
+                             "num_threads",
+                             "max_tokens",
+                             "allowed_special",
+                             "disallowed_special",
+                             NULL};
+    struct EncodeContext* ctx = global_encode_context;
+
+    if (!ctx || !ctx->initialized_encode) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Vocabulary is not initialized for encoding. "
+                        "Call 'initialize_encode' function first.");
+        return NULL;
+    }
+
+    PyObject* py_text = NULL;
+    int num_threads = 0;
+    Py_ssize_t max_tokens = -1;
+    PyObject* allowed_special = NULL;
+    PyObject* disallowed_special = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|inOO", kwlist,
+                                     &py_text, &num_threads, &max_tokens,
+                                     &allowed_special, &disallowed_special)) {
+        return NULL;
+    }
+
+    unsigned char* special_policy = NULL;
+    if (!special_policy_from_args(ctx, allowed_special, disallowed_special,
+                                  &special_policy)) {
+        return NULL;
+    }
+
+    if (num_threads <= 0) {
+        num_threads = cpu_count();
+    }
+
+    struct EncodeTask task = {.text = NULL,
+                              .text_len = 0,
+                              .continuation = false,
+                              .ctx = ctx,
+                              .tokens = NULL,
+                              .max_tokens = max_tokens > 0 ? max_tokens : 0,
+                              .special_policy = special_policy,
+                              .error_msg = NULL};
+    bool transcoded =
+        max_tokens == 0 || encode_unicode(py_text, &task, num_threads);
+    free(special_policy);
+
+    if (!transcoded) {
+        return NULL;
+    }
+    if (task.error_msg) {
+        log_debug("Error occurred during counting: %s", task.error_msg);
+        PyErr_SetString(encode_error_type(task.error_msg), task.error_msg);
+        return NULL;
+    }
+
+    return PyLong_FromSize_t(task.num_tokens);
+}
+
+static void free_encode_tasks(struct EncodeTask* tasks,
+                              bool* owns_text,
+                              struct IntVector* token_vecs,
+                              thread_t* threads,
+                              unsigned char* special_policy,
+                              Py_ssize_t num_texts) {
+    for (Py_ssize_t i = 0; i < num_texts; i++) {
+        if (owns_text[i]) {
+            free(tasks[i].text);
+        }
+        vector_free(tasks[i].tokens);
+        vector_free(tasks[i].offsets);
+        vector_free(tasks[i].word_ids);
+    }
+    free(owns_text);
+    free(token_vecs);
+    free(threads);
+    free(special_policy);
+    free(tasks);
+}
+
+/*
+ * Shared by `batch_encode` and `batch_count_tokens`. With `count_only` the
+ * tokens are not collected and the result is a list of token counts instead
+ * of a list of token lists. With `max_tokens`, every text is truncated to
+ * that many tokens, and `batch_encode` also returns the number of bytes
+ * consumed from each text. With `return_offsets`, `batch_encode` also returns
+ * the offsets and word ids of every text, like `encode`.
+ */
+static PyObject* encode_texts(PyObject* args,
+                              PyObject* kwargs,
+                              bool count_only) {
+    static char* kwlist[] = {"texts",           "num_threads",
+                             "max_tokens",      "return_offsets",
+                             "allowed_special", "disallowed_special",
+                             NULL};
     struct EncodeContext* ctx = global_encode_context;
     thread_t* threads = NULL;
     struct EncodeTask* tasks = NULL;
     PyObject* texts = NULL;
     int num_threads = 1;
-    int num_texts = 0;
+    Py_ssize_t max_tokens = -1;
+    int return_offsets = 0;
+    PyObject* allowed_special = NULL;
+    PyObject* disallowed_special = NULL;
+    unsigned char* special_policy = NULL;
+    Py_ssize_t num_texts = 0;
+
+    if (!ctx || !ctx->initialized_encode) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Vocabulary is not initialized for encoding. "
+                        "Call 'initialize_encode' function first.");
+        return NULL;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|inpOO", kwlist, &texts,
+                                     &num_threads, &max_tokens,
+                                     &return_offsets, &allowed_special,
+                                     &disallowed_special)) {
+        log_debug("Error: Invalid arguments passed to encode.");
+        PyErr_SetString(PyExc_TypeError,
+                        "Invalid arguments. Expected a list of strings.");
+        return NULL;
+    }
+
+    if (count_only && return_offsets) {
+        PyErr_SetString(PyExc_TypeError,
+                        "Offsets are not available when counting tokens.");
+        return NULL;
+    }
+
+    if (!PyList_Check(texts)) {
+        log_debug("Error: Expected a list of strings.");
+        PyErr_SetString(PyExc_TypeError,
+                        "Invalid arguments. Expected a list of strings.");
+        return NULL;
+    }
+
+    // ASCII texts are encoded in place, straight from the string objects'
+    // storage. The snapshot keeps them alive while the GIL is released, even
+    // if the caller's list is modified in the meantime.
+    if (!special_policy_from_args(ctx, allowed_special, disallowed_special,
+                                  &special_policy)) {
+        return NULL;
+    }
+
+    PyObject* snapshot = PyList_AsTuple(texts);
+    if (!snapshot) {
+        free(special_policy);
+        return NULL;
+    }
+
+    num_texts = PyTuple_GET_SIZE(snapshot);
+    threads = malloc(num_threads * sizeof(thread_t));
+    tasks = malloc(num_texts * sizeof(struct EncodeTask));
+    // Tokens, then offsets and word ids of every text if they are needed.
+    const Py_ssize_t num_vecs = (return_offsets ? 3 : 1) * num_texts;
+    struct IntVector* token_vecs =
+        calloc(num_vecs > 0 ? num_vecs : 1, sizeof(struct IntVector));
+    bool* owns_text = calloc(num_texts > 0 ? num_texts : 1, sizeof(bool));
+    // Whether all of a text was transcoded, see `encode_unicode`.
+    bool* complete = calloc(num_texts > 0 ? num_texts : 1, sizeof(bool));
+
+    if (!threads || (num_texts > 0 && (!tasks || !token_vecs)) || !owns_text ||
+        !complete) {
+        PyErr_NoMemory();
+        free(complete);
+        free_encode_tasks(tasks, owns_text, token_vecs, threads,
+                          special_policy, 0);
+        Py_DECREF(snapshot);
+        return NULL;
+    }
+
+    for (Py_ssize_t i = 0; i < num_texts; i++) {
+        PyObject* item = PyTuple_GET_ITEM(snapshot, i);
+
+        tasks[i].ctx = ctx;
+        tasks[i].max_tokens = max_tokens > 0 ? max_tokens : 0;
+        tasks[i].special_policy = special_policy;
+        tasks[i].text = unicode_prefix_as_utf8(
+            item, budget_prefix_chars(&tasks[i]), &tasks[i].text_len,
+            &owns_text[i], &complete[i]);
+        if (!tasks[i].text) {
+            log_debug("Error: Failed to get text of item at index %zd", i);
+            free(complete);
+            free_encode_tasks(tasks, owns_text, token_vecs, threads,
+                              special_policy, i);
+            Py_DECREF(snapshot);
+            return NULL;
+        }
+
+        tasks[i].continuation = false;
+        if (!count_only) {
+            vector_init(&token_vecs[i], 256);
+        }
+        tasks[i].tokens = count_only ? NULL : &token_vecs[i];
+        tasks[i].offsets = NULL;
+        tasks[i].word_ids = NULL;
+        if (return_offsets) {
+            tasks[i].offsets = &token_vecs[num_texts + i];
+            tasks[i].word_ids = &token_vecs[2 * num_texts + i];
+            vector_init(tasks[i].offsets, 512);
+            vector_init(tasks[i].word_ids, 256);
+        }
+        tasks[i].error_msg = NULL;
+        if (max_tokens == 0) {
+            // A budget of zero tokens consumes nothing, like an empty text.
+            tasks[i].text_len = 0;
+        }
+    }
+
+    TaskQueue q;
+    taskqueue_init(&q, tasks, (int)num_texts);
+
+    Py_BEGIN_ALLOW_THREADS
+
+        for (int i = 0; i < num_threads; i++) {
+        log_debug("Starting thread number %d", i);
+        THREAD_CREATE(&threads[i], encode_wrapper, &q);
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        THREAD_JOIN(threads[i]);
+    }
+    log_debug("All threads joined");
+
+    Py_END_ALLOW_THREADS
+
+        // Texts whose budget did not run out within the transcoded prefix
+        // are encoded again with more of their text.
+        for (Py_ssize_t i = 0; i < num_texts; i++) {
+        if (complete[i] || budget_prefix_encoded(&tasks[i])) {
+            continue;
+        }
+        if (owns_text[i]) {
+            free(tasks[i].text);
+            owns_text[i] = false;
+        }
+        tasks[i].text = NULL;
+        if (!encode_unicode(PyTuple_GET_ITEM(snapshot, i), &tasks[i], 1)) {
+            free(complete);
+            free_encode_tasks(tasks, owns_text, token_vecs, threads,
+                              special_policy, num_texts);
+            Py_DECREF(snapshot);
+            return NULL;
+        }
+    }
+    free(complete);
+
+    for (Py_ssize_t i = 0; i < num_texts; i++) {
+        if (tasks[i].error_msg) {
+            log_debug("Error occurred in chunk %zd: %s", i, tasks[i].error_msg);
+            PyErr_SetString(encode_error_type(tasks[i].error_msg),
+                            tasks[i].error_msg);
+            free_encode_tasks(tasks, owns_text, token_vecs, threads,
+                              special_policy, num_texts);
+            Py_DECREF(snapshot);
+            return NULL;
+        }
+    }
+
+    PyObject* result = PyList_New(num_texts);
+    if (!result) {
+        log_debug("Error: Failed to create result list");
+        PyErr_NoMemory();
+        free_encode_tasks(tasks, owns_text, token_vecs, threads,
+                          special_policy, num_texts);
+        Py_DECREF(snapshot);
+        return NULL;
+    }
+
+    for (Py_ssize_t i = 0; i < num_texts; i++) {
+        if (count_only) {
+            PyObject* count = PyLong_FromSize_t(tasks[i].num_tokens);
+            if (!count) {
+                Py_DECREF(result);
+                free_encode_tasks(tasks, owns_text, token_vecs, threads,
+                                  special_policy, num_texts);
+                Py_DECREF(snapshot);
+                return NULL;
+            }
+            PyList_SET_ITEM(result, i, count);
+            continue;
+        }
+
+        Py_ssize_t size = (Py_ssize_t)tasks[i].tokens->size;
+
+        PyObject* sublist = PyList_New(size);
+        if (!sublist) {
+            Py_DECREF(result);
+            log_debug("Error: Failed to create sublist for chunk %zd", i);
+            PyErr_NoMemory();
+            free_encode_tasks(tasks, owns_text, token_vecs, threads,
+                              special_policy, num_texts);
+            Py_DECREF(snapshot);
+            return NULL;
+        }
+
+        log_debug("Inserting tokens for chunk %zd, size: %zd", i, size);
+
+        for (Py_ssize_t j = 0; j < size; j++) {
+            PyObject* item = PyLong_FromLong(tasks[i].tokens->data[j]);
+            if (!item) {
+                Py_DECREF(sublist);
+                Py_DECREF(result);
+                PyErr_NoMemory();
+                free_encode_tasks(tasks, owns_text, token_vecs, threads,
+                                  special_policy, num_texts);
+                Py_DECREF(snapshot);
+                return NULL;
+            }
+            PyList_SET_ITEM(sublist, j, item);
+        }
+
+        PyList_SET_ITEM(result, i, sublist);
+    }
+
+    PyObject* offsets = NULL;
+    PyObject* word_ids = NULL;
+    if (return_offsets) {
+        offsets = PyList_New(num_texts);
+        word_ids = PyList_New(num_texts);
+        for (Py_ssize_t i = 0; offsets && word_ids && i < num_texts; i++) {
+            PyObject* text_offsets = vector_to_array(tasks[i].offsets);
+            PyObject* text_word_ids =
+                text_offsets ? vector_to_array(tasks[i].word_ids) : NULL;
+            if (!text_word_ids) {
+                Py_XDECREF(text_offsets);
+                Py_CLEAR(offsets);
+                break;
+            }
+            PyList_SET_ITEM(offsets, i, text_offsets);
+            PyList_SET_ITEM(word_ids, i, text_word_ids);
+        }
+        if (!offsets || !word_ids) {
+            Py_CLEAR(offsets);
+            Py_CLEAR(word_ids);
+            Py_CLEAR(result);
+        }
+    }
+
+    PyObject* consumed = NULL;
+    if (result && !count_only && max_tokens >= 0) {
+        consumed = PyList_New(num_texts);
+        for (Py_ssize_t i = 0; consumed && i < num_texts; i++) {
+            PyObject* item = PyLong_FromSize_t(tasks[i].consumed);
+            if (!item) {
+                Py_CLEAR(consumed);
+                break;
+            }
+            PyList_SET_ITEM(consumed, i, item);
+        }
+        if (!consumed) {
+            Py_CLEAR(offsets);
+            Py_CLEAR(word_ids);
+            Py_CLEAR(result);
+        }
+    }
+
+    free_encode_tasks(tasks, owns_text, token_vecs, threads,
+                      special_policy, num_texts);
+    Py_DECREF(snapshot);
+
+    if (!result) {
+        return NULL;
+    }
+    if (offsets && consumed) {
+        return Py_BuildValue("(NNNN)", result, offsets, word_ids, consumed);
+    }
+    if (offsets) {
+        return Py_BuildValue("(NNN)", result, offsets, word_ids);
+    }
+    if (consumed) {
+        return Py_BuildValue("(NN)", result, consumed);
+    }
+
+    return result;
+}
+
+PyObject* p_batch_encode(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return encode_texts(args, kwargs, false);
+}
+
+PyObject* p_batch_count_tokens(PyObject* self,
+                               PyObject* args,
+                               PyObject* kwargs) {
+    return encode_texts(args, kwargs, true);
+}
+
+static PyObject* shard_stats_to_dict(const struct ShardStats* stats,
+                                     const char* output_prefix) {
+    PyObject* shards = PyList_New((Py_ssize_t)stats->num_shards);
+    if (!shards) {
+        return NULL;
+    }
+
+    size_t path_len = strlen(output_prefix) + 32;
+    char* path = malloc(path_len);
+    if (!path) {
+        Py_DECREF(shards);
+        return PyErr_NoMemory();
+    }
+
+    for (size_t i = 0; i < stats->num_shards; i++) {
+        snprintf(path, path_len, "%s_%05zu.bin", output_prefix, i);
+        PyObject* item = PyUnicode_DecodeFSDefault(path);
+        if (!item) {
+            free(path);
+            Py_DECREF(shards);
+            return NULL;
+        }
+        PyList_SET_ITEM(shards, (Py_ssize_t)i, item);
+    }
+    free(path);
+
+    PyObject* result = Py_BuildValue(
+        "{s:n,s:n,s:s,s:N}", "num_documents", (Py_ssize_t)stats->num_documents,
+        "num_tokens", (Py_ssize_t)stats->num_tokens, "dtype",
+        stats->token_size == 2 ? "uint16" : "uint32", "shards", shards);
+    if (!result) {
+        Py_DECREF(shards);
+    }
+
+    return result;
+}
+
+static PyObject* p_encode_file(PyObject* self,
+                               PyObject* args,
+                               PyObject* kwargs) {
+    static char* kwlist[] = {"input_paths", "output_prefix", "doc_separator",
+                             "eos_id",      "num_threads",   "max_shard_tokens",
+                             NULL};
+    struct EncodeContext* ctx = global_encode_context;
+    PyObject* py_paths = NULL;
+    PyObject* py_prefix = NULL;
+    char* doc_separator = NULL;
+    int eos_id = -1;
+    int num_threads = 0;
+    Py_ssize_t max_shard_tokens = 0;
+
+    if (!ctx || !ctx->initialized_encode) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Vocabulary is not initialized for encoding. "
+                        "Call 'initialize_encode' function first.");
+        return NULL;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO&|ziin", kwlist,
+                                     &py_paths, PyUnicode_FSConverter,
+                                     &py_prefix, &doc_separator, &eos_id,
+                                     &num_threads, &max_shard_tokens)) {
+        return NULL;
+    }
+
+    // A single path is accepted as well as a list of them.
+    PyObject* paths = NULL;
+    if (PyUnicode_Check(py_paths) || PyBytes_Check(py_paths) ||
+        PyObject_HasAttrString(py_paths, "__fspath__")) {
+        paths = PyTuple_Pack(1, py_paths);
+    } else {
+        paths = PySequence_Tuple(py_paths);
+    }
+    if (!paths) {
+        Py_DECREF(py_prefix);
+        return NULL;
+    }
+
+    Py_ssize_t num_paths = PyTuple_GET_SIZE(paths);
+    PyObject** encoded_paths = calloc(num_paths > 0 ? num_paths : 1,
+                                      sizeof(PyObject*));
+    const char** input_paths =
+        malloc((num_paths > 0 ? num_paths : 1) * sizeof(char*));
+    if (!encoded_paths || !input_paths) {
+        free(encoded_paths);
+        free(input_paths);
+        Py_DECREF(paths);
+        Py_DECREF(py_prefix);
+        return PyErr_NoMemory();
+    }
+
+    Py_ssize_t converted = 0;
+    for (; converted < num_paths; converted++) {
+        if (!PyUnicode_FSConverter(PyTuple_GET_ITEM(paths, converted),
+                                   &encoded_paths[converted])) {
+            break;
+        }
+        input_paths[converted] = PyBytes_AS_STRING(encoded_paths[converted]);
+    }
+
+    PyObject* result = NULL;
+    if (converted == num_paths) {
+        struct ShardOptions options = {
+            .output_prefix = PyBytes_AS_STRING(py_prefix),
+            .doc_separator = doc_separator,
+            .doc_separator_len = doc_separator ? strlen(doc_separator) : 0,
+            .eos_id = eos_id,
+            .num_threads = num_threads > 0 ? num_threads : cpu_count(),
+            .max_shard_tokens =
+                max_shard_tokens > 0 ? (size_t)max_shard_tokens : SIZE_MAX};
+        struct ShardStats stats;
+        char* error_msg = NULL;
+
+        Py_BEGIN_ALLOW_THREADS
+
+            error_msg = shard_encode_files(ctx, input_paths, num_paths,
+                                           &options, &stats);
+
+        Py_END_ALLOW_THREADS
+
+            if (error_msg) {
+            log_debug("Error occurred during file encoding: %s", error_msg);
+            PyErr_SetString(encode_error_type(error_msg), error_msg);
+        } else {
+            result = shard_stats_to_dict(&stats, options.output_prefix);
+        }
+    }
+
+    for (Py_ssize_t i = 0; i < converted; i++) {
+        Py_DECREF(encoded_paths[i]);
+    }
+    free(encoded_paths);
+    free(input_paths);
+    Py_DECREF(paths);
+    Py_DECREF(py_prefix);
+
+    return result;
+}
+
+static bool check_decode_context(const struct DecodeContext* ctx) {
+    if (!ctx || !ctx->initialized_decode) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Vocabulary is not initialized for decoding. "
+                        "Call 'initialize_decode' function first.");
+        return false;
+    }
+
+    if (!ctx->vocab_size_decode) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Vocab size is not properly set during initialization. "
+                        "Please try again.");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Creates the string of a decoded text. Its length and largest code point are
+ * known from the tokens, so it is written straight into a string of the right
+ * kind. Only a text with tokens that are not valid UTF-8 on their own, such
+ * as the pieces of a split character, goes through the UTF-8 codec.
+ */
+static PyObject* decoded_utf8_to_str(const char* text,
+                                     size_t len,
+                                     size_t num_chars,
+                                     uint32_t maxchar) {
+    if (maxchar > 0x10FFFF) {
+        return PyUnicode_DecodeUTF8(text, (Py_ssize_t)len, NULL);
+    }
+
+    PyObject* str = PyUnicode_New((Py_ssize_t)num_chars, (Py_UCS4)maxchar);
+    if (!str) {
+        return NULL;
+    }
+    if (maxchar < 0x80) {
+        memcpy(PyUnicode_1BYTE_DATA(str), text, len);
+    } else {
+        unicode_from_utf8(text, len, (enum UnicodeKind)PyUnicode_KIND(str),
+                          PyUnicode_DATA(str));
+    }
+
+    return str;
+}
+
+static PyObject* decoded_text_to_str(const struct DecodeTask* task) {
+    return decoded_utf8_to_str(task->result, task->result_len,
+                               task->result_num_chars, task->result_maxchar);
+}
+
+// Runs `work` over the tasks on up to `num_threads` threads, or on the
+// calling thread if no threads can be started. Does not need the GIL.
+static void run_decode_tasks(struct DecodeTask* tasks,
+                             int num_tasks,
+                             int num_threads,
+                             thread_return_t (*work)(thread_arg_t)) {
+    if (num_threads > num_tasks) {
+        num_threads = num_tasks;
+    }
+
+    DecodeQueue q;
+    decodequeue_init(&q, tasks, num_tasks);
+
+    thread_t* threads =
+        num_threads > 1 ? malloc(num_threads * sizeof(thread_t)) : NULL;
+    if (!threads) {
+        work(&q);
+        return;
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        log_debug("Starting thread %d", i);
+        THREAD_CREATE(&threads[i], work, &q);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        THREAD_JOIN(threads[i]);
+    }
+    log_debug("All threads joined");
+
+    free(threads);
+}
+
+/*
+ * Decodes every task into its part of `text`, one after the other, at the
+ * lengths found by `decode_measure`. Returns the first error.
+ */
+static char* decode_into_slices(struct DecodeTask* tasks,
+                                int num_tasks,
+                                int num_threads,
+                                char* text) {
+    size_t offset = 0;
+    for (int i = 0; i < num_tasks; i++) {
+        tasks[i].output = text + offset;
+        tasks[i].output_capacity = tasks[i].result_len;
+        offset += tasks[i].result_len;
+    }
+
+    run_decode_tasks(tasks, num_tasks, num_threads, decode_wrapper);
+
+    for (int i = 0; i < num_tasks; i++) {
+        if (tasks[i].error_msg) {
+            return tasks[i].error_msg;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Decodes a long token sequence in pieces on up to `num_threads` threads,
+ * without the GIL. The pieces split the tokens evenly, which is exact since
+ * every token decodes on its own. Each piece first measures its output, then
+ * decodes straight into its part of one buffer, found by a prefix sum over
+ * the lengths.
+ */
+static void decode_document(struct DecodeTask* task, int num_threads) {
+    int token_num = *task->tokens_size;
+
+    if (token_num < PARALLEL_DECODE_THRESHOLD) {
+        decode(task);
+        return;
+    }
+
+    int num_pieces = token_num / PARALLEL_DECODE_MIN_PIECE;
+    if (num_pieces > num_threads) {
+        num_pieces = num_threads;
+    }
+
+    if (num_pieces <= 1) {
+        Py_BEGIN_ALLOW_THREADS
+
+            decode(task);
+
+        Py_END_ALLOW_THREADS
+
+            return;
+    }
+
+    struct DecodeTask* tasks = malloc(num_pieces * sizeof(struct DecodeTask));
+    int* sizes = malloc(num_pieces * sizeof(int));
+    if (!tasks || !sizes) {
+        free(tasks);
+        free(sizes);
+        task->error_msg = "Failed to allocate memory for parallel decoding.";
+        return;
+    }
+
+    for (int i = 0; i < num_pieces; i++) {
+        int start = (int)((int64_t)token_num * i / num_pieces);
+        int end = (int)((int64_t)token_num * (i + 1) / num_pieces);
+        sizes[i] = end - start;
+        tasks[i] = (struct DecodeTask){
+            .tokens = task->tokens + start,
+            .tokens_size = &sizes[i],
+            .continuation = task->continuation || i > 0,
+            .ctx = task->ctx};
+    }
+
+    log_debug("Decoding %d tokens in %d pieces.", token_num, num_pieces);
+
+    task->result = NULL;
+    task->error_msg = NULL;
+    char* text = NULL;
+    size_t total = 0;
+    size_t num_chars = 0;
+    uint32_t maxchar = 0;
+
+    Py_BEGIN_ALLOW_THREADS
+
+        run_decode_tasks(tasks, num_pieces, num_pieces, decode_measure_wrapper);
+
+    for (int i = 0; i < num_pieces && !task->error_msg; i++) {
+        task->error_msg = tasks[i].error_msg;
+        total += tasks[i].result_len;
+        num_chars += tasks[i].result_num_chars;
+        if (tasks[i].result_maxchar > maxchar) {
+            maxchar = tasks[i].result_maxchar;
+        }
+    }
+
+    if (!task->error_msg) {
+        if (!task->output) {
+            text = malloc(total + 1);
+            if (!text) {
+                task->error_msg = "Failed to allocate memory for text buffer";
+            }
+        } else if (total > task->output_capacity) {
+            task->error_msg = "Output buffer is too small.";
+        } else {
+            text = task->output;
+        }
+    }
+
+    if (!task->error_msg) {
+        task->error_msg =
+            decode_into_slices(tasks, num_pieces, num_pieces, text);
+    }
+
+    Py_END_ALLOW_THREADS
+
+        if (task->error_msg) {
+        if (!task->output) {
+            free(text);
+        }
+    } else {
+        if (!task->output) {
+            text[total] = '\0';
+        }
+        task->result = text;
+        task->result_len = total;
+        task->result_num_chars = num_chars;
+        task->result_maxchar = maxchar;
+    }
+
+    free(tasks);
+    free(sizes);
+}
+
+/*
+ * Decodes the tokens given to one of the Python level decode functions, into
+ * `output` if it is not NULL. Returns false with a Python exception set if
+ * decoding fails.
+ */
+static bool decode_object(PyObject* tokens,
+                          int num_threads,
+                          char* output,
+                          size_t output_capacity,
+                          struct DecodeTask* task) {
+    struct DecodeContext* ctx = global_decode_context;
+    struct TokenArray array;
+
+    if (!check_decode_context(ctx)) {
+        return false;
+    }
+
+    if (!token_array_from_object(tokens, &array)) {
+        return false;
+    }
+
+    if (num_threads <= 0) {
+        num_threads = cpu_count();
+    }
+
+    int tokens_size = (int)array.len;
+    *task = (struct DecodeTask){.tokens = array.tokens,
+                                .tokens_size = &tokens_size,
+                                .continuation = false,
+                                .ctx = ctx,
+                                .output = output,
+                                .output_capacity = output_capacity};
+
+    decode_document(task, num_threads);
+    token_array_release(&array);
+    task->tokens = NULL;
+    task->tokens_size = NULL;
+
+    if (task->error_msg) {
+        PyErr_SetString(PyExc_ValueError, task->error_msg);
+        return false;
+    }
+
+    return true;
+}
+
+static PyObject* p_decode(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"tokens", "num_threads", NULL};
+    PyObject* tokens = NULL;
+    int num_threads = 0;
+    struct DecodeTask task;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i", kwlist, &tokens,
+                                     &num_threads)) {
+        return NULL;
+    }
+
+    if (!decode_object(tokens, num_threads, NULL, 0, &task)) {
+        return NULL;
+    }
+
+    PyObject* py_string = decoded_text_to_str(&task);
+    free(task.result);
+
+    return py_string;
+}
+
+// Decodes the tokens into the UTF-8 bytes of the text, as `bytes`.
+static PyObject* p_decode_bytes(PyObject* self,
+                                PyObject* args,
+                                PyObject* kwargs) {
+    static char* kwlist[] = {"tokens", "num_threads", NULL};
+    PyObject* tokens = NULL;
+    int num_threads = 0;
+    struct DecodeTask task;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i", kwlist, &tokens,
+                                     &num_threads)) {
+        return NULL;
+    }
+
+    if (!decode_object(tokens, num_threads, NULL, 0, &task)) {
+        return NULL;
+    }
+
+    PyObject* bytes =
+        PyBytes_FromStringAndSize(task.result, (Py_ssize_t)task.result_len);
+    free(task.result);
+
+    return bytes;
+}
+
+/*
+ * Decodes the tokens into a writable buffer such as a bytearray instead of
+ * building a str, and returns the number of UTF-8 bytes written.
+ */
+static PyObject* p_decode_into(PyObject* self,
+                               PyObject* args,
+                               PyObject* kwargs) {
+    static char* kwlist[] = {"tokens", "buffer", "num_threads", NULL};
+    PyObject* tokens = NULL;
+    Py_buffer output;
+    int num_threads = 0;
+    struct DecodeTask task;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Ow*|i", kwlist, &tokens,
+                                     &output, &num_threads)) {
+        return NULL;
+    }
+
+    bool ok = decode_object(tokens, num_threads, (char*)output.buf,
+                            (size_t)output.len, &task);
+    PyBuffer_Release(&output);
+    if (!ok) {
+        return NULL;
+    }
+
+    return PyLong_FromSize_t(task.result_len);
+}
+
+// Decodes every task into a string of its own, returns the list of them.
+static PyObject* decode_batch_list(struct DecodeTask* tasks,
+                                   int num_tasks,
+                                   int num_threads) {
+    Py_BEGIN_ALLOW_THREADS
+
+        run_decode_tasks(tasks, num_tasks, num_threads, decode_wrapper);
+
+    Py_END_ALLOW_THREADS
+
+        PyObject* results_list = PyList_New(num_tasks);
+    for (int i = 0; results_list && i < num_tasks; i++) {
+        if (tasks[i].error_msg) {
+            log_debug("Error occurred in chunk %d: %s", i, tasks[i].error_msg);
+            PyErr_SetString(PyExc_ValueError, tasks[i].error_msg);
+            Py_CLEAR(results_list);
+            break;
+        }
+        PyObject* string = decoded_text_to_str(&tasks[i]);
+        if (!string) {
+            Py_CLEAR(results_list);
+            break;
+        }
+        PyList_SET_ITEM(results_list, i, string);
+    }
+
+    for (int i = 0; i < num_tasks; i++) {
+        free(tasks[i].result);
+    }
+
+    return results_list;
+}
+
+struct DecodedTextInfo {
+    size_t num_chars;
+    uint32_t maxchar;
+};
+
+// The texts of a batch, back to back in one bytes object. Text i is
+// data[offsets[i]:offsets[i + 1]], turned into a str only when accessed.
+struct DecodedBatchObject {
+    PyObject_HEAD PyObject* data;
+    PyObject* offsets;  // bytes holding num_texts + 1 int64 offsets
+    struct DecodedTextInfo* info;
+    Py_ssize_t num_texts;
+};
+
+static void decoded_batch_dealloc(struct DecodedBatchObject* self) {
+    Py_XDECREF(self->data);
+    Py_XDECREF(self->offsets);
+    free(self->info);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static Py_ssize_t decoded_batch_length(struct DecodedBatchObject* self) {
+    return self->num_texts;
+}
+
+static PyObject* decoded_batch_item(struct DecodedBatchObject* self,
+                                    Py_ssize_t i) {
+    if (i < 0 || i >= self->num_texts) {
+        PyErr_SetString(PyExc_IndexError, "DecodedBatch index out of range");
+        return NULL;
+    }
+
+    const int64_t* offsets = (const int64_t*)PyBytes_AS_STRING(self->offsets);
+    return decoded_utf8_to_str(PyBytes_AS_STRING(self->data) + offsets[i],
+                               (size_t)(offsets[i + 1] - offsets[i]),
+                               self->info[i].num_chars,
+                               self->info[i].maxchar);
+}
+
+static PyObject* decoded_batch_get_data(struct DecodedBatchObject* self,
+                                        void* Py_UNUSED(closure)) {
+    Py_INCREF(self->data);
+    return self->data;
+}
+
+static PyObject* decoded_batch_get_offsets(struct DecodedBatchObject* self,
+                                           void* Py_UNUSED(closure)) {
+    PyObject* view = PyMemoryView_FromObject(self->offsets);
+    if (!view) {
+        return NULL;
+    }
+    PyObject* offsets = PyObject_CallMethod(view, "cast", "s", "q");
+    Py_DECREF(view);
+    return offsets;
+}
+
+static PySequenceMethods decodedBatchSequence = {
+    .sq_length = (lenfunc)decoded_batch_length,
+    .sq_item = (ssizeargfunc)decoded_batch_item,
+};
+
+static PyGetSetDef decodedBatchGetSet[] = {
+    {"data", (getter)decoded_batch_get_data, NULL,
+     "UTF-8 bytes of all texts, back to back", NULL},
+    {"offsets", (getter)decoded_batch_get_offsets, NULL,
+     "Start of every text in data and the end of the last, as int64", NULL},
+    {NULL, NULL, NULL, NULL, NULL}};
+
+static PyTypeObject DecodedBatchType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_hutoken.DecodedBatch",
+    .tp_doc = "Decoded texts of a batch in one contiguous UTF-8 buffer",
+    .tp_basicsize = sizeof(struct DecodedBatchObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)decoded_batch_dealloc,
+    .tp_as_sequence = &decodedBatchSequence,
+    .tp_getset = decodedBatchGetSet,
+};
+
+/*
+ * Decodes every task into one bytes object instead of a buffer each: the
+ * texts are measured first, then decoded into their places, found by a
+ * prefix sum over the lengths.
+ */
+static PyObject* decode_batch_concat(struct DecodeTask* tasks,
+                                     int num_tasks,
+                                     int num_threads) {
+    Py_BEGIN_ALLOW_THREADS
+
+        run_decode_tasks(tasks, num_tasks, num_threads,
+                         decode_measure_wrapper);
+
+    Py_END_ALLOW_THREADS
+
+        for (int i = 0; i < num_tasks; i++) {
+        if (tasks[i].error_msg) {
+            log_debug("Error occurred in chunk %d: %s", i, tasks[i].error_msg);
+            PyErr_SetString(PyExc_ValueError, tasks[i].error_msg);
+            return NULL;
+        }
+    }
 
-    if (!ctx || !ctx->initialized_encode) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "Vocabulary is not initialized for encoding. "
-                        "Call 'initialize_encode' function first.");
+    struct DecodedBatchObject* batch =
+        PyObject_New(struct DecodedBatchObject, &DecodedBatchType);
+    if (!batch) {
         return NULL;
     }
+    batch->num_texts = num_tasks;
+    batch->data = NULL;
+    batch->info = malloc(num_tasks * sizeof(struct DecodedTextInfo));
+    batch->offsets = PyBytes_FromStringAndSize(
+        NULL, (Py_ssize_t)((num_tasks + 1) * sizeof(int64_t)));
+    if (!batch->info || !batch->offsets) {
+        Py_DECREF(batch);
+        return PyErr_NoMemory();
+    }
 
-    if (!PyArg_ParseTuple(args, "O|i", &texts, &num_threads)) {
-        log_debug("Error: Invalid arguments passed to encode.");
-        PyErr_SetString(PyExc_TypeError,
-                        "Invalid arguments. Expected a list of strings.");
-        return NULL;
+    int64_t* offsets = (int64_t*)PyBytes_AS_STRING(batch->offsets);
+    offsets[0] = 0;
+    for (int i = 0; i < num_tasks; i++) {
+        offsets[i + 1] = offsets[i] + (int64_t)tasks[i].result_len;
+        batch->info[i] = (struct DecodedTextInfo){
+            .num_chars = tasks[i].result_num_chars,
+            .maxchar = tasks[i].result_maxchar};
     }
 
-    if (!PyList_Check(texts)) {
-        log_debug("Error: Expected a list of strings.");
-        PyErr_SetString(PyExc_TypeError,
-                        "Invalid arguments. Expected a list of strings.");
+    batch->data =
+        PyBytes_FromStringAndSize(NULL, (Py_ssize_t)offsets[num_tasks]);
+    if (!batch->data) {
+        Py_DECREF(batch);
         return NULL;
     }
 
-    threads = malloc(num_threads * sizeof(thread_t));
-    num_texts = PyList_Size(texts);
-    tasks = malloc(num_texts * sizeof(struct EncodeTask));
-    struct IntVector* token_vecs = malloc(num_texts * sizeof(struct IntVector));
+    char* error_msg = NULL;
+    char* text = PyBytes_AS_STRING(batch->data);
 
-    for (Py_ssize_t i = 0; i < num_texts; i++) {
-        PyObject* item = PyList_GetItem(texts, i);
-        if (!item) {
-            log_debug("Error: Failed to get item at index %zd", i);
-            PyErr_SetString(PyExc_RuntimeError, "Failed to get item.");
-            for (int i = 0; i < num_texts; ++i) {
-                vector_free(&token_vecs[i]);
-            }
-            free(token_vecs);
-            free(threads);
-            free(tasks);
-            return NULL;
-        }
+    Py_BEGIN_ALLOW_THREADS
 
-        char* text_chunk = (char*)PyUnicode_AsUTF8(item);
+        error_msg = decode_into_slices(tasks, num_tasks, num_threads, text);
 
-        tasks[i].text = strdup(text_chunk);
-        tasks[i].ctx = ctx;
-        vector_init(&token_vecs[i], 256);
-        tasks[i].tokens = &token_vecs[i];
-        tasks[i].error_msg = NULL;
+    Py_END_ALLOW_THREADS
+
+        if (error_msg) {
+        PyErr_SetString(PyExc_ValueError, error_msg);
+        Py_DECREF(batch);
+        return NULL;
     }
 
-    TaskQueue q;
-    taskqueue_init(&q, tasks, num_texts);
+    return (PyObject*)batch;
+}
 
-    Py_BEGIN_ALLOW_THREADS
+static void free_decode_batch(struct DecodeTask* tasks,
+                              int* sizes,
+                              struct TokenArray* arrays,
+                              Py_ssize_t num_arrays) {
+    for (Py_ssize_t i = 0; i < num_arrays; i++) {
+        token_array_release(&arrays[i]);
+    }
+    free(arrays);
+    free(sizes);
+    free(tasks);
+}
 
-        for (int i = 0; i < num_threads; i++) {
-        log_debug("Starting thread number %d", i);
-        THREAD_CREATE(&threads[i], encode_wrapper, &q);
+/*
+ * Decodes a list of token sequences, or a flat `tokens` buffer split by
+ * `offsets`, where sequence i is tokens[offsets[i]:offsets[i + 1]]. The
+ * sequences are decoded straight from the caller's buffers where possible.
+ * With `concat`, the texts are returned in a single DecodedBatch instead of
+ * a list of strings.
+ */
+static PyObject* p_batch_decode(PyObject* self,
+                                PyObject* args,
+                                PyObject* kwargs) {
+    struct DecodeContext* ctx = global_decode_context;
+    PyObject* tokens = NULL;
+    PyObject* offsets = Py_None;
+    Py_ssize_t num_tokens = 0;
+    Py_ssize_t num_arrays = 0;
+    int num_threads = 1;
+    int concat = 0;
+
+    static char* kwlist[] = {"tokens", "num_threads", "offsets", "concat",
+                             NULL};
+
+    if (!check_decode_context(ctx)) {
+        return NULL;
     }
 
-    for (int i = 0; i < num_threads; i++) {
-        THREAD_JOIN(threads[i]);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iOp", kwlist, &tokens,
+                                     &num_threads, &offsets, &concat)) {
+        return NULL;
     }
-    log_debug("All threads joined");
 
-    Py_END_ALLOW_THREADS
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
 
-        for (Py_ssize_t i = 0; i < num_texts; i++) {
-        if (tasks[i].error_msg) {
-            log_debug("Error occurred in chunk %zd: %s", i, tasks[i].error_msg);
-            PyErr_SetString(PyExc_RuntimeError, tasks[i].error_msg);
-            for (int i = 0; i < num_texts; ++i) {
-                vector_free(&token_vecs[i]);
-            }
-            free(token_vecs);
-            free(threads);
-            free(tasks);
+    // The flat tokens and their offsets, or one array per sequence.
+    struct TokenArray* arrays = NULL;
+    PyObject* seq = NULL;
+    if (offsets != Py_None) {
+        arrays = calloc(2, sizeof(struct TokenArray));
+        if (!arrays) {
+            return PyErr_NoMemory();
+        }
+        if (!token_array_from_object(tokens, &arrays[0])) {
+            free(arrays);
+            return NULL;
+        }
+        num_arrays = 1;
+        if (!token_array_from_object(offsets, &arrays[1])) {
+            free_decode_batch(NULL, NULL, arrays, num_arrays);
+            return NULL;
+        }
+        num_arrays = 2;
+        num_tokens = arrays[1].len - 1;
+    } else {
+        seq = PySequence_Fast(tokens, "Expected a list of token sequences.");
+        if (!seq) {
             return NULL;
         }
+        num_tokens = PySequence_Fast_GET_SIZE(seq);
     }
 
-    PyObject* result = PyList_New(num_texts);
-    if (!result) {
-        log_debug("Error: Failed to create result list");
-        PyErr_NoMemory();
-        for (int i = 0; i < num_texts; ++i) {
-            vector_free(&token_vecs[i]);
-        }
-        free(token_vecs);
-        free(threads);
-        free(tasks);
+    if (num_tokens <= 0) {
+        Py_XDECREF(seq);
+        free_decode_batch(NULL, NULL, arrays, num_arrays);
+        PyErr_SetString(PyExc_ValueError, "No tokens provided.");
         return NULL;
     }
 
-    for (Py_ssize_t i = 0; i < num_texts; i++) {
-        int size = tasks[i].tokens->size;
+    if (!arrays) {
+        arrays = calloc(num_tokens, sizeof(struct TokenArray));
+    }
+    struct DecodeTask* tasks = calloc(num_tokens, sizeof(struct DecodeTask));
+    int* sizes = malloc(num_tokens * sizeof(int));
+    if (!arrays || !tasks || !sizes) {
+        Py_XDECREF(seq);
+        free_decode_batch(tasks, sizes, arrays, num_arrays);
+        return PyErr_NoMemory();
+    }
 
-        PyObject* sublist = PyList_New(size);
-        if (!sublist) {
-            Py_DECREF(result);
-            log_debug("Error: Failed to create sublist for chunk %zd", i);
-            PyErr_NoMemory();
-            for (int i = 0; i < num_texts; ++i) {
-                vector_free(&token_vecs[i]);
+    if (seq) {
+        for (Py_ssize_t i = 0; i < num_tokens; i++) {
+            if (!token_array_from_object(PySequence_Fast_GET_ITEM(seq, i),
+                                         &arrays[i])) {
+                log_debug("Error: item at index %zd is not a token sequence",
+                          i);
+                Py_DECREF(seq);
+                free_decode_batch(tasks, sizes, arrays, num_arrays);
+                return NULL;
             }
-            free(token_vecs);
-            free(threads);
-            free(tasks);
-            return NULL;
+            num_arrays = i + 1;
+            tasks[i].tokens = arrays[i].tokens;
+            sizes[i] = (int)arrays[i].len;
         }
-
-        log_debug("Inserting tokens for chunk %zd, size: %d", i, size);
-
-        for (int j = 0; j < size; j++) {
-            PyObject* item = PyLong_FromLong(tasks[i].tokens->data[j]);
-            if (!item) {
-                Py_DECREF(sublist);
-                Py_DECREF(result);
-                PyErr_NoMemory();
-                for (int i = 0; i < num_texts; ++i) {
-                    vector_free(&token_vecs[i]);
-                }
-                free(token_vecs);
-                free(threads);
-                free(tasks);
+        Py_DECREF(seq);
+    } else {
+        const int* bounds = arrays[1].tokens;
+        for (Py_ssize_t i = 0; i < num_tokens; i++) {
+            if (bounds[i] < 0 || bounds[i] > bounds[i + 1] ||
+                bounds[i + 1] > arrays[0].len) {
+                PyErr_SetString(PyExc_ValueError,
+                                "Offsets must be non-decreasing and within "
+                                "the tokens.");
+                free_decode_batch(tasks, sizes, arrays, num_arrays);
                 return NULL;
             }
-            PyList_SetItem(sublist, j, item);
+            tasks[i].tokens = arrays[0].tokens + bounds[i];
+            sizes[i] = bounds[i + 1] - bounds[i];
         }
-
-        PyList_SetItem(result, i, sublist);
     }
 
-    for (Py_ssize_t i = 0; i < num_texts; i++) {
-        free(tasks[i].text);
-        vector_free(tasks[i].tokens);
-    }
-    for (int i = 0; i < num_texts; ++i) {
-        vector_free(&token_vecs[i]);
+    for (Py_ssize_t i = 0; i < num_tokens; i++) {
+        tasks[i].tokens_size = &sizes[i];
+        tasks[i].continuation = false;
+        tasks[i].ctx = ctx;
     }
-    free(token_vecs);
-    free(threads);
-    free(tasks);
+
+    PyObject* result =
+        concat ? decode_batch_concat(tasks, (int)num_tokens, num_threads)
+               : decode_batch_list(tasks, (int)num_tokens, num_threads);
+    free_decode_batch(tasks, sizes, arrays, num_arrays);
 
     return result;
 }
 
-static PyObject* p_decode(PyObject* self, PyObject* args) {
-    struct DecodeContext* ctx = global_decode_context;
-    PyObject* tokens = NULL;
-    int tokens_size = 0;
-    struct DecodeTask* task = NULL;
+struct EncoderObject {
+    PyObject_HEAD struct StreamEncoder stream;
+};
 
-    if (!ctx || !ctx->initialized_decode) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "Vocabulary is not initialized for decoding. "
-                        "Call 'initialize_decode' function first.");
+static int encoder_init(struct EncoderObject* self,
+                        PyObject* args,
+                        PyObject* kwargs) {
+    struct EncodeContext* ctx = global_encode_context;
 
-        return NULL;
+    if (!ctx || !ctx->initialized_encode) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Vocabulary is not initialized for encoding. "
+                        "Call 'initialize_encode' function first.");
+        return -1;
     }
 
-    if (!ctx->vocab_size_decode) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "Vocab size is not properly set during initialization. "
-                        "Please try again.");
-        return NULL;
+    static char* kwlist[] = {NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "", kwlist)) {
+        return -1;
     }
 
-    if (!PyArg_ParseTuple(args, "O", &tokens)) {
-        PyErr_SetString(
-            PyExc_TypeError,
-            "Failed to parse arguments. Expected a single list of tokens.");
-        return NULL;
+    stream_encoder_release(&self->stream);
+    if (!stream_encoder_init(&self->stream, ctx)) {
+        PyErr_NoMemory();
+        return -1;
     }
 
-    if (!PyList_Check(tokens)) {
-        PyErr_SetString(PyExc_TypeError, "Argument must be a list of integers");
+    return 0;
+}
+
+static void encoder_dealloc(struct EncoderObject* self) {
+    stream_encoder_release(&self->stream);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* encoder_feed(struct EncoderObject* self, PyObject* chunk) {
+    if (!self->stream.pending) {
+        PyErr_SetString(PyExc_RuntimeError, "Encoder is not initialized.");
         return NULL;
     }
 
-    task = malloc(sizeof(struct DecodeTask));
-    tokens_size = PyList_Size(tokens);
-    char* result = NULL;
+    struct IntVector tokens_vec;
+    vector_init(&tokens_vec, 256);
     char* error_msg = NULL;
-    int* token_array = malloc(sizeof(int) * tokens_size);
 
-    for (int i = 0; i < tokens_size; i++) {
-        PyObject* item = PyList_GetItem(tokens, i);
-        if (!item) {
-            PyErr_SetString(PyExc_RuntimeError, "Failed to get token item.");
-            free(task);
-            free(token_array);
+    if (PyUnicode_Check(chunk)) {
+        size_t chunk_len = 0;
+        bool owns_chunk = false;
+        char* text = unicode_as_utf8(chunk, &chunk_len, &owns_chunk);
+        if (!text) {
+            vector_free(&tokens_vec);
+            return NULL;
+        }
+
+        error_msg =
+            stream_encoder_feed(&self->stream, text, chunk_len, &tokens_vec);
+
+        if (owns_chunk) {
+            free(text);
+        }
+    } else {
+        // Raw UTF-8 bytes, which may end in the middle of a character.
+        Py_buffer view;
+        if (PyObject_GetBuffer(chunk, &view, PyBUF_SIMPLE) < 0) {
+            vector_free(&tokens_vec);
+            return NULL;
+        }
+
+        if (memchr(view.buf, '\0', view.len) != NULL) {
+            PyBuffer_Release(&view);
+            vector_free(&tokens_vec);
+            PyErr_SetString(PyExc_ValueError, "embedded null character");
             return NULL;
         }
 
-        token_array[i] = (int)PyLong_AsLong(item);
+        error_msg = stream_encoder_feed(&self->stream, view.buf,
+                                        (size_t)view.len, &tokens_vec);
+        PyBuffer_Release(&view);
     }
 
-    task->tokens = token_array;
-    task->tokens_size = &tokens_size;
-    task->result = result;
-    task->ctx = ctx;
-    task->error_msg = error_msg;
+    if (error_msg) {
+        PyErr_SetString(PyExc_RuntimeError, error_msg);
+        vector_free(&tokens_vec);
+        return NULL;
+    }
 
-    decode(task);
+    PyObject* list = tokens_to_list(&tokens_vec);
+    vector_free(&tokens_vec);
 
-    if (task->error_msg) {
-        PyErr_SetString(PyExc_ValueError, task->error_msg);
-        free(task);
-        free(token_array);
+    return list;
+}
+
+static PyObject* encoder_finish(struct EncoderObject* self,
+                                PyObject* Py_UNUSED(ignored)) {
+    if (!self->stream.pending) {
+        PyErr_SetString(PyExc_RuntimeError, "Encoder is not initialized.");
         return NULL;
     }
 
-    const char* task_result = task->result;
+    struct IntVector tokens_vec;
+    vector_init(&tokens_vec, 256);
 
-    PyObject* py_string =
-        task_result ? PyUnicode_FromString(task_result) : Py_None;
+    char* error_msg = stream_encoder_finish(&self->stream, &tokens_vec);
+    if (error_msg) {
+        PyErr_SetString(PyExc_RuntimeError, error_msg);
+        vector_free(&tokens_vec);
+        return NULL;
+    }
 
-    free(task->result);
-    free(task);
-    free(token_array);
+    PyObject* list = tokens_to_list(&tokens_vec);
+    vector_free(&tokens_vec);
 
-    return py_string;
+    return list;
 }
 
-static PyObject* p_batch_decode(PyObject* self, PyObject* args) {
+static PyMethodDef encoderMethods[] = {
+    {"feed", (PyCFunction)encoder_feed, METH_O,
+     "Encodes a chunk of text (str or UTF-8 bytes), returns the tokens which "
+     "are final"},
+    {"finish", (PyCFunction)encoder_finish, METH_NOARGS,
+     "Encodes the remaining text, and resets the encoder"},
+    {NULL, NULL, 0, NULL}};
+
+static PyTypeObject EncoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_hutoken.Encoder",
+    .tp_doc = "Incremental encoder for text arriving in chunks",
+    .tp_basicsize = sizeof(struct EncoderObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)encoder_init,
+    .tp_dealloc = (destructor)encoder_dealloc,
+    .tp_methods = encoderMethods,
+};
+
+struct DecoderObject {
+    PyObject_HEAD struct StreamDecoder stream;
+    char* errors;  // error handler for invalid UTF-8, as in bytes.decode
+};
+
+static int decoder_init(struct DecoderObject* self,
+                        PyObject* args,
+                        PyObject* kwargs) {
+    static char* kwlist[] = {"errors", NULL};
     struct DecodeContext* ctx = global_decode_context;
-    thread_t* threads = NULL;
-    struct DecodeTask* tasks = NULL;
-    PyObject* tokens = NULL;
-    Py_ssize_t num_tokens = 0;
-    int num_threads = 1;
+    const char* errors = "strict";
 
     if (!ctx || !ctx->initialized_decode) {
         PyErr_SetString(PyExc_RuntimeError,
                         "Vocabulary is not initialized for decoding. "
                         "Call 'initialize_decode' function first.");
-        return NULL;
+        return -1;
     }
 
-    if (!PyArg_ParseTuple(args, "O|i", &tokens, &num_threads)) {
-        PyErr_SetString(
-            PyExc_TypeError,
-            "Failed to parse arguments. Expected a single list of tokens.");
-        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|s", kwlist, &errors)) {
+        return -1;
     }
 
-    num_tokens = PyList_Size(tokens);
-    if (num_tokens <= 0) {
-        PyErr_SetString(PyExc_ValueError, "No tokens provided.");
-        return NULL;
+    free(self->errors);
+    self->errors = strdup(errors);
+    if (!self->errors) {
+        PyErr_NoMemory();
+        return -1;
     }
+    stream_decoder_init(&self->stream, ctx);
 
-    threads = malloc(num_threads * sizeof(thread_t));
-    tasks = malloc(num_tokens * sizeof(struct DecodeTask));
-
-    for (Py_ssize_t i = 0; i < num_tokens; i++) {
-        PyObject* item = PyList_GetItem(tokens, i);
-        if (!item) {
-            PyErr_SetString(PyExc_RuntimeError, "Failed to get token item.");
-            free(threads);
-            free(tasks);
-            return NULL;
-        }
+    return 0;
+}
 
-        if (!PyList_Check(item)) {
-            log_debug("Error: item at index %zd is not a list", i);
-            PyErr_SetString(PyExc_TypeError,
-                            "Each item must be a list of integers.");
-            free(threads);
-            free(tasks);
-            return NULL;
-        }
+static void decoder_dealloc(struct DecoderObject* self) {
+    free(self->errors);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
 
-        int tokens_size = PyList_Size(item);
-        tasks[i].tokens = malloc(sizeof(int) * tokens_size);
-        if (!tasks[i].tokens) {
-            log_debug("Error: Memory allocation failed for tokens");
-            PyErr_SetString(PyExc_MemoryError,
-                            "Failed to allocate memory for tokens");
-            free(threads);
-            free(tasks);
-            return NULL;
-        }
-        for (Py_ssize_t j = 0; j < tokens_size; j++) {
-            PyObject* token = PyList_GetItem(item, j);
-            if (token) {
-                tasks[i].tokens[j] = (int)PyLong_AsLong(token);
-            } else {
-                tasks[i].tokens[j] = -1;
-            }
-        }
+static PyObject* decoder_feed(struct DecoderObject* self, PyObject* tokens) {
+    if (!self->errors) {
+        PyErr_SetString(PyExc_RuntimeError, "Decoder is not initialized.");
+        return NULL;
+    }
 
-        tasks[i].tokens_size = malloc(sizeof(int));
-        if (!tasks[i].tokens_size) {
-            log_debug("Error: Memory allocation failed for tokens_size");
-            PyErr_SetString(PyExc_MemoryError,
-                            "Failed to allocate memory for tokens_size");
+    // A single token or a sequence of them.
+    int single = 0;
+    struct TokenArray array = {.tokens = &single, .len = 1};
 
-            free(tasks[i].tokens);
-            free(threads);
-            free(tasks);
+    if (PyLong_Check(tokens)) {
+        single = (int)PyLong_AsLong(tokens);
+        if (PyErr_Occurred()) {
             return NULL;
         }
-        *tasks[i].tokens_size = PyList_Size(item);
-        tasks[i].result = NULL;
-        tasks[i].ctx = ctx;
+    } else if (!token_array_from_object(tokens, &array)) {
+        return NULL;
     }
 
-    DecodeQueue q;
-    decodequeue_init(&q, tasks, num_tokens);
-
-    Py_BEGIN_ALLOW_THREADS
-
-        for (int i = 0; i < num_threads; i++) {
-        log_debug("Starting thread %d", i);
-        THREAD_CREATE(&threads[i], decode_wrapper, &q);
-    }
+    char* text = NULL;
+    size_t text_len = 0;
+    char* error_msg = stream_decoder_feed(&self->stream, array.tokens,
+                                          (int)array.len, &text, &text_len);
+    token_array_release(&array);
 
-    for (int i = 0; i < num_threads; i++) {
-        THREAD_JOIN(threads[i]);
+    if (error_msg) {
+        PyErr_SetString(PyExc_ValueError, error_msg);
+        return NULL;
     }
-    log_debug("All threads joined");
 
-    Py_END_ALLOW_THREADS
+    PyObject* result =
+        PyUnicode_DecodeUTF8(text, (Py_ssize_t)text_len, self->errors);
+    free(text);
 
-        for (Py_ssize_t i = 0; i < num_tokens; i++) {
-        if (tasks[i].error_msg) {
-            log_debug("Error occurred in chunk %zd: %s", i, tasks[i].error_msg);
-            PyErr_SetString(PyExc_ValueError, tasks[i].error_msg);
-            free(threads);
-            free(tasks);
-            return NULL;
-        }
-    }
+    return result;
+}
 
-    PyObject* results_list = PyList_New(num_tokens);
-    if (!results_list) {
-        PyErr_SetString(PyExc_MemoryError,
-                        "Failed to allocate memory for result list");
-        free(threads);
-        free(tasks);
+static PyObject* decoder_finish(struct DecoderObject* self,
+                                PyObject* Py_UNUSED(ignored)) {
+    if (!self->errors) {
+        PyErr_SetString(PyExc_RuntimeError, "Decoder is not initialized.");
         return NULL;
     }
 
-    for (Py_ssize_t i = 0; i < num_tokens; i++) {
-        PyObject* string = PyUnicode_FromString(tasks[i].result);
-        if (!string) {
-            Py_DECREF(results_list);
-            PyErr_SetString(PyExc_MemoryError,
-                            "Failed to create Python string from decoded text");
-            free(threads);
-            free(tasks);
-            return NULL;
-        }
-        PyList_SET_ITEM(results_list, i, string);
-
-        free(tasks[i].tokens_size);
-        free(tasks[i].result);
-        free(tasks[i].tokens);
-    }
-    free(threads);
-    free(tasks);
+    char text[sizeof(self->stream.pending)];
+    size_t text_len = 0;
+    stream_decoder_finish(&self->stream, text, &text_len);
 
-    return results_list;
+    return PyUnicode_DecodeUTF8(text, (Py_ssize_t)text_len, self->errors);
 }
 
+static PyMethodDef decoderMethods[] = {
+    {"feed", (PyCFunction)decoder_feed, METH_O,
+     "Decodes a token or a list of tokens, returns the newly completed text"},
+    {"finish", (PyCFunction)decoder_finish, METH_NOARGS,
+     "Returns the rest of an incomplete character, and resets the decoder"},
+    {NULL, NULL, 0, NULL}};
+
+static PyTypeObject DecoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_hutoken.Decoder",
+    .tp_doc = "Incremental decoder for tokens arriving one by one",
+    .tp_basicsize = sizeof(struct DecoderObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)decoder_init,
+    .tp_dealloc = (destructor)decoder_dealloc,
+    .tp_methods = decoderMethods,
+};
+
 #ifdef USE_FOMA
 PyObject* p_initialize_foma(PyObject* self) {
     return initialize_foma();
@@ -1126,15 +3465,36 @@ PyObject* p_look_up_word(PyObject* self, PyObject* args) {
 #endif
 
 static PyMethodDef huTokenMethods[] = {
-    {"bpe_train", p_bpe_train, METH_VARARGS, "BPE training"},
-    {"bbpe_train", p_bbpe_train, METH_VARARGS, "BBPE training"},
+    {"bpe_train", (PyCFunction)p_bpe_train, METH_VARARGS | METH_KEYWORDS,
+     "BPE training"},
+    {"bpe_train_files", (PyCFunction)p_bpe_train_files,
+     METH_VARARGS | METH_KEYWORDS, "BPE training streamed from files"},
+    {"bpe_train_iter", (PyCFunction)p_bpe_train_iter,
+     METH_VARARGS | METH_KEYWORDS, "BPE training streamed from an iterator"},
+    {"bbpe_train", (PyCFunction)p_bbpe_train, METH_VARARGS | METH_KEYWORDS,
+     "BBPE training"},
     {"initialize", (PyCFunction)p_initialize, METH_VARARGS | METH_KEYWORDS,
      "Initalize tokenizer"},
-    {"encode", (PyCFunction)p_encode, METH_VARARGS, "Encodes string"},
-    {"batch_encode", (PyCFunction)p_batch_encode, METH_VARARGS,
+    {"add_special_tokens", p_add_special_tokens, METH_VARARGS,
+     "Registers special tokens that encode recognizes in the text"},
+    {"encode", (PyCFunction)p_encode, METH_VARARGS | METH_KEYWORDS,
+     "Encodes string, in parallel if it is large"},
+    {"batch_encode", (PyCFunction)p_batch_encode, METH_VARARGS | METH_KEYWORDS,
      "Encodes list of strings"},
-    {"decode", p_decode, METH_VARARGS, "Decodes list of ints"},
-    {"batch_decode", p_batch_decode, METH_VARARGS,
+    {"count_tokens", (PyCFunction)p_count_tokens, METH_VARARGS | METH_KEYWORDS,
+     "Counts the tokens of a string"},
+    {"batch_count_tokens", (PyCFunction)p_batch_count_tokens,
+     METH_VARARGS | METH_KEYWORDS,
+     "Counts the tokens of each string in a list"},
+    {"encode_file", (PyCFunction)p_encode_file, METH_VARARGS | METH_KEYWORDS,
+     "Encodes files into binary token shards"},
+    {"decode", (PyCFunction)p_decode, METH_VARARGS | METH_KEYWORDS,
+     "Decodes list of ints"},
+    {"decode_bytes", (PyCFunction)p_decode_bytes, METH_VARARGS | METH_KEYWORDS,
+     "Decodes tokens into UTF-8 bytes"},
+    {"decode_into", (PyCFunction)p_decode_into, METH_VARARGS | METH_KEYWORDS,
+     "Decodes tokens into a writable buffer"},
+    {"batch_decode", (PyCFunction)p_batch_decode, METH_VARARGS | METH_KEYWORDS,
      "Decodes list of lists of ints"},
 #ifdef USE_FOMA
     {"initialize_foma", (PyCFunction)p_initialize_foma, METH_NOARGS,
@@ -1149,5 +3509,37 @@ static struct PyModuleDef huToken = {PyModuleDef_HEAD_INIT, "huToken",
                                      huTokenMethods};
 
 PyMODINIT_FUNC PyInit__hutoken(void) {
-    return PyModule_Create(&huToken);
+    if (PyType_Ready(&EncoderType) < 0 || PyType_Ready(&DecoderType) < 0 ||
+        PyType_Ready(&DecodedBatchType) < 0) {
+        return NULL;
+    }
+
+    PyObject* module = PyModule_Create(&huToken);
+    if (!module) {
+        return NULL;
+    }
+
+    Py_INCREF(&EncoderType);
+    if (PyModule_AddObject(module, "Encoder", (PyObject*)&EncoderType) < 0) {
+        Py_DECREF(&EncoderType);
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    Py_INCREF(&DecoderType);
+    if (PyModule_AddObject(module, "Decoder", (PyObject*)&DecoderType) < 0) {
+        Py_DECREF(&DecoderType);
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    Py_INCREF(&DecodedBatchType);
+    if (PyModule_AddObject(module, "DecodedBatch",
+                           (PyObject*)&DecodedBatchType) < 0) {
+        Py_DECREF(&DecodedBatchType);
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    return module;
 }
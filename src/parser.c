@@ -3,30 +3,46 @@
 #include <ctype.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
-static const char* consume_while(const char* p, bool (*predicate)(uint32_t));
+static const char* consume_while(const char* p,
+                                 const char* end,
+                                 bool (*predicate)(uint32_t));
 static bool is_custom_alpha(uint32_t cp);
 static bool is_digit(uint32_t cp);
 static bool is_other(uint32_t cp);
 static bool is_whitespace(uint32_t cp);
-static uint32_t decode_utf8(const char** s);
+static uint32_t decode_utf8(const char** s, const char* limit);
 
 struct ParserState parser_init(const char* text) {
-    struct ParserState state = {.current_pos = text};
+    if (!text) {
+        return parser_init_n("", 0);
+    }
+
+    return parser_init_n(text, strlen(text));
+}
+
+// Parses only the first `length` bytes of `text`, which does not need to be
+// NUL-terminated. Tokens never extend past the limit.
+struct ParserState parser_init_n(const char* text, size_t length) {
+    struct ParserState state = {.current_pos = text, .end = text + length};
 
     if (!text) {
         state.current_pos = "";
+        state.end = state.current_pos;
     }
 
     return state;
 }
 
 bool parser_next_token(struct ParserState* state, struct TokenSlice* token) {
-    if (!state || !state->current_pos || *state->current_pos == '\0') {
+    if (!state || !state->current_pos ||
+        state->current_pos >= state->end || *state->current_pos == '\0') {
         return false;
     }
 
     const char* p = state->current_pos;
+    const char* limit = state->end;
     token->start = p;
     const char* end = NULL;
 
@@ -35,7 +51,7 @@ bool parser_next_token(struct ParserState* state, struct TokenSlice* token) {
         s++;
     }
     const char* s_after_space = s;
-    s = consume_while(s, is_custom_alpha);
+    s = consume_while(s, limit, is_custom_alpha);
     if (s > s_after_space) {
         end = s;
         token->length = end - token->start;
@@ -48,7 +64,7 @@ bool parser_next_token(struct ParserState* state, struct TokenSlice* token) {
         s++;
     }
     s_after_space = s;
-    s = consume_while(s, is_digit);
+    s = consume_while(s, limit, is_digit);
     if (s > s_after_space) {
         end = s;
         token->length = end - token->start;
@@ -61,7 +77,7 @@ bool parser_next_token(struct ParserState* state, struct TokenSlice* token) {
         s++;
     }
     s_after_space = s;
-    s = consume_while(s, is_other);
+    s = consume_while(s, limit, is_other);
     if (s > s_after_space) {
         end = s;
         token->length = end - token->start;
@@ -72,7 +88,7 @@ bool parser_next_token(struct ParserState* state, struct TokenSlice* token) {
     s = p;
     if (*s == ' ') {
         s++;
-        while (*s == ' ') {
+        while (s < limit && *s == ' ') {
             s++;
         }
         end = s;
@@ -87,10 +103,12 @@ bool parser_next_token(struct ParserState* state, struct TokenSlice* token) {
     return true;
 }
 
-static const char* consume_while(const char* p, bool (*predicate)(uint32_t)) {
-    while (*p != '\0') {
+static const char* consume_while(const char* p,
+                                 const char* end,
+                                 bool (*predicate)(uint32_t)) {
+    while (p < end && *p != '\0') {
         const char* next_p = p;
-        uint32_t cp = decode_utf8(&next_p);
+        uint32_t cp = decode_utf8(&next_p, end);
         if (cp == 0 || !predicate(cp)) {
             break;
         }
@@ -141,8 +159,9 @@ static bool is_whitespace(uint32_t cp) {
     return cp <= 255 && isspace(cp);
 }
 
-static uint32_t decode_utf8(const char** s) {
+static uint32_t decode_utf8(const char** s, const char* limit) {
     const unsigned char* p = (const unsigned char*)*s;
+    const ptrdiff_t available = limit - *s;
     if (*p == 0) {
         return 0;
     }
@@ -154,21 +173,21 @@ static uint32_t decode_utf8(const char** s) {
         cp = p[0];
         len = 1;
     } else if ((*p & 0xE0) == 0xC0) {
-        if ((p[1] & 0xC0) != 0x80) {
+        if (available < 2 || (p[1] & 0xC0) != 0x80) {
             return 0;
         }
         cp = ((uint32_t)(p[0] & 0x1F) << 6) | (uint32_t)(p[1] & 0x3F);
         len = 2;
     } else if ((*p & 0xF0) == 0xE0) {
-        if ((p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80) {
+        if (available < 3 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80) {
             return 0;
         }
         cp = ((uint32_t)(p[0] & 0x0F) << 12) | ((uint32_t)(p[1] & 0x3F) << 6) |
              (uint32_t)(p[2] & 0x3F);
         len = 3;
     } else if ((*p & 0xF8) == 0xF0) {
-        if ((p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80 ||
-            (p[3] & 0xC0) != 0x80) {
+        if (available < 4 || (p[1] & 0xC0) != 0x80 ||
+            (p[2] & 0xC0) != 0x80 || (p[3] & 0xC0) != 0x80) {
             return 0;
         }
         cp = ((uint32_t)(p[0] & 0x07) << 18) | ((uint32_t)(p[1] & 0x3F) << 12) |
@@ -167,6 +167,51 @@ char* pretokenizer_encode_arena(struct Arena* arena,
     return final_result;
 }
 
+/*
+ * Fills `starts` and `ends` with the range of input bytes that every output
+ * byte of `pretokenizer_encode_arena` was produced from, i.e. the character
+ * (or, for byte encoders, the byte) it replaces. Bytes of the prefix map to
+ * the empty range at the start of the text. Both arrays must hold as many
+ * elements as the encoded text has bytes.
+ */
+void pretokenizer_source_offsets(const char* text,
+                                 const char** special_chars,
+                                 const char* prefix,
+                                 bool is_byte_encoder,
+                                 int starts[],
+                                 int ends[]) {
+    size_t out = 0;
+
+    if (prefix) {
+        for (size_t prefix_len = strlen(prefix); out < prefix_len; ++out) {
+            starts[out] = 0;
+            ends[out] = 0;
+        }
+    }
+
+    const unsigned char* p = (const unsigned char*)text;
+    while (*p != '\0') {
+        const char* replacement = special_chars[*p];
+        int char_len = is_byte_encoder ? 1 : utf8_char_length(p);
+
+        size_t out_len = char_len;
+        if (replacement != NULL) {
+            out_len = strlen(replacement);
+        } else if (is_byte_encoder && *p >= 0x80) {
+            out_len = 2;
+        }
+
+        const int start = (int)((const char*)p - text);
+        for (size_t i = 0; i < out_len; ++i) {
+            starts[out + i] = start;
+            ends[out + i] = start + char_len;
+        }
+
+        out += out_len;
+        p += char_len;
+    }
+}
+
 /*
  * A helper function to decode a single UTF-8 character from a byte stream
  * and return its Unicode code point.
@@ -214,34 +259,33 @@ size_t pretokenizer_decode(const char* text,
         }
     }
 
+    return pretokenizer_decode_n(text, text_len, ctx, buffer);
+}
+
+/*
+ * Same as `pretokenizer_decode`, for the first `text_len` bytes of `text`
+ * and without removing the prefix. `buffer` needs room for `text_len + 1`
+ * bytes, since decoding never makes the text longer.
+ */
+size_t pretokenizer_decode_n(const char* text,
+                             size_t text_len,
+                             const struct DecodeContext* ctx,
+                             char* buffer) {
     char* dest = buffer;
     const char* p = text;
     const char* end_of_text = text + text_len;
     const struct ACAutomaton* automaton = ctx->ac;
 
-    if (ctx->is_byte_encoder) {
-        while (p < end_of_text) {
-            const struct ACNode* longest_match_node = NULL;
-            size_t longest_match_len = 0;
-
-            struct ACNode* current_node = automaton->root;
-            for (const char* q = p; q < end_of_text; ++q) {
-                unsigned char index = (unsigned char)*q;
-                if (current_node->children[index]) {
-                    current_node = current_node->children[index];
-                    if (current_node->output_value != -1) {
-                        longest_match_node = current_node;
-                        longest_match_len = current_node->pattern_len;
-                    }
-                } else {
-                    break;
-                }
-            }
+    while (p < end_of_text) {
+        // The special characters are replaced by their bytes, taking the
+        // longest one where several start at the same position.
+        struct ACMatch match;
+        bool has_match = ac_automaton_find(automaton, p, end_of_text - p, NULL,
+                                           &match);
+        const char* match_start = has_match ? p + match.start : end_of_text;
 
-            if (longest_match_node) {
-                *dest++ = (unsigned char)longest_match_node->output_value;
-                p += longest_match_len;
-            } else {
+        if (ctx->is_byte_encoder) {
+            while (p < match_start) {
                 int bytes_in_char = 0;
                 uint32_t codepoint =
                     utf8_to_codepoint((const unsigned char*)p, &bytes_in_char);
@@ -252,37 +296,16 @@ size_t pretokenizer_decode(const char* text,
                 }
                 p += (bytes_in_char > 0) ? bytes_in_char : 1;
             }
+        } else {
+            memcpy(dest, p, match_start - p);
+            dest += match_start - p;
+            p = match_start;
         }
-    } else {
-        while (p < end_of_text) {
-            const struct ACNode* longest_match_node = NULL;
-            size_t longest_match_len = 0;
-
-            struct ACNode* current_node = automaton->root;
-            for (const char* q = p; q < end_of_text; ++q) {
-                unsigned char index = (unsigned char)*q;
-                if (current_node->children[index]) {
-                    current_node = current_node->children[index];
-                    if (current_node->output_value != -1) {
-                        longest_match_node = current_node;
-                        longest_match_len = current_node->pattern_len;
-                    }
-                } else {
-                    break;
-                }
-            }
 
-            if (longest_match_node) {
-                *dest++ = (unsigned char)longest_match_node->output_value;
-                p += longest_match_len;
-                log_debug("Matched special token of length %zu",
-                          longest_match_len);
-            } else {
-                int char_len = utf8_char_length((const unsigned char*)p);
-                memcpy(dest, p, char_len);
-                dest += char_len;
-                p += char_len;
-            }
+        if (has_match) {
+            *dest++ = (unsigned char)match.output_value;
+            p += match.len;
+            log_debug("Matched special token of length %zu", match.len);
         }
     }
 
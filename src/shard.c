@@ -0,0 +1,686 @@
+#include "hutoken/shard.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "hutoken/bpe.h"
+#include "hutoken/core.h"
+#include "hutoken/hashmap.h"
+#include "hutoken/helper.h"
+#include "hutoken/taskqueue.h"
+#include "hutoken/vector.h"
+
+/*
+ * Every shard is a pair of files:
+ *
+ *   <prefix>_<n>.bin  the tokens of its documents, back to back, as uint16 or
+ *                     uint32 values in native byte order
+ *   <prefix>_<n>.idx  "HUTOKIDX", uint32 version, uint32 bytes per token,
+ *                     uint64 number of documents, followed by number of
+ *                     documents + 1 uint64 token offsets into the .bin file
+ *
+ * Input files are memory mapped and cut into documents at the separator.
+ * Documents are queued in batches of about SHARD_BATCH_BYTES; a batch is
+ * encoded by the worker threads while the previous one is being written out
+ * by a writer thread, so at most two batches of tokens are held in memory.
+ */
+static const char SHARD_INDEX_MAGIC[8] = {'H', 'U', 'T', 'O',
+                                          'K', 'I', 'D', 'X'};
+static const uint32_t SHARD_INDEX_VERSION = 1;
+static const size_t SHARD_BATCH_BYTES = (size_t)32 * 1024 * 1024;
+// Documents longer than this are encoded in pieces when the built-in
+// pretokenizer is used, see `encode_find_split`.
+static const size_t SHARD_MAX_PIECE = (size_t)1024 * 1024;
+static const size_t SHARD_CONVERT_CHUNK = 65536;
+
+struct MappedFile {
+    const char* data;
+    size_t size;
+};
+
+struct ShardBatch {
+    struct EncodeTask* tasks;
+    struct IntVector* tokens;
+    bool* ends_document;
+    size_t count;
+    size_t capacity;
+    size_t bytes;
+    // Inputs whose last document is in this batch, unmapped once it is
+    // encoded.
+    struct MappedFile* files;
+    size_t num_files;
+    size_t files_capacity;
+};
+
+struct ShardWriter {
+    const struct ShardOptions* options;
+    struct ShardStats* stats;
+    FILE* bin;
+    FILE* idx;
+    size_t shard_tokens;
+    size_t shard_documents;
+    void* convert_buffer;
+    struct ShardBatch* batch;  // batch being written by the writer thread
+    char* error_msg;
+};
+
+struct ShardEncoder {
+    struct EncodeContext* ctx;
+    const struct ShardOptions* options;
+    struct ShardWriter writer;
+    struct ShardBatch batches[2];
+    int current;
+    bool writing;
+    thread_t writer_thread;
+    thread_t* threads;
+};
+
+static char* map_file(const char* path, struct MappedFile* file);
+static void unmap_file(struct MappedFile* file);
+static const char* find_separator(const char* text,
+                                  size_t len,
+                                  const char* separator,
+                                  size_t separator_len);
+static char* encode_input(struct ShardEncoder* enc, const char* path);
+static char* add_document(struct ShardEncoder* enc,
+                          const char* text,
+                          size_t len);
+static char* add_piece(struct ShardEncoder* enc,
+                       const char* text,
+                       size_t len,
+                       bool continuation,
+                       bool ends_document);
+static char* flush_batch(struct ShardEncoder* enc);
+static char* wait_writer(struct ShardEncoder* enc);
+static void batch_reset(struct ShardBatch* batch);
+static void batch_free(struct ShardBatch* batch);
+static thread_return_t shard_encode_worker(thread_arg_t arg);
+static thread_return_t shard_write_batch(thread_arg_t arg);
+static char* write_tokens(struct ShardWriter* writer,
+                          const int* tokens,
+                          size_t count);
+static char* end_document(struct ShardWriter* writer);
+static char* open_shard(struct ShardWriter* writer);
+static char* close_shard(struct ShardWriter* writer);
+static size_t token_size_for(struct EncodeContext* ctx, int eos_id);
+
+/*
+ * Encodes the input files into token shards named after
+ * `options->output_prefix`. Documents never span two shards; a new shard is
+ * started once the current one holds at least `options->max_shard_tokens`
+ * tokens. Returns an error message or NULL. Shards written before an error
+ * are left on disk.
+ */
+char* shard_encode_files(struct EncodeContext* ctx,
+                         const char* const* input_paths,
+                         size_t num_paths,
+                         const struct ShardOptions* options,
+                         struct ShardStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->token_size = token_size_for(ctx, options->eos_id);
+
+    struct ShardEncoder enc;
+    memset(&enc, 0, sizeof(enc));
+    enc.ctx = ctx;
+    enc.options = options;
+    enc.writer.options = options;
+    enc.writer.stats = stats;
+    enc.writer.convert_buffer = malloc(SHARD_CONVERT_CHUNK * sizeof(uint32_t));
+    enc.threads = malloc(options->num_threads * sizeof(thread_t));
+    if (!enc.writer.convert_buffer || !enc.threads) {
+        free(enc.writer.convert_buffer);
+        free(enc.threads);
+        return "Failed to allocate memory for file encoding.";
+    }
+
+    log_debug("Encoding %zu files into shards of %zu-byte tokens.", num_paths,
+              stats->token_size);
+
+    char* error_msg = NULL;
+    for (size_t i = 0; i < num_paths && !error_msg; ++i) {
+        error_msg = encode_input(&enc, input_paths[i]);
+    }
+    if (!error_msg) {
+        error_msg = flush_batch(&enc);
+    }
+
+    char* writer_error = wait_writer(&enc);
+    if (!error_msg) {
+        error_msg = writer_error;
+    }
+
+    char* close_error = close_shard(&enc.writer);
+    if (!error_msg) {
+        error_msg = close_error;
+    }
+
+    batch_free(&enc.batches[0]);
+    batch_free(&enc.batches[1]);
+    free(enc.writer.convert_buffer);
+    free(enc.threads);
+
+    log_debug("Encoded %zu documents into %zu tokens and %zu shards.",
+              stats->num_documents, stats->num_tokens, stats->num_shards);
+
+    return error_msg;
+}
+
+// Queues every document of one input file.
+static char* encode_input(struct ShardEncoder* enc, const char* path) {
+    struct MappedFile file;
+    char* error_msg = map_file(path, &file);
+    if (error_msg) {
+        return error_msg;
+    }
+
+    const char* cursor = file.data;
+    const char* end = file.data + file.size;
+    while (cursor < end && !error_msg) {
+        const char* doc_end =
+            find_separator(cursor, end - cursor, enc->options->doc_separator,
+                           enc->options->doc_separator_len);
+        if (!doc_end) {
+            error_msg = add_document(enc, cursor, end - cursor);
+            cursor = end;
+        } else {
+            error_msg = add_document(enc, cursor, doc_end - cursor);
+            cursor = doc_end + enc->options->doc_separator_len;
+        }
+    }
+
+    // The mapping is released after the batch holding the file's last
+    // document has been encoded.
+    struct ShardBatch* batch = &enc->batches[enc->current];
+    if (batch->num_files == batch->files_capacity) {
+        size_t new_capacity =
+            batch->files_capacity ? batch->files_capacity * 2 : 8;
+        struct MappedFile* files =
+            realloc(batch->files, new_capacity * sizeof(struct MappedFile));
+        if (!files) {
+            unmap_file(&file);
+            return "Failed to allocate memory for file encoding.";
+        }
+        batch->files = files;
+        batch->files_capacity = new_capacity;
+    }
+    batch->files[batch->num_files++] = file;
+
+    return error_msg;
+}
+
+static char* add_document(struct ShardEncoder* enc,
+                          const char* text,
+                          size_t len) {
+    if (len == 0) {
+        return NULL;
+    }
+    // Encoding stops at a NUL byte, so the rest of the document would be lost.
+    if (memchr(text, '\0', len) != NULL) {
+        return ENCODE_NUL_CHARACTER_MSG;
+    }
+
+    if (enc->ctx->pattern != NULL || len <= SHARD_MAX_PIECE) {
+        return add_piece(enc, text, len, false, true);
+    }
+
+    size_t start = 0;
+    while (start < len) {
+        size_t end =
+            len - start <= SHARD_MAX_PIECE
+                ? len
+                : encode_find_split(text, len, start + SHARD_MAX_PIECE);
+        char* error_msg =
+            add_piece(enc, text + start, end - start, start > 0, end == len);
+        if (error_msg) {
+            return error_msg;
+        }
+        start = end;
+    }
+
+    return NULL;
+}
+
+static char* add_piece(struct ShardEncoder* enc,
+                       const char* text,
+                       size_t len,
+                       bool continuation,
+                       bool ends_document) {
+    struct ShardBatch* batch = &enc->batches[enc->current];
+    if (batch->bytes >= SHARD_BATCH_BYTES) {
+        char* error_msg = flush_batch(enc);
+        if (error_msg) {
+            return error_msg;
+        }
+        batch = &enc->batches[enc->current];
+    }
+
+    if (batch->count == batch->capacity) {
+        size_t new_capacity = batch->capacity ? batch->capacity * 2 : 256;
+        struct EncodeTask* tasks =
+            realloc(batch->tasks, new_capacity * sizeof(struct EncodeTask));
+        if (tasks) {
+            batch->tasks = tasks;
+        }
+        struct IntVector* tokens =
+            realloc(batch->tokens, new_capacity * sizeof(struct IntVector));
+        if (tokens) {
+            batch->tokens = tokens;
+        }
+        bool* ends = realloc(batch->ends_document, new_capacity * sizeof(bool));
+        if (ends) {
+            batch->ends_document = ends;
+        }
+        if (!tasks || !tokens || !ends) {
+            return "Failed to allocate memory for file encoding.";
+        }
+        batch->capacity = new_capacity;
+    }
+
+    size_t i = batch->count;
+    vector_init(&batch->tokens[i], len / 4 + 16);
+    if (!batch->tokens[i].data) {
+        return "Failed to allocate memory for file encoding.";
+    }
+    // The tokens pointer is set in `flush_batch`, after the last realloc.
+    batch->tasks[i] = (struct EncodeTask){.text = (char*)text,
+                                          .text_len = len,
+                                          .continuation = continuation,
+                                          .ctx = enc->ctx,
+                                          .tokens = NULL,
+                                          .error_msg = NULL};
+    batch->ends_document[i] = ends_document;
+    batch->count++;
+    batch->bytes += len;
+
+    return NULL;
+}
+
+/*
+ * Encodes the current batch on the worker threads, then hands it to the
+ * writer thread once the previous batch has been written, and continues
+ * with the other batch.
+ */
+static char* flush_batch(struct ShardEncoder* enc) {
+    struct ShardBatch* batch = &enc->batches[enc->current];
+
+    if (batch->count > 0) {
+        for (size_t i = 0; i < batch->count; ++i) {
+            batch->tasks[i].tokens = &batch->tokens[i];
+        }
+
+        int num_threads = enc->options->num_threads;
+        if ((size_t)num_threads > batch->count) {
+            num_threads = (int)batch->count;
+        }
+
+        TaskQueue q;
+        taskqueue_init(&q, batch->tasks, (int)batch->count);
+
+        for (int i = 0; i < num_threads; i++) {
+            THREAD_CREATE(&enc->threads[i], shard_encode_worker, &q);
+        }
+
+        for (int i = 0; i < num_threads; i++) {
+            THREAD_JOIN(enc->threads[i]);
+        }
+
+        log_debug("Encoded batch of %zu pieces, %zu bytes.", batch->count,
+                  batch->bytes);
+    }
+
+    for (size_t i = 0; i < batch->num_files; ++i) {
+        unmap_file(&batch->files[i]);
+    }
+    batch->num_files = 0;
+
+    for (size_t i = 0; i < batch->count; ++i) {
+        if (batch->tasks[i].error_msg) {
+            return batch->tasks[i].error_msg;
+        }
+    }
+
+    char* error_msg = wait_writer(enc);
+    if (error_msg || batch->count == 0) {
+        return error_msg;
+    }
+
+    enc->writer.batch = batch;
+    THREAD_CREATE(&enc->writer_thread, shard_write_batch, &enc->writer);
+    enc->writing = true;
+    enc->current ^= 1;
+
+    return NULL;
+}
+
+// Waits for the writer thread and empties the batch it has written.
+static char* wait_writer(struct ShardEncoder* enc) {
+    if (!enc->writing) {
+        return NULL;
+    }
+
+    THREAD_JOIN(enc->writer_thread);
+    enc->writing = false;
+    batch_reset(enc->writer.batch);
+
+    return enc->writer.error_msg;
+}
+
+static void batch_reset(struct ShardBatch* batch) {
+    for (size_t i = 0; i < batch->count; ++i) {
+        vector_free(&batch->tokens[i]);
+    }
+    batch->count = 0;
+    batch->bytes = 0;
+}
+
+static void batch_free(struct ShardBatch* batch) {
+    batch_reset(batch);
+    for (size_t i = 0; i < batch->num_files; ++i) {
+        unmap_file(&batch->files[i]);
+    }
+    free(batch->tasks);
+    free(batch->tokens);
+    free(batch->ends_document);
+    free(batch->files);
+}
+
+static thread_return_t shard_encode_worker(thread_arg_t arg) {
+    TaskQueue* q = (TaskQueue*)arg;
+    struct EncodeTask* task = NULL;
+
+    while ((task = taskqueue_get(q)) != NULL) {
+        encode(task);
+    }
+
+    return 0;
+}
+
+static thread_return_t shard_write_batch(thread_arg_t arg) {
+    struct ShardWriter* writer = (struct ShardWriter*)arg;
+    struct ShardBatch* batch = writer->batch;
+
+    for (size_t i = 0; i < batch->count && !writer->error_msg; ++i) {
+        writer->error_msg = write_tokens(writer, batch->tokens[i].data,
+                                         batch->tokens[i].size);
+        if (!writer->error_msg && batch->ends_document[i]) {
+            writer->error_msg = end_document(writer);
+        }
+    }
+
+    return 0;
+}
+
+static char* write_tokens(struct ShardWriter* writer,
+                          const int* tokens,
+                          size_t count) {
+    if (count == 0) {
+        return NULL;
+    }
+    if (!writer->bin) {
+        char* error_msg = open_shard(writer);
+        if (error_msg) {
+            return error_msg;
+        }
+    }
+
+    size_t token_size = writer->stats->token_size;
+    uint32_t max_token = token_size == 2 ? UINT16_MAX : UINT32_MAX;
+
+    while (count > 0) {
+        size_t n = count < SHARD_CONVERT_CHUNK ? count : SHARD_CONVERT_CHUNK;
+
+        for (size_t i = 0; i < n; ++i) {
+            if (tokens[i] < 0 || (uint32_t)tokens[i] > max_token) {
+                log_debug("Token %d does not fit in %zu bytes.", tokens[i],
+                          token_size);
+                return "Text contains characters that are not in the "
+                       "vocabulary.";
+            }
+            if (token_size == 2) {
+                ((uint16_t*)writer->convert_buffer)[i] = (uint16_t)tokens[i];
+            } else {
+                ((uint32_t*)writer->convert_buffer)[i] = (uint32_t)tokens[i];
+            }
+        }
+
+        if (fwrite(writer->convert_buffer, token_size, n, writer->bin) != n) {
+            return "Failed to write shard file.";
+        }
+
+        writer->shard_tokens += n;
+        writer->stats->num_tokens += n;
+        tokens += n;
+        count -= n;
+    }
+
+    return NULL;
+}
+
+static char* end_document(struct ShardWriter* writer) {
+    if (writer->options->eos_id >= 0) {
+        char* error_msg = write_tokens(writer, &writer->options->eos_id, 1);
+        if (error_msg) {
+            return error_msg;
+        }
+    }
+    if (!writer->bin) {
+        return NULL;
+    }
+
+    uint64_t offset = writer->shard_tokens;
+    if (fwrite(&offset, sizeof(offset), 1, writer->idx) != 1) {
+        return "Failed to write shard index file.";
+    }
+    writer->shard_documents++;
+    writer->stats->num_documents++;
+
+    if (writer->shard_tokens >= writer->options->max_shard_tokens) {
+        return close_shard(writer);
+    }
+
+    return NULL;
+}
+
+static char* open_shard(struct ShardWriter* writer) {
+    const char* prefix = writer->options->output_prefix;
+    size_t path_len = strlen(prefix) + 32;
+    char* path = malloc(path_len);
+    if (!path) {
+        return "Failed to allocate memory for file encoding.";
+    }
+
+    snprintf(path, path_len, "%s_%05zu.bin", prefix, writer->stats->num_shards);
+    writer->bin = fopen(path, "wb");
+    snprintf(path, path_len, "%s_%05zu.idx", prefix, writer->stats->num_shards);
+    writer->idx = fopen(path, "wb");
+    free(path);
+
+    if (!writer->bin || !writer->idx) {
+        if (writer->bin) {
+            fclose(writer->bin);
+        }
+        if (writer->idx) {
+            fclose(writer->idx);
+        }
+        writer->bin = NULL;
+        writer->idx = NULL;
+        return "Could not create shard files.";
+    }
+
+    writer->stats->num_shards++;
+    writer->shard_tokens = 0;
+    writer->shard_documents = 0;
+
+    uint32_t token_size = (uint32_t)writer->stats->token_size;
+    uint64_t num_documents = 0;
+    uint64_t first_offset = 0;
+    if (fwrite(SHARD_INDEX_MAGIC, sizeof(SHARD_INDEX_MAGIC), 1, writer->idx) !=
+            1 ||
+        fwrite(&SHARD_INDEX_VERSION, sizeof(uint32_t), 1, writer->idx) != 1 ||
+        fwrite(&token_size, sizeof(uint32_t), 1, writer->idx) != 1 ||
+        fwrite(&num_documents, sizeof(uint64_t), 1, writer->idx) != 1 ||
+        fwrite(&first_offset, sizeof(uint64_t), 1, writer->idx) != 1) {
+        return "Failed to write shard index file.";
+    }
+
+    return NULL;
+}
+
+// Fills in the document count of the index header and closes the shard.
+static char* close_shard(struct ShardWriter* writer) {
+    if (!writer->bin) {
+        return NULL;
+    }
+
+    char* error_msg = NULL;
+    uint64_t num_documents = writer->shard_documents;
+    if (fseek(writer->idx, sizeof(SHARD_INDEX_MAGIC) + 2 * sizeof(uint32_t),
+              SEEK_SET) != 0 ||
+        fwrite(&num_documents, sizeof(uint64_t), 1, writer->idx) != 1) {
+        error_msg = "Failed to write shard index file.";
+    }
+    if (fclose(writer->idx) != 0 && !error_msg) {
+        error_msg = "Failed to write shard index file.";
+    }
+    if (fclose(writer->bin) != 0 && !error_msg) {
+        error_msg = "Failed to write shard file.";
+    }
+
+    writer->bin = NULL;
+    writer->idx = NULL;
+
+    return error_msg;
+}
+
+// Two bytes per token are enough if every token id fits in 16 bits.
+static size_t token_size_for(struct EncodeContext* ctx, int eos_id) {
+    int max_id = eos_id;
+    size_t iter = 0;
+    void* item = NULL;
+    while (hashmap_iter(ctx->vocab_encode, &iter, &item)) {
+        const struct Token* token = item;
+        if (token->value > max_id) {
+            max_id = token->value;
+        }
+    }
+
+    return max_id <= UINT16_MAX ? 2 : 4;
+}
+
+static const char* find_separator(const char* text,
+                                  size_t len,
+                                  const char* separator,
+                                  size_t separator_len) {
+    if (separator_len == 0 || len < separator_len) {
+        return NULL;
+    }
+
+    const char* last = text + len - separator_len;
+    const char* p = text;
+    while (p <= last) {
+        p = memchr(p, separator[0], last - p + 1);
+        if (!p) {
+            return NULL;
+        }
+        if (memcmp(p, separator, separator_len) == 0) {
+            return p;
+        }
+        p++;
+    }
+
+    return NULL;
+}
+
+static char* map_file(const char* path, struct MappedFile* file) {
+    file->data = NULL;
+    file->size = 0;
+
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE handle =
+        CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                    FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return "Could not open input file.";
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size)) {
+        CloseHandle(handle);
+        return "Could not read size of input file.";
+    }
+
+    if (size.QuadPart > 0) {
+        HANDLE mapping =
+            CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        void* data =
+            mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        if (!data) {
+            CloseHandle(handle);
+            return "Could not map input file.";
+        }
+        file->data = data;
+        file->size = (size_t)size.QuadPart;
+    }
+
+    CloseHandle(handle);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return "Could not open input file.";
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return "Could not read size of input file.";
+    }
+
+    if (st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return "Could not map input file.";
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+#endif
+        file->data = data;
+        file->size = st.st_size;
+    }
+
+    close(fd);
+#endif
+
+    return NULL;
+}
+
+static void unmap_file(struct MappedFile* file) {
+    if (!file->data) {
+        return;
+    }
+
+#if defined(_WIN32) || defined(_WIN64)
+    UnmapViewOfFile(file->data);
+#else
+    munmap((void*)file->data, file->size);
+#endif
+
+    file->data = NULL;
+    file->size = 0;
+}
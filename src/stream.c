@@ -0,0 +1,210 @@
+#include "hutoken/stream.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hutoken/core.h"
+#include "hutoken/helper.h"
+#include "hutoken/pretokenizer.h"
+#include "hutoken/taskqueue.h"
+#include "hutoken/vector.h"
+
+static const size_t STREAM_INITIAL_CAPACITY = 4096;
+
+static char* encode_pending(struct StreamEncoder* stream,
+                            size_t len,
+                            struct IntVector* tokens);
+
+bool stream_encoder_init(struct StreamEncoder* stream,
+                         struct EncodeContext* ctx) {
+    if (!stream || !ctx) {
+        return false;
+    }
+
+    stream->pending = malloc(STREAM_INITIAL_CAPACITY);
+    if (!stream->pending) {
+        log_debug("Error: Failed to allocate stream encoder buffer.");
+        return false;
+    }
+
+    stream->ctx = ctx;
+    stream->pending_len = 0;
+    stream->pending_capacity = STREAM_INITIAL_CAPACITY;
+    stream->started = false;
+
+    return true;
+}
+
+void stream_encoder_release(struct StreamEncoder* stream) {
+    if (stream) {
+        free(stream->pending);
+        stream->pending = NULL;
+        stream->pending_len = 0;
+        stream->pending_capacity = 0;
+    }
+}
+
+/*
+ * Appends a chunk of UTF-8 text and encodes everything up to the last
+ * position where a new pretoken is guaranteed to start. Those tokens cannot
+ * change with later input, so they are appended to `tokens` right away. The
+ * rest, i.e. the unfinished last pretoken and any incomplete UTF-8 sequence,
+ * is kept until the next chunk arrives. Returns an error message or NULL.
+ */
+char* stream_encoder_feed(struct StreamEncoder* stream,
+                          const char* chunk,
+                          size_t chunk_len,
+                          struct IntVector* tokens) {
+    size_t needed = stream->pending_len + chunk_len + 1;
+    if (needed > stream->pending_capacity) {
+        size_t new_capacity = stream->pending_capacity * 2;
+        if (new_capacity < needed) {
+            new_capacity = needed;
+        }
+        char* new_pending = realloc(stream->pending, new_capacity);
+        if (!new_pending) {
+            return "Failed to grow stream encoder buffer.";
+        }
+        stream->pending = new_pending;
+        stream->pending_capacity = new_capacity;
+    }
+
+    memcpy(stream->pending + stream->pending_len, chunk, chunk_len);
+    stream->pending_len += chunk_len;
+    stream->pending[stream->pending_len] = '\0';
+
+    // A custom regex gives no guarantee about where its matches start, so
+    // the whole text is kept until `stream_encoder_finish`.
+    if (stream->ctx->pattern != NULL) {
+        return NULL;
+    }
+
+    size_t split = encode_find_last_split(stream->pending, stream->pending_len);
+    if (split == 0) {
+        return NULL;
+    }
+
+    return encode_pending(stream, split, tokens);
+}
+
+// Encodes whatever is left. The encoder can be reused for a new text
+// afterwards.
+char* stream_encoder_finish(struct StreamEncoder* stream,
+                            struct IntVector* tokens) {
+    char* error_msg = NULL;
+
+    if (stream->pending_len > 0) {
+        error_msg = encode_pending(stream, stream->pending_len, tokens);
+    }
+
+    stream->pending_len = 0;
+    stream->started = false;
+
+    return error_msg;
+}
+
+// Encodes the first `len` pending bytes and drops them from the buffer.
+static char* encode_pending(struct StreamEncoder* stream,
+                            size_t len,
+                            struct IntVector* tokens) {
+    struct EncodeTask task = {.text = stream->pending,
+                              .text_len = len,
+                              .continuation = stream->started,
+                              .ctx = stream->ctx,
+                              .tokens = tokens,
+                              .error_msg = NULL};
+    encode(&task);
+
+    stream->started = true;
+    stream->pending_len -= len;
+    memmove(stream->pending, stream->pending + len, stream->pending_len);
+    stream->pending[stream->pending_len] = '\0';
+
+    log_debug("Stream encoder encoded %zu bytes, kept %zu bytes.", len,
+              stream->pending_len);
+
+    return task.error_msg;
+}
+
+void stream_decoder_init(struct StreamDecoder* stream,
+                         struct DecodeContext* ctx) {
+    stream->ctx = ctx;
+    stream->pending_len = 0;
+    stream->started = false;
+}
+
+/*
+ * Returns the length of the longest prefix of `text` that does not end in
+ * the middle of a UTF-8 sequence. Only the last three bytes are looked at.
+ */
+static size_t utf8_complete_len(const char* text, size_t len) {
+    size_t lead = len;
+    while (lead > 0 && len - lead < 3 &&
+           ((unsigned char)text[lead - 1] & 0xC0) == 0x80) {
+        lead--;
+    }
+    if (lead == 0 || ((unsigned char)text[lead - 1] & 0xC0) != 0xC0) {
+        return len;
+    }
+    lead--;
+    int expected = utf8_char_length((const unsigned char*)text + lead);
+    return len - lead < (size_t)expected ? lead : len;
+}
+
+/*
+ * Decodes `num_tokens` more tokens. `*text` is set to a malloc'd string
+ * holding the newly completed text: the bytes kept from the previous call
+ * followed by the new ones, up to an incomplete UTF-8 sequence at the end,
+ * which is kept for the next call. The work only depends on the number of
+ * new tokens. Returns an error message or NULL.
+ */
+char* stream_decoder_feed(struct StreamDecoder* stream,
+                          int tokens[],
+                          int num_tokens,
+                          char** text,
+                          size_t* text_len) {
+    struct DecodeTask task = {.tokens = tokens,
+                              .tokens_size = &num_tokens,
+                              .continuation = stream->started,
+                              .ctx = stream->ctx,
+                              .result = NULL,
+                              .error_msg = NULL};
+    decode(&task);
+    if (task.error_msg) {
+        return task.error_msg;
+    }
+    if (num_tokens > 0) {
+        stream->started = true;
+    }
+
+    size_t total = stream->pending_len + task.result_len;
+    char* result = realloc(task.result, total + 1);
+    if (!result) {
+        free(task.result);
+        return "Failed to allocate memory for decoded text.";
+    }
+    memmove(result + stream->pending_len, result, task.result_len);
+    memcpy(result, stream->pending, stream->pending_len);
+
+    size_t complete = utf8_complete_len(result, total);
+    stream->pending_len = total - complete;
+    memcpy(stream->pending, result + complete, stream->pending_len);
+    result[complete] = '\0';
+
+    *text = result;
+    *text_len = complete;
+    return NULL;
+}
+
+// Copies the kept bytes, at most 3, to `text` and resets the decoder for a
+// new sequence.
+void stream_decoder_finish(struct StreamDecoder* stream,
+                           char* text,
+                           size_t* text_len) {
+    memcpy(text, stream->pending, stream->pending_len);
+    *text_len = stream->pending_len;
+    stream->pending_len = 0;
+    stream->started = false;
+}
@@ -0,0 +1,1020 @@
+#include "hutoken/trainer.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hutoken/bpe.h"
+#include "hutoken/helper.h"
+#include "hutoken/taskqueue.h"
+
+// Merges with fewer occurrences than this per thread run on one thread.
+static const size_t PARALLEL_MERGE_MIN_PIECE = (size_t)16 * 1024;
+
+// Start of a checkpoint file, followed by its version.
+static const char CHECKPOINT_MAGIC[8] = "HUTOKCKP";
+static const uint32_t CHECKPOINT_VERSION = 1;
+
+struct PairIndexEntry {
+    int left;
+    int right;
+    size_t index;
+};
+
+// A run of occurrences of the pair being merged, rewritten on one thread.
+struct MergeWork {
+    struct Trainer* trainer;
+    const size_t* positions;
+    size_t num_positions;
+    int left;
+    int right;
+    int id;
+    struct PairUpdates* updates;
+};
+
+static uint64_t pair_index_hash(const void* item);
+static int pair_index_compare(const void* lhs, const void* rhs);
+static bool grow(void** array,
+                 size_t* capacity,
+                 size_t needed,
+                 size_t element_size);
+static bool resize(void** array, size_t capacity, size_t element_size);
+static bool append_word(struct Trainer* trainer,
+                        size_t len,
+                        int64_t freq,
+                        size_t* start);
+static bool add_token(struct Trainer* trainer, char* bytes, int* id);
+static size_t find_pair(struct Trainer* trainer,
+                        int left,
+                        int right,
+                        bool create);
+static bool update_pair(struct Trainer* trainer,
+                        int left,
+                        int right,
+                        int64_t delta,
+                        size_t position);
+static bool count_update(struct Trainer* trainer,
+                         size_t index,
+                         int64_t delta,
+                         size_t position);
+static bool heap_push(struct Trainer* trainer, struct PairHeapEntry entry);
+static struct PairHeapEntry heap_pop(struct Trainer* trainer);
+static void heap_sift_down(struct Trainer* trainer, size_t i);
+static int compare_positions(const void* lhs, const void* rhs);
+static bool merge_positions(struct Trainer* trainer,
+                            const size_t* positions,
+                            size_t num_positions,
+                            int left,
+                            int right,
+                            int id);
+static size_t split_positions(const struct Trainer* trainer,
+                              const size_t* positions,
+                              size_t num_positions,
+                              size_t num_pieces,
+                              size_t* ends);
+static thread_return_t merge_worker(thread_arg_t arg);
+static bool record_update(struct Trainer* trainer,
+                          struct PairUpdates* updates,
+                          int left,
+                          int right,
+                          int64_t delta,
+                          size_t position);
+static bool apply_updates(struct Trainer* trainer,
+                          const struct PairUpdates* updates,
+                          int id);
+static bool merge_at(struct Trainer* trainer,
+                     struct PairUpdates* updates,
+                     size_t position,
+                     int left,
+                     int right,
+                     int id);
+
+bool trainer_init(struct Trainer* trainer) {
+    *trainer = (struct Trainer){.num_threads = 1};
+    trainer->pair_index = hashmap_new(1024, sizeof(struct PairIndexEntry),
+                                      pair_index_hash, pair_index_compare);
+    trainer->vocab =
+        hashmap_new(1024, sizeof(struct Token), token_hash, token_compare);
+    vector_init(&trainer->touched, 64);
+    if (!trainer->pair_index || !trainer->vocab || !trainer->touched.data) {
+        trainer->oom = true;
+        return false;
+    }
+
+    // A token for each individual byte value, byte 0 being the empty string.
+    for (int i = 0; i < 256; i++) {
+        char* key = malloc(2);
+        if (!key) {
+            trainer->oom = true;
+            return false;
+        }
+        key[0] = (char)i;
+        key[1] = '\0';
+        int id = -1;
+        if (!add_token(trainer, key, &id)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Adds a word that occurs `freq` times in the corpus, one symbol per byte.
+ * The bytes must not contain NUL. All words have to be added before counting
+ * the pairs.
+ */
+bool trainer_add_word(struct Trainer* trainer,
+                      const char* bytes,
+                      size_t len,
+                      int64_t freq) {
+    if (len == 0 || freq <= 0) {
+        return true;
+    }
+    size_t start = 0;
+    if (!append_word(trainer, len, freq, &start)) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        trainer->symbols[start + i] = (unsigned char)bytes[i];
+    }
+    return true;
+}
+
+// Adds every distinct word once, weighted by the times it occurs.
+bool trainer_add_word_counts(struct Trainer* trainer,
+                             struct WordCounts* counts) {
+    size_t i = 0;
+    void* item = NULL;
+    while (hashmap_iter(counts->words, &i, &item)) {
+        const struct WordCount* word = item;
+        if (!trainer_add_word(trainer, word->bytes, word->len, word->count)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool write_values(FILE* file, const void* values, size_t size) {
+    return fwrite(values, 1, size, file) == size;
+}
+
+static bool read_values(FILE* file, void* values, size_t size) {
+    return fread(values, 1, size, file) == size;
+}
+
+/*
+ * Writes what training has learned and still needs to the file: the tokens
+ * after the 256 bytes, the merges in order, and the words that can still be
+ * merged, as their current symbols. The pair counts follow from the words,
+ * so they are counted again on resuming rather than stored. Numbers are
+ * written in the byte order of the machine.
+ */
+bool trainer_write_checkpoint(const struct Trainer* trainer, FILE* file) {
+    uint64_t num_tokens = trainer->num_tokens;
+    uint64_t num_merges = trainer->num_merges;
+    bool ok = write_values(file, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) &&
+              write_values(file, &CHECKPOINT_VERSION,
+                           sizeof(CHECKPOINT_VERSION)) &&
+              write_values(file, &num_tokens, sizeof(num_tokens));
+    for (size_t i = 256; ok && i < trainer->num_tokens; i++) {
+        uint32_t len = (uint32_t)strlen(trainer->tokens[i]);
+        ok = write_values(file, &len, sizeof(len)) &&
+             write_values(file, trainer->tokens[i], len);
+    }
+    ok = ok && write_values(file, &num_merges, sizeof(num_merges));
+    for (size_t i = 0; ok && i < trainer->num_merges; i++) {
+        const struct TrainerMerge* merge = &trainer->merges[i];
+        int32_t ids[3] = {merge->left, merge->right, merge->id};
+        ok = write_values(file, ids, sizeof(ids)) &&
+             write_values(file, &merge->count, sizeof(merge->count));
+    }
+
+    // A word of a single symbol has no pair left, so it is left out.
+    for (size_t w = 0; ok && w < trainer->num_words; w++) {
+        size_t first = trainer->word_starts[w];
+        uint32_t len = 0;
+        for (size_t i = first; i != TRAINER_NONE; i = trainer->next[i]) {
+            len++;
+        }
+        if (len < 2) {
+            continue;
+        }
+        ok = write_values(file, &trainer->freqs[first], sizeof(int64_t)) &&
+             write_values(file, &len, sizeof(len));
+        for (size_t i = first; ok && i != TRAINER_NONE; i = trainer->next[i]) {
+            int32_t symbol = trainer->symbols[i];
+            ok = write_values(file, &symbol, sizeof(symbol));
+        }
+    }
+    return ok;
+}
+
+/*
+ * Restores the state written by `trainer_write_checkpoint` into a trainer
+ * that has no words yet. The pairs have to be counted afterwards. Returns
+ * false if the file cannot be read or is not a valid checkpoint, setting
+ * `oom` if it was for lack of memory.
+ */
+bool trainer_read_checkpoint(struct Trainer* trainer, FILE* file) {
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    uint32_t version = 0;
+    uint64_t num_tokens = 0;
+    if (!read_values(file, magic, sizeof(magic)) ||
+        memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0 ||
+        !read_values(file, &version, sizeof(version)) ||
+        version != CHECKPOINT_VERSION ||
+        !read_values(file, &num_tokens, sizeof(num_tokens)) ||
+        num_tokens < trainer->num_tokens || num_tokens > INT_MAX) {
+        log_debug("Error: Not a checkpoint of this version.");
+        return false;
+    }
+
+    while (trainer->num_tokens < num_tokens) {
+        uint32_t len = 0;
+        if (!read_values(file, &len, sizeof(len))) {
+            return false;
+        }
+        char* bytes = malloc((size_t)len + 1);
+        if (!bytes) {
+            trainer->oom = true;
+            return false;
+        }
+        bytes[len] = '\0';
+        if (!read_values(file, bytes, len) || strlen(bytes) != len) {
+            free(bytes);
+            return false;
+        }
+        size_t expected = trainer->num_tokens;
+        int id = -1;
+        if (!add_token(trainer, bytes, &id)) {
+            return false;
+        }
+        if ((size_t)id != expected) {
+            log_debug("Error: Token %zu of the checkpoint is a duplicate.",
+                      expected);
+            return false;
+        }
+    }
+
+    // Every merge made one of the tokens, so a larger count is corrupt
+    // rather than a reason to allocate that much.
+    uint64_t num_merges = 0;
+    if (!read_values(file, &num_merges, sizeof(num_merges)) ||
+        num_merges > num_tokens) {
+        return false;
+    }
+    if (!grow((void**)&trainer->merges, &trainer->merges_capacity,
+              (size_t)num_merges, sizeof(struct TrainerMerge))) {
+        trainer->oom = true;
+        return false;
+    }
+    for (; trainer->num_merges < num_merges; trainer->num_merges++) {
+        int32_t ids[3];
+        int64_t count = 0;
+        if (!read_values(file, ids, sizeof(ids)) ||
+            !read_values(file, &count, sizeof(count))) {
+            return false;
+        }
+        for (int k = 0; k < 3; k++) {
+            if (ids[k] < 0 || (uint64_t)ids[k] >= num_tokens) {
+                return false;
+            }
+        }
+        trainer->merges[trainer->num_merges] = (struct TrainerMerge){
+            .left = ids[0], .right = ids[1], .id = ids[2], .count = count};
+    }
+
+    // The words run to the end of the file, which has to end between two of
+    // them: a partly written word means the file was cut short.
+    while (true) {
+        int64_t freq = 0;
+        size_t read = fread(&freq, 1, sizeof(freq), file);
+        if (read == 0 && feof(file)) {
+            break;
+        }
+        if (read != sizeof(freq)) {
+            return false;
+        }
+        uint32_t len = 0;
+        size_t start = 0;
+        if (freq <= 0 || !read_values(file, &len, sizeof(len)) || len == 0 ||
+            !append_word(trainer, len, freq, &start)) {
+            return false;
+        }
+        for (size_t i = 0; i < len; i++) {
+            int32_t symbol = 0;
+            if (!read_values(file, &symbol, sizeof(symbol)) || symbol < 0 ||
+                (uint64_t)symbol >= num_tokens) {
+                return false;
+            }
+            trainer->symbols[start + i] = symbol;
+        }
+    }
+    return true;
+}
+
+/*
+ * Counts every adjacent pair of symbols once, weighted by the frequency of
+ * the words, and puts the pairs on the heap. From here on the counts are
+ * only updated by the merges.
+ */
+bool trainer_count_pairs(struct Trainer* trainer) {
+    for (size_t w = 0; w < trainer->num_words; w++) {
+        size_t end = w + 1 < trainer->num_words ? trainer->word_starts[w + 1]
+                                                : trainer->num_symbols;
+        for (size_t i = trainer->word_starts[w]; i + 1 < end; i++) {
+            if (!update_pair(trainer, trainer->symbols[i],
+                             trainer->symbols[i + 1], trainer->freqs[i], i)) {
+                return false;
+            }
+        }
+    }
+
+    if (!grow((void**)&trainer->heap, &trainer->heap_capacity,
+              trainer->num_pairs, sizeof(struct PairHeapEntry))) {
+        trainer->oom = true;
+        return false;
+    }
+    for (size_t i = 0; i < trainer->num_pairs; i++) {
+        const struct PairStats* pair = &trainer->pairs[i];
+        trainer->heap[i] = (struct PairHeapEntry){
+            .count = pair->count, .left = pair->left, .right = pair->right};
+    }
+    trainer->heap_size = trainer->num_pairs;
+    for (size_t i = trainer->heap_size / 2; i-- > 0;) {
+        heap_sift_down(trainer, i);
+    }
+    trainer->touched.size = 0;
+    return true;
+}
+
+/*
+ * Merges the most frequent pair, the smallest one by its ids among equally
+ * frequent pairs, if it occurs at least `min_frequency` times. The merged
+ * token gets the next id, unless a token with the same bytes already
+ * exists. Only the occurrences of the pair are touched. Returns false if
+ * there is no pair to merge, or on error, which sets `oom` if it was for
+ * lack of memory.
+ */
+bool trainer_merge_next(struct Trainer* trainer,
+                        int64_t min_frequency,
+                        struct TrainerMerge* merge) {
+    trainer->oom = false;
+    if (min_frequency < 1) {
+        min_frequency = 1;
+    }
+
+    size_t index = SIZE_MAX;
+    while (trainer->heap_size > 0) {
+        struct PairHeapEntry top = trainer->heap[0];
+        size_t found = find_pair(trainer, top.left, top.right, false);
+        // Entries pushed before the count last changed are outdated.
+        if (found == SIZE_MAX || trainer->pairs[found].count != top.count) {
+            heap_pop(trainer);
+            continue;
+        }
+        if (top.count < min_frequency) {
+            return false;
+        }
+        heap_pop(trainer);
+        index = found;
+        break;
+    }
+    if (index == SIZE_MAX) {
+        return false;
+    }
+
+    int left = trainer->pairs[index].left;
+    int right = trainer->pairs[index].right;
+    int64_t count = trainer->pairs[index].count;
+
+    size_t left_len = strlen(trainer->tokens[left]);
+    size_t right_len = strlen(trainer->tokens[right]);
+    char* bytes = malloc(left_len + right_len + 1);
+    if (!bytes) {
+        trainer->oom = true;
+        return false;
+    }
+    memcpy(bytes, trainer->tokens[left], left_len);
+    memcpy(bytes + left_len, trainer->tokens[right], right_len + 1);
+    int id = -1;
+    if (!add_token(trainer, bytes, &id)) {
+        return false;
+    }
+
+    // The occurrences are merged from left to right, as the merges within a
+    // word depend on the order, and the pair only loses occurrences while
+    // they are walked.
+    struct PositionList positions = trainer->pairs[index].positions;
+    trainer->pairs[index].positions = (struct PositionList){0};
+    for (size_t i = 1; i < positions.size; i++) {
+        if (positions.data[i] < positions.data[i - 1]) {
+            qsort(positions.data, positions.size, sizeof(size_t),
+                  compare_positions);
+            break;
+        }
+    }
+    if (!grow((void**)&trainer->merges, &trainer->merges_capacity,
+              trainer->num_merges + 1, sizeof(struct TrainerMerge))) {
+        free(positions.data);
+        trainer->oom = true;
+        return false;
+    }
+    *merge = (struct TrainerMerge){
+        .left = left, .right = right, .id = id, .count = count};
+    trainer->merges[trainer->num_merges++] = *merge;
+    trainer->touched.size = 0;
+
+    bool ok = merge_positions(trainer, positions.data, positions.size, left,
+                              right, id);
+    free(positions.data);
+
+    for (size_t i = 0; i < trainer->touched.size && ok; i++) {
+        const struct PairStats* pair =
+            &trainer->pairs[trainer->touched.data[i]];
+        if (pair->count > 0) {
+            ok = heap_push(trainer,
+                           (struct PairHeapEntry){.count = pair->count,
+                                                  .left = pair->left,
+                                                  .right = pair->right});
+        }
+    }
+    return ok;
+}
+
+static size_t hashmap_memory_usage(const struct HashMap* map) {
+    return map ? sizeof(*map) + map->bucket_size * map->bucket_num : 0;
+}
+
+// The bytes the trainer has allocated, for reporting progress.
+size_t trainer_memory_usage(const struct Trainer* trainer) {
+    size_t bytes =
+        trainer->symbols_capacity * (sizeof(int) + 2 * sizeof(size_t) +
+                                     sizeof(int64_t)) +
+        trainer->words_capacity * sizeof(size_t) +
+        trainer->pairs_capacity * sizeof(struct PairStats) +
+        trainer->heap_capacity * sizeof(struct PairHeapEntry) +
+        trainer->touched.capacity * sizeof(int) +
+        trainer->merges_capacity * sizeof(struct TrainerMerge) +
+        trainer->new_pairs_capacity * 2 * sizeof(size_t) +
+        trainer->tokens_capacity * sizeof(char*) +
+        hashmap_memory_usage(trainer->pair_index) +
+        hashmap_memory_usage(trainer->vocab);
+    for (size_t i = 0; i < trainer->num_pairs; i++) {
+        bytes += trainer->pairs[i].positions.capacity * sizeof(size_t);
+    }
+    for (size_t i = 0; i < trainer->num_tokens; i++) {
+        bytes += strlen(trainer->tokens[i]) + 1;
+    }
+    if (trainer->updates) {
+        for (int i = 0; i < trainer->num_threads; i++) {
+            bytes += trainer->updates[i].capacity * sizeof(struct PairUpdate);
+        }
+    }
+    return bytes;
+}
+
+void trainer_free(struct Trainer* trainer) {
+    free((void*)trainer->symbols);
+    free((void*)trainer->prev);
+    free((void*)trainer->next);
+    free((void*)trainer->word_starts);
+    free((void*)trainer->freqs);
+    for (size_t i = 0; i < trainer->num_pairs; i++) {
+        free(trainer->pairs[i].positions.data);
+    }
+    free(trainer->pairs);
+    hashmap_free(trainer->pair_index);
+    free(trainer->heap);
+    vector_free(&trainer->touched);
+    free(trainer->merges);
+    if (trainer->updates) {
+        for (int i = 0; i < trainer->num_threads; i++) {
+            free(trainer->updates[i].data);
+        }
+        free(trainer->updates);
+    }
+    free((void*)trainer->new_pairs);
+    for (size_t i = 0; i < trainer->num_tokens; i++) {
+        free(trainer->tokens[i]);
+    }
+    free((void*)trainer->tokens);
+    hashmap_free(trainer->vocab);
+    *trainer = (struct Trainer){0};
+}
+
+static uint64_t pair_index_hash(const void* item) {
+    const struct PairIndexEntry* entry = item;
+    uint64_t x = ((uint64_t)(uint32_t)entry->left << 32) |
+                 (uint32_t)entry->right;
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    x = x ^ (x >> 31);
+
+    return x;
+}
+
+static int pair_index_compare(const void* lhs, const void* rhs) {
+    const struct PairIndexEntry* a = lhs;
+    const struct PairIndexEntry* b = rhs;
+    return !(a->left == b->left && a->right == b->right);
+}
+
+static bool grow(void** array,
+                 size_t* capacity,
+                 size_t needed,
+                 size_t element_size) {
+    if (needed <= *capacity) {
+        return true;
+    }
+    size_t new_capacity = *capacity ? 2 * *capacity : 4;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void* grown = realloc(*array, new_capacity * element_size);
+    if (!grown) {
+        log_debug("Error: Failed to allocate memory for the trainer.");
+        return false;
+    }
+    *array = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+// Brings an array that goes along with a grown one to its capacity.
+static bool resize(void** array, size_t capacity, size_t element_size) {
+    void* resized = realloc(*array, capacity * element_size);
+    if (!resized) {
+        log_debug("Error: Failed to allocate memory for the trainer.");
+        return false;
+    }
+    *array = resized;
+    return true;
+}
+
+/*
+ * Appends a word of `len` symbols, linked in order, setting `start` to where
+ * its symbols are to be filled in.
+ */
+static bool append_word(struct Trainer* trainer,
+                        size_t len,
+                        int64_t freq,
+                        size_t* start) {
+    if (trainer->num_words >= INT_MAX) {
+        log_debug("Error: Too many words to train on.");
+        return false;
+    }
+    size_t symbols_capacity = trainer->symbols_capacity;
+    size_t words_capacity = trainer->words_capacity;
+    if (!grow((void**)&trainer->symbols, &symbols_capacity,
+              trainer->num_symbols + len, sizeof(int)) ||
+        !resize((void**)&trainer->prev, symbols_capacity, sizeof(size_t)) ||
+        !resize((void**)&trainer->next, symbols_capacity, sizeof(size_t)) ||
+        !resize((void**)&trainer->freqs, symbols_capacity, sizeof(int64_t))) {
+        trainer->oom = true;
+        return false;
+    }
+    trainer->symbols_capacity = symbols_capacity;
+    if (!grow((void**)&trainer->word_starts, &words_capacity,
+              trainer->num_words + 1, sizeof(size_t))) {
+        trainer->oom = true;
+        return false;
+    }
+    trainer->words_capacity = words_capacity;
+
+    *start = trainer->num_symbols;
+    for (size_t i = 0; i < len; i++) {
+        trainer->prev[*start + i] = i > 0 ? *start + i - 1 : TRAINER_NONE;
+        trainer->next[*start + i] =
+            i + 1 < len ? *start + i + 1 : TRAINER_NONE;
+        trainer->freqs[*start + i] = freq;
+    }
+    trainer->word_starts[trainer->num_words] = *start;
+    trainer->num_words++;
+    trainer->num_symbols += len;
+    return true;
+}
+
+/*
+ * Takes ownership of `bytes`. Sets `id` to the id of the token with these
+ * bytes, adding it to the vocabulary if it is not there yet.
+ */
+static bool add_token(struct Trainer* trainer, char* bytes, int* id) {
+    struct Token* existing =
+        hashmap_get(trainer->vocab, &(struct Token){.key = bytes});
+    if (existing) {
+        free(bytes);
+        *id = existing->value;
+        return true;
+    }
+    if (trainer->num_tokens >= INT_MAX ||
+        !grow((void**)&trainer->tokens, &trainer->tokens_capacity,
+              trainer->num_tokens + 1, sizeof(char*))) {
+        free(bytes);
+        trainer->oom = true;
+        return false;
+    }
+    int new_id = (int)trainer->num_tokens;
+    hashmap_set(trainer->vocab, &(struct Token){.key = bytes, .value = new_id});
+    if (trainer->vocab->oom) {
+        free(bytes);
+        trainer->oom = true;
+        return false;
+    }
+    trainer->tokens[trainer->num_tokens++] = bytes;
+    *id = new_id;
+    return true;
+}
+
+/*
+ * The index of the pair in `pairs`, or SIZE_MAX if it has never occurred and
+ * is not to be created.
+ */
+static size_t find_pair(struct Trainer* trainer,
+                        int left,
+                        int right,
+                        bool create) {
+    struct PairIndexEntry key = {.left = left, .right = right};
+    const struct PairIndexEntry* entry =
+        hashmap_get(trainer->pair_index, &key);
+    if (entry) {
+        return entry->index;
+    }
+    if (!create || !grow((void**)&trainer->pairs, &trainer->pairs_capacity,
+                         trainer->num_pairs + 1, sizeof(struct PairStats))) {
+        return SIZE_MAX;
+    }
+
+    key.index = trainer->num_pairs;
+    hashmap_set(trainer->pair_index, &key);
+    if (trainer->pair_index->oom) {
+        return SIZE_MAX;
+    }
+    trainer->pairs[trainer->num_pairs++] =
+        (struct PairStats){.left = left, .right = right};
+    return key.index;
+}
+
+// Adds `delta` to the count of the pair, creating it if it gains occurrences.
+static bool update_pair(struct Trainer* trainer,
+                        int left,
+                        int right,
+                        int64_t delta,
+                        size_t position) {
+    size_t index = find_pair(trainer, left, right, delta > 0);
+    if (index == SIZE_MAX) {
+        if (delta > 0) {
+            trainer->oom = true;
+            return false;
+        }
+        return true;
+    }
+    return count_update(trainer, index, delta, position);
+}
+
+/*
+ * Adds `delta` to the count of the pair at `index`. A pair that gains an
+ * occurrence remembers the position of its left symbol.
+ */
+static bool count_update(struct Trainer* trainer,
+                         size_t index,
+                         int64_t delta,
+                         size_t position) {
+    struct PairStats* pair = &trainer->pairs[index];
+    pair->count += delta;
+    if (delta > 0) {
+        struct PositionList* positions = &pair->positions;
+        if (!grow((void**)&positions->data, &positions->capacity,
+                  positions->size + 1, sizeof(size_t))) {
+            trainer->oom = true;
+            return false;
+        }
+        positions->data[positions->size++] = position;
+    }
+    if (trainer->num_merges > 0 && pair->touched != trainer->num_merges) {
+        pair->touched = trainer->num_merges;
+        size_t size = trainer->touched.size;
+        vector_push(&trainer->touched, (int)index);
+        if (trainer->touched.size == size) {
+            trainer->oom = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool heap_before(const struct PairHeapEntry* a,
+                        const struct PairHeapEntry* b) {
+    if (a->count != b->count) {
+        return a->count > b->count;
+    }
+    if (a->left != b->left) {
+        return a->left < b->left;
+    }
+    return a->right < b->right;
+}
+
+static bool heap_push(struct Trainer* trainer, struct PairHeapEntry entry) {
+    if (!grow((void**)&trainer->heap, &trainer->heap_capacity,
+              trainer->heap_size + 1, sizeof(struct PairHeapEntry))) {
+        trainer->oom = true;
+        return false;
+    }
+    struct PairHeapEntry* heap = trainer->heap;
+    size_t i = trainer->heap_size++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!heap_before(&entry, &heap[parent])) {
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = entry;
+    return true;
+}
+
+static struct PairHeapEntry heap_pop(struct Trainer* trainer) {
+    struct PairHeapEntry top = trainer->heap[0];
+    trainer->heap[0] = trainer->heap[--trainer->heap_size];
+    heap_sift_down(trainer, 0);
+    return top;
+}
+
+static void heap_sift_down(struct Trainer* trainer, size_t i) {
+    struct PairHeapEntry* heap = trainer->heap;
+    size_t size = trainer->heap_size;
+    if (i >= size) {
+        return;
+    }
+    struct PairHeapEntry entry = heap[i];
+    while (2 * i + 1 < size) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < size && heap_before(&heap[child + 1], &heap[child])) {
+            child++;
+        }
+        if (!heap_before(&heap[child], &entry)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = entry;
+}
+
+static int compare_positions(const void* lhs, const void* rhs) {
+    size_t a = *(const size_t*)lhs;
+    size_t b = *(const size_t*)rhs;
+    return (a > b) - (a < b);
+}
+
+/*
+ * Merges the pair at the sorted positions. The positions are split into
+ * runs whose merges share no symbols, which are rewritten on up to
+ * `num_threads` threads. Each run records the changes to the pair counts,
+ * and the records are applied in the order of the runs, the same as merging
+ * the positions one by one.
+ */
+static bool merge_positions(struct Trainer* trainer,
+                            const size_t* positions,
+                            size_t num_positions,
+                            int left,
+                            int right,
+                            int id) {
+    size_t num_threads = trainer->num_threads > 1 ? trainer->num_threads : 1;
+    if (!trainer->updates) {
+        trainer->updates = calloc(num_threads, sizeof(struct PairUpdates));
+        if (!trainer->updates) {
+            trainer->oom = true;
+            return false;
+        }
+    }
+    size_t num_pieces = num_positions / PARALLEL_MERGE_MIN_PIECE;
+    if (num_pieces > num_threads) {
+        num_pieces = num_threads;
+    }
+    if (num_pieces < 1) {
+        num_pieces = 1;
+    }
+
+    size_t ends[num_pieces];
+    struct MergeWork works[num_pieces];
+    num_pieces = split_positions(trainer, positions, num_positions, num_pieces,
+                                 ends);
+    size_t start = 0;
+    for (size_t k = 0; k < num_pieces; k++) {
+        works[k] = (struct MergeWork){.trainer = trainer,
+                                      .positions = positions + start,
+                                      .num_positions = ends[k] - start,
+                                      .left = left,
+                                      .right = right,
+                                      .id = id,
+                                      .updates = &trainer->updates[k]};
+        start = ends[k];
+    }
+
+    thread_t threads[num_pieces];
+    for (size_t k = 1; k < num_pieces; k++) {
+        THREAD_CREATE(&threads[k], merge_worker, &works[k]);
+    }
+    merge_worker(&works[0]);
+    for (size_t k = 1; k < num_pieces; k++) {
+        THREAD_JOIN(threads[k]);
+    }
+
+    // The (x, id) and (id, y) pairs that are new, found once per merge.
+    if (trainer->new_pairs_capacity < trainer->num_tokens) {
+        size_t capacity = trainer->tokens_capacity;
+        size_t* new_pairs =
+            realloc(trainer->new_pairs, 2 * capacity * sizeof(size_t));
+        if (!new_pairs) {
+            trainer->oom = true;
+            return false;
+        }
+        for (size_t i = 2 * trainer->new_pairs_capacity; i < 2 * capacity;
+             i++) {
+            new_pairs[i] = TRAINER_NONE;
+        }
+        trainer->new_pairs = new_pairs;
+        trainer->new_pairs_capacity = capacity;
+    }
+
+    bool ok = true;
+    for (size_t k = 0; k < num_pieces && ok; k++) {
+        ok = !trainer->updates[k].oom &&
+             apply_updates(trainer, &trainer->updates[k], id);
+    }
+    for (size_t k = 0; k < num_pieces; k++) {
+        const struct PairUpdates* updates = &trainer->updates[k];
+        for (size_t i = 0; i < updates->size; i++) {
+            const struct PairUpdate* update = &updates->data[i];
+            if (update->index == TRAINER_NONE) {
+                bool by_left = update->right == id;
+                trainer->new_pairs[2 * (size_t)(by_left ? update->left
+                                                        : update->right) +
+                                   !by_left] = TRAINER_NONE;
+            }
+        }
+    }
+    if (!ok) {
+        trainer->oom = true;
+    }
+    return ok;
+}
+
+/*
+ * Splits the positions into up to `num_pieces` runs of about equal size,
+ * storing where each ends. A run only ends where no earlier merge reaches
+ * the next position: a merge rewrites its two symbols and links the symbol
+ * after them back, and reads the symbol before, all within two links of its
+ * position. Returns the number of runs.
+ */
+static size_t split_positions(const struct Trainer* trainer,
+                              const size_t* positions,
+                              size_t num_positions,
+                              size_t num_pieces,
+                              size_t* ends) {
+    size_t count = 0;
+    size_t reach = 0;
+    for (size_t i = 0; i < num_positions && count + 1 < num_pieces; i++) {
+        size_t target = num_positions * (count + 1) / num_pieces;
+        if (i >= target && i > 0 && positions[i] > reach) {
+            ends[count++] = i;
+        }
+        size_t end = positions[i];
+        for (int step = 0; step < 2 && trainer->next[end] != TRAINER_NONE;
+             step++) {
+            end = trainer->next[end];
+        }
+        if (end > reach) {
+            reach = end;
+        }
+    }
+    ends[count++] = num_positions;
+    return count;
+}
+
+static thread_return_t merge_worker(thread_arg_t arg) {
+    struct MergeWork* work = arg;
+    struct PairUpdates* updates = work->updates;
+    updates->size = 0;
+    updates->oom = false;
+    for (size_t i = 0; i < work->num_positions; i++) {
+        if (i > 0 && work->positions[i] == work->positions[i - 1]) {
+            continue;
+        }
+        if (!merge_at(work->trainer, updates, work->positions[i], work->left,
+                      work->right, work->id)) {
+            updates->oom = true;
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Records a change to the count of a pair, looking up the pair, which only
+ * reads the pair index, so that runs can record at the same time.
+ */
+static bool record_update(struct Trainer* trainer,
+                          struct PairUpdates* updates,
+                          int left,
+                          int right,
+                          int64_t delta,
+                          size_t position) {
+    if (!grow((void**)&updates->data, &updates->capacity, updates->size + 1,
+              sizeof(struct PairUpdate))) {
+        return false;
+    }
+    updates->data[updates->size++] = (struct PairUpdate){
+        .left = left,
+        .right = right,
+        .delta = delta,
+        .position = position,
+        .index = find_pair(trainer, left, right, false)};
+    return true;
+}
+
+/*
+ * Applies the recorded changes in order. Pairs that did not exist when they
+ * were recorded are new pairs with the merged token, which are created by
+ * their first occurrence and then found in `new_pairs`.
+ */
+static bool apply_updates(struct Trainer* trainer,
+                          const struct PairUpdates* updates,
+                          int id) {
+    for (size_t i = 0; i < updates->size; i++) {
+        const struct PairUpdate* update = &updates->data[i];
+        size_t index = update->index;
+        if (index == TRAINER_NONE) {
+            bool by_left = update->right == id;
+            size_t* slot =
+                &trainer->new_pairs[2 * (size_t)(by_left ? update->left
+                                                         : update->right) +
+                                    !by_left];
+            if (*slot == TRAINER_NONE) {
+                if (update->delta <= 0) {
+                    continue;
+                }
+                *slot = find_pair(trainer, update->left, update->right, true);
+                if (*slot == SIZE_MAX) {
+                    return false;
+                }
+            }
+            index = *slot;
+        }
+        if (!count_update(trainer, index, update->delta, update->position)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Replaces (left, right) at the position with `id`, if it is still there,
+ * and records moving the counts of the neighbouring pairs over to the pairs
+ * with the new token.
+ */
+static bool merge_at(struct Trainer* trainer,
+                     struct PairUpdates* updates,
+                     size_t position,
+                     int left,
+                     int right,
+                     int id) {
+    int* symbols = trainer->symbols;
+    size_t second = trainer->next[position];
+    if (symbols[position] != left || second == TRAINER_NONE ||
+        symbols[second] != right) {
+        return true;
+    }
+    int64_t freq = trainer->freqs[position];
+
+    if (!record_update(trainer, updates, left, right, -freq, position)) {
+        return false;
+    }
+    size_t before = trainer->prev[position];
+    if (before != TRAINER_NONE) {
+        int x = symbols[before];
+        if (!record_update(trainer, updates, x, left, -freq, before) ||
+            !record_update(trainer, updates, x, id, freq, before)) {
+            return false;
+        }
+    }
+    size_t after = trainer->next[second];
+    if (after != TRAINER_NONE) {
+        int y = symbols[after];
+        if (!record_update(trainer, updates, right, y, -freq, second) ||
+            !record_update(trainer, updates, id, y, freq, position)) {
+            return false;
+        }
+        trainer->prev[after] = position;
+    }
+    symbols[position] = id;
+    symbols[second] = -1;
+    trainer->next[position] = after;
+    trainer->prev[second] = TRAINER_NONE;
+    trainer->next[second] = TRAINER_NONE;
+    return true;
+}
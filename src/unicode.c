@@ -0,0 +1,272 @@
+#include "hutoken/unicode.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+static inline size_t codepoint_utf8_len(uint32_t cp);
+static inline char* write_codepoint(char* dest, uint32_t cp);
+static inline uint32_t codepoint_at(const void* data,
+                                    size_t index,
+                                    enum UnicodeKind kind);
+static inline size_t utf8_sequence_len(const unsigned char* p, size_t left);
+static inline uint32_t next_codepoint(const unsigned char** p);
+
+/*
+ * Computes the number of bytes needed to store the code points of a
+ * fixed-width string (Latin-1, UCS-2 or UCS-4) as UTF-8, without the NUL
+ * terminator. Surrogates and NUL characters are rejected, since neither
+ * can be passed through the NUL-terminated encode pipeline.
+ */
+enum UnicodeError unicode_utf8_len(const void* data,
+                                   size_t length,
+                                   enum UnicodeKind kind,
+                                   size_t* utf8_len) {
+    if (!data || !utf8_len) {
+        return UNICODE_INVALID_ARGUMENT;
+    }
+
+    size_t total = 0;
+
+    if (kind == UNICODE_KIND_UCS1) {
+        const uint8_t* p = data;
+        for (size_t i = 0; i < length; ++i) {
+            if (p[i] == 0) {
+                return UNICODE_NUL_CHARACTER;
+            }
+            total += 1 + (p[i] >> 7);
+        }
+        *utf8_len = total;
+        return UNICODE_SUCCESS;
+    }
+
+    for (size_t i = 0; i < length; ++i) {
+        uint32_t cp = codepoint_at(data, i, kind);
+        if (cp == 0) {
+            return UNICODE_NUL_CHARACTER;
+        }
+        if (cp >= 0xD800 && cp <= 0xDFFF) {
+            return UNICODE_SURROGATE;
+        }
+        total += codepoint_utf8_len(cp);
+    }
+
+    *utf8_len = total;
+    return UNICODE_SUCCESS;
+}
+
+/*
+ * Transcodes a fixed-width string into `buffer`, which must hold at least
+ * the length reported by `unicode_utf8_len` plus the NUL terminator.
+ */
+enum UnicodeError unicode_to_utf8(const void* data,
+                                  size_t length,
+                                  enum UnicodeKind kind,
+                                  char* buffer) {
+    if (!data || !buffer) {
+        return UNICODE_INVALID_ARGUMENT;
+    }
+
+    char* dest = buffer;
+
+    if (kind == UNICODE_KIND_UCS1) {
+        const uint8_t* p = data;
+        for (size_t i = 0; i < length; ++i) {
+            if (p[i] < 0x80) {
+                *dest++ = (char)p[i];
+            } else {
+                *dest++ = (char)(0xC0 | (p[i] >> 6));
+                *dest++ = (char)(0x80 | (p[i] & 0x3F));
+            }
+        }
+    } else {
+        for (size_t i = 0; i < length; ++i) {
+            uint32_t cp = codepoint_at(data, i, kind);
+            if (cp >= 0xD800 && cp <= 0xDFFF) {
+                return UNICODE_SURROGATE;
+            }
+            dest = write_codepoint(dest, cp);
+        }
+    }
+
+    *dest = '\0';
+
+    return UNICODE_SUCCESS;
+}
+
+/*
+ * Counts the code points of UTF-8 text and finds the largest of them. The
+ * text is checked as strictly as Python's UTF-8 codec does: overlong forms,
+ * surrogates, code points above U+10FFFF and truncated sequences make it
+ * invalid. NUL characters are allowed.
+ */
+enum UnicodeError unicode_utf8_scan(const char* text,
+                                    size_t len,
+                                    size_t* length,
+                                    uint32_t* maxchar) {
+    if (!text || !length || !maxchar) {
+        return UNICODE_INVALID_ARGUMENT;
+    }
+
+    const unsigned char* p = (const unsigned char*)text;
+    size_t count = 0;
+    uint32_t largest = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        size_t n = utf8_sequence_len(p + i, len - i);
+        if (n == 0) {
+            return UNICODE_INVALID_UTF8;
+        }
+        const unsigned char* next = p + i;
+        uint32_t cp = next_codepoint(&next);
+        if (cp > largest) {
+            largest = cp;
+        }
+        count++;
+        i += n;
+    }
+
+    *maxchar = largest;
+    *length = count;
+    return UNICODE_SUCCESS;
+}
+
+/*
+ * Writes the code points of valid UTF-8 text, as checked by
+ * `unicode_utf8_scan`, into a fixed-width string of the given kind, which
+ * must be wide enough for the largest of them.
+ */
+void unicode_from_utf8(const char* text,
+                       size_t len,
+                       enum UnicodeKind kind,
+                       void* data) {
+    const unsigned char* p = (const unsigned char*)text;
+    const unsigned char* end = p + len;
+
+    // One loop per kind, with ASCII copied without decoding.
+    if (kind == UNICODE_KIND_UCS1) {
+        uint8_t* dest = data;
+        while (p < end) {
+            *dest++ = *p < 0x80 ? *p++ : (uint8_t)next_codepoint(&p);
+        }
+    } else if (kind == UNICODE_KIND_UCS2) {
+        uint16_t* dest = data;
+        while (p < end) {
+            *dest++ = *p < 0x80 ? *p++ : (uint16_t)next_codepoint(&p);
+        }
+    } else {
+        uint32_t* dest = data;
+        while (p < end) {
+            *dest++ = *p < 0x80 ? *p++ : next_codepoint(&p);
+        }
+    }
+}
+
+static inline size_t codepoint_utf8_len(uint32_t cp) {
+    if (cp < 0x80) {
+        return 1;
+    }
+    if (cp < 0x800) {
+        return 2;
+    }
+    if (cp < 0x10000) {
+        return 3;
+    }
+    return 4;
+}
+
+static inline char* write_codepoint(char* dest, uint32_t cp) {
+    if (cp < 0x80) {
+        *dest++ = (char)cp;
+    } else if (cp < 0x800) {
+        *dest++ = (char)(0xC0 | (cp >> 6));
+        *dest++ = (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        *dest++ = (char)(0xE0 | (cp >> 12));
+        *dest++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *dest++ = (char)(0x80 | (cp & 0x3F));
+    } else {
+        *dest++ = (char)(0xF0 | (cp >> 18));
+        *dest++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+        *dest++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *dest++ = (char)(0x80 | (cp & 0x3F));
+    }
+    return dest;
+}
+
+static inline uint32_t codepoint_at(const void* data,
+                                    size_t index,
+                                    enum UnicodeKind kind) {
+    switch (kind) {
+        case UNICODE_KIND_UCS1:
+            return ((const uint8_t*)data)[index];
+        case UNICODE_KIND_UCS2:
+            return ((const uint16_t*)data)[index];
+        default:
+            return ((const uint32_t*)data)[index];
+    }
+}
+
+// The length of the valid UTF-8 sequence at `p`, 0 if there is none.
+static inline size_t utf8_sequence_len(const unsigned char* p, size_t left) {
+    unsigned char lead = p[0];
+    if (lead < 0x80) {
+        return 1;
+    }
+
+    size_t n = 0;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        n = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        n = 3;
+        if (lead == 0xE0) {
+            lo = 0xA0;  // overlong
+        } else if (lead == 0xED) {
+            hi = 0x9F;  // surrogates
+        }
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        n = 4;
+        if (lead == 0xF0) {
+            lo = 0x90;  // overlong
+        } else if (lead == 0xF4) {
+            hi = 0x8F;  // above U+10FFFF
+        }
+    } else {
+        return 0;
+    }
+
+    if (left < n || p[1] < lo || p[1] > hi) {
+        return 0;
+    }
+    for (size_t k = 2; k < n; ++k) {
+        if (p[k] < 0x80 || p[k] > 0xBF) {
+            return 0;
+        }
+    }
+    return n;
+}
+
+// Decodes the valid UTF-8 sequence at `*p` and moves past it.
+static inline uint32_t next_codepoint(const unsigned char** p) {
+    const unsigned char* s = *p;
+    uint32_t cp = 0;
+    if (s[0] < 0x80) {
+        cp = s[0];
+        *p += 1;
+    } else if (s[0] < 0xE0) {
+        cp = ((uint32_t)(s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+        *p += 2;
+    } else if (s[0] < 0xF0) {
+        cp = ((uint32_t)(s[0] & 0x0F) << 12) | ((uint32_t)(s[1] & 0x3F) << 6) |
+             (s[2] & 0x3F);
+        *p += 3;
+    } else {
+        cp = ((uint32_t)(s[0] & 0x07) << 18) |
+             ((uint32_t)(s[1] & 0x3F) << 12) | ((uint32_t)(s[2] & 0x3F) << 6) |
+             (s[3] & 0x3F);
+        *p += 4;
+    }
+    return cp;
+}
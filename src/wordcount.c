@@ -0,0 +1,156 @@
+#include "hutoken/wordcount.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hutoken/hash.h"
+#include "hutoken/helper.h"
+#include "hutoken/parser.h"
+
+static uint64_t word_count_hash(const void* item);
+static int word_count_compare(const void* lhs, const void* rhs);
+
+bool word_counts_init(struct WordCounts* counts) {
+    *counts = (struct WordCounts){0};
+    counts->words = hashmap_new(1024, sizeof(struct WordCount),
+                                word_count_hash, word_count_compare);
+    if (!counts->words) {
+        log_debug("Error: Failed to allocate memory for word counts.");
+        counts->oom = true;
+        return false;
+    }
+    return true;
+}
+
+bool word_counts_add(struct WordCounts* counts,
+                     const char* bytes,
+                     size_t len,
+                     int64_t count) {
+    if (len == 0 || count <= 0) {
+        return true;
+    }
+    struct WordCount key = {.bytes = (char*)bytes, .len = len};
+    struct WordCount* found = hashmap_get(counts->words, &key);
+    if (found) {
+        found->count += count;
+        counts->total += count;
+        return true;
+    }
+
+    key.bytes = malloc(len);
+    if (!key.bytes) {
+        log_debug("Error: Failed to allocate memory for a word.");
+        counts->oom = true;
+        return false;
+    }
+    memcpy(key.bytes, bytes, len);
+    key.count = count;
+    hashmap_set(counts->words, &key);
+    if (counts->words->oom) {
+        free(key.bytes);
+        counts->oom = true;
+        return false;
+    }
+    counts->total += count;
+    return true;
+}
+
+/*
+ * Counts each pretoken of the first `len` bytes of the text as a word, or
+ * each match of `regex` if it is not NULL, in which case the text has to end
+ * there with a NUL. Both stop at the first NUL byte.
+ */
+static bool add_segment(struct WordCounts* counts,
+                        const char* text,
+                        size_t len,
+                        const regex_t* regex) {
+    if (regex == NULL) {
+        struct ParserState parser = parser_init_n(text, len);
+        struct TokenSlice word;
+        while (parser_next_token(&parser, &word)) {
+            if (!word_counts_add(counts, word.start, word.length, 1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    regmatch_t match;
+    const char* cursor = text;
+    while (regexec(regex, cursor, 1, &match, 0) == 0) {
+        // An empty match would never move the cursor.
+        if (match.rm_eo == 0) {
+            if (*cursor == '\0') {
+                break;
+            }
+            cursor++;
+            continue;
+        }
+        if (!word_counts_add(counts, cursor + match.rm_so,
+                             match.rm_eo - match.rm_so, 1)) {
+            return false;
+        }
+        cursor += match.rm_eo;
+    }
+    return true;
+}
+
+/*
+ * Like `add_segment`, but NUL bytes in the text, which can come from files,
+ * only separate words: the text between them is counted as well.
+ */
+bool word_counts_add_text(struct WordCounts* counts,
+                          const char* text,
+                          size_t len,
+                          const regex_t* regex) {
+    const char* end = text + len;
+    while (true) {
+        const char* nul = memchr(text, '\0', end - text);
+        if (!add_segment(counts, text, (nul ? nul : end) - text, regex)) {
+            return false;
+        }
+        if (!nul) {
+            return true;
+        }
+        text = nul + 1;
+    }
+}
+
+// Adds the counts of `other` to `counts`.
+bool word_counts_merge(struct WordCounts* counts, struct WordCounts* other) {
+    size_t i = 0;
+    void* item = NULL;
+    while (hashmap_iter(other->words, &i, &item)) {
+        const struct WordCount* word = item;
+        if (!word_counts_add(counts, word->bytes, word->len, word->count)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void word_counts_free(struct WordCounts* counts) {
+    if (counts->words) {
+        size_t i = 0;
+        void* item = NULL;
+        while (hashmap_iter(counts->words, &i, &item)) {
+            free(((struct WordCount*)item)->bytes);
+        }
+        hashmap_free(counts->words);
+    }
+    *counts = (struct WordCounts){0};
+}
+
+static uint64_t word_count_hash(const void* item) {
+    const struct WordCount* word = item;
+    return hashmap_murmur(word->bytes, word->len);
+}
+
+static int word_count_compare(const void* lhs, const void* rhs) {
+    const struct WordCount* a = lhs;
+    const struct WordCount* b = rhs;
+    if (a->len != b->len) {
+        return a->len < b->len ? -1 : 1;
+    }
+    return memcmp(a->bytes, b->bytes, a->len);
+}
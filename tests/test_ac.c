@@ -11,10 +11,30 @@
         test();                                 \
     } while (0)
 
+// Follows `pattern` from the root along trie edges only.
+static int32_t walk(const struct ACAutomaton* automaton, const char* pattern) {
+    int32_t state = AC_ROOT;
+    for (size_t i = 0; i < strlen(pattern); ++i) {
+        const struct ACState* s = &automaton->states[state];
+        int32_t next = -1;
+        for (uint32_t k = 0; k < s->num_edges; ++k) {
+            if (automaton->labels[s->first_edge + k] ==
+                (unsigned char)pattern[i]) {
+                next = automaton->targets[s->first_edge + k];
+            }
+        }
+        if (next < 0) {
+            return -1;
+        }
+        state = next;
+    }
+    return state;
+}
+
 void test_create_and_free_automaton(void) {
     struct ACAutomaton* automaton = ac_automaton_create();
     assert(automaton != NULL);
-    assert(automaton->root != NULL);
+    assert(automaton->num_nodes == 1);
     ac_automaton_free(automaton);
 }
 
@@ -24,15 +44,12 @@ void test_add_single_pattern(void) {
     int value = 42;
 
     assert(ac_automaton_add_string(automaton, pattern, value) == true);
+    ac_automaton_build_failure_links(automaton);
 
-    struct ACNode* current = automaton->root;
-    for (size_t i = 0; i < strlen(pattern); ++i) {
-        unsigned char index = (unsigned char)pattern[i];
-        assert(current->children[index] != NULL);
-        current = current->children[index];
-    }
-    assert(current->output_value == value);
-    assert(current->pattern_len == strlen(pattern));
+    int32_t state = walk(automaton, pattern);
+    assert(state > AC_ROOT);
+    assert(automaton->states[state].output_value == value);
+    assert(automaton->states[state].pattern_len == strlen(pattern));
 
     ac_automaton_free(automaton);
 }
@@ -41,22 +58,17 @@ void test_add_multiple_patterns(void) {
     struct ACAutomaton* automaton = ac_automaton_create();
     assert(ac_automaton_add_string(automaton, "apple", 1) == true);
     assert(ac_automaton_add_string(automaton, "banana", 2) == true);
+    ac_automaton_build_failure_links(automaton);
 
-    struct ACNode* current = automaton->root;
-    const char* p1 = "apple";
-    for (size_t i = 0; i < strlen(p1); ++i) {
-        current = current->children[(unsigned char)p1[i]];
-    }
-    assert(current->output_value == 1);
-    assert(current->pattern_len == 5);
+    int32_t state = walk(automaton, "apple");
+    assert(automaton->states[state].output_value == 1);
+    assert(automaton->states[state].pattern_len == 5);
 
-    current = automaton->root;
-    const char* p2 = "banana";
-    for (size_t i = 0; i < strlen(p2); ++i) {
-        current = current->children[(unsigned char)p2[i]];
-    }
-    assert(current->output_value == 2);
-    assert(current->pattern_len == 6);
+    state = walk(automaton, "banana");
+    assert(automaton->states[state].output_value == 2);
+    assert(automaton->states[state].pattern_len == 6);
+
+    assert(walk(automaton, "apricot") == -1);
 
     ac_automaton_free(automaton);
 }
@@ -66,24 +78,16 @@ void test_add_overlapping_patterns(void) {
     assert(ac_automaton_add_string(automaton, "he", 1) == true);
     assert(ac_automaton_add_string(automaton, "her", 2) == true);
     assert(ac_automaton_add_string(automaton, "hers", 3) == true);
+    ac_automaton_build_failure_links(automaton);
 
-    struct ACNode* node_h = automaton->root->children['h'];
-    assert(node_h != NULL);
-
-    struct ACNode* node_he = node_h->children['e'];
-    assert(node_he != NULL);
-    assert(node_he->output_value == 1);
-    assert(node_he->pattern_len == 2);
-
-    struct ACNode* node_her = node_he->children['r'];
-    assert(node_her != NULL);
-    assert(node_her->output_value == 2);
-    assert(node_her->pattern_len == 3);
-
-    struct ACNode* node_hers = node_her->children['s'];
-    assert(node_hers != NULL);
-    assert(node_hers->output_value == 3);
-    assert(node_hers->pattern_len == 4);
+    assert(automaton->num_nodes == 5);
+    assert(automaton->states[walk(automaton, "h")].output_value == -1);
+    assert(automaton->states[walk(automaton, "he")].output_value == 1);
+    assert(automaton->states[walk(automaton, "he")].pattern_len == 2);
+    assert(automaton->states[walk(automaton, "her")].output_value == 2);
+    assert(automaton->states[walk(automaton, "her")].pattern_len == 3);
+    assert(automaton->states[walk(automaton, "hers")].output_value == 3);
+    assert(automaton->states[walk(automaton, "hers")].pattern_len == 4);
 
     ac_automaton_free(automaton);
 }
@@ -96,16 +100,12 @@ void test_build_failure_links_simple(void) {
 
     ac_automaton_build_failure_links(automaton);
 
-    struct ACNode* root = automaton->root;
-    struct ACNode* node_a = root->children['a'];
-    struct ACNode* node_b = root->children['b'];
-    struct ACNode* node_ab = node_a->children['b'];
-    struct ACNode* node_bc = node_b->children['c'];
-
-    assert(node_a->failure_link == root);
-    assert(node_b->failure_link == root);
-    assert(node_ab->failure_link == node_b);
-    assert(node_bc->failure_link == root);
+    const struct ACState* states = automaton->states;
+    assert(states[walk(automaton, "a")].failure_link == AC_ROOT);
+    assert(states[walk(automaton, "b")].failure_link == AC_ROOT);
+    assert(states[walk(automaton, "ab")].failure_link ==
+           walk(automaton, "b"));
+    assert(states[walk(automaton, "bc")].failure_link == AC_ROOT);
 
     ac_automaton_free(automaton);
 }
@@ -119,17 +119,62 @@ void test_build_failure_links_complex(void) {
 
     ac_automaton_build_failure_links(automaton);
 
-    struct ACNode* root = automaton->root;
-    struct ACNode* node_h = root->children['h'];
-    struct ACNode* node_s = root->children['s'];
-    struct ACNode* node_sh = node_s->children['h'];
-    struct ACNode* node_she = node_sh->children['e'];
-    struct ACNode* node_he = node_h->children['e'];
+    const struct ACState* states = automaton->states;
+    assert(states[walk(automaton, "s")].failure_link == AC_ROOT);
+    assert(states[walk(automaton, "h")].failure_link == AC_ROOT);
+    assert(states[walk(automaton, "sh")].failure_link == walk(automaton, "h"));
+    assert(states[walk(automaton, "she")].failure_link ==
+           walk(automaton, "he"));
+    // "she" ends with "he", which is reported through the output link.
+    assert(states[walk(automaton, "she")].output_link == walk(automaton, "he"));
+    assert(states[walk(automaton, "his")].output_link == -1);
 
-    assert(node_s->failure_link == root);
-    assert(node_h->failure_link == root);
-    assert(node_sh->failure_link == node_h);
-    assert(node_she->failure_link == node_he);
+    ac_automaton_free(automaton);
+}
+
+void test_next_follows_failure_links(void) {
+    struct ACAutomaton* automaton = ac_automaton_create();
+    ac_automaton_add_string(automaton, "abcd", 1);
+    ac_automaton_add_string(automaton, "bce", 2);
+    ac_automaton_build_failure_links(automaton);
+
+    int32_t state = AC_ROOT;
+    const char* text = "abce";
+    for (size_t i = 0; i < strlen(text); ++i) {
+        state = ac_automaton_next(automaton, state, (unsigned char)text[i]);
+    }
+    assert(state == walk(automaton, "bce"));
+    assert(ac_automaton_next(automaton, state, 'x') == AC_ROOT);
+
+    ac_automaton_free(automaton);
+}
+
+void test_find_leftmost_longest(void) {
+    struct ACAutomaton* automaton = ac_automaton_create();
+    ac_automaton_add_string(automaton, "<|im", 0);
+    ac_automaton_add_string(automaton, "<|im_start|>", 1);
+    ac_automaton_add_string(automaton, "start", 2);
+    ac_automaton_build_failure_links(automaton);
+
+    struct ACMatch match;
+    const char* text = "hi <|im_start|> there";
+    assert(ac_automaton_find(automaton, text, strlen(text), NULL, &match));
+    assert(match.start == 3);
+    assert(match.len == 12);
+    assert(match.output_value == 1);
+
+    const unsigned char enabled[] = {1, 0, 1};
+    assert(ac_automaton_find(automaton, text, strlen(text), enabled, &match));
+    assert(match.start == 3);
+    assert(match.len == 4);
+    assert(match.output_value == 0);
+
+    const unsigned char only_start[] = {0, 0, 1};
+    assert(
+        ac_automaton_find(automaton, text, strlen(text), only_start, &match));
+    assert(match.start == 8);
+
+    assert(!ac_automaton_find(automaton, "<|i", 3, NULL, &match));
 
     ac_automaton_free(automaton);
 }
@@ -139,8 +184,13 @@ void test_add_invalid_patterns(void) {
     assert(ac_automaton_add_string(automaton, NULL, 1) == false);
 
     assert(ac_automaton_add_string(automaton, "", 100) == true);
-    assert(automaton->root->output_value == 100);
-    assert(automaton->root->pattern_len == 0);
+    ac_automaton_build_failure_links(automaton);
+    assert(automaton->states[AC_ROOT].output_value == 100);
+    assert(automaton->states[AC_ROOT].pattern_len == 0);
+
+    // The empty pattern never matches.
+    struct ACMatch match;
+    assert(!ac_automaton_find(automaton, "abc", 3, NULL, &match));
 
     ac_automaton_free(automaton);
 }
@@ -152,7 +202,8 @@ void test_free_null_automaton(void) {
 void test_build_on_empty_automaton(void) {
     struct ACAutomaton* automaton = ac_automaton_create();
     ac_automaton_build_failure_links(automaton);
-    assert(automaton->root->failure_link == automaton->root);
+    assert(automaton->states[AC_ROOT].failure_link == AC_ROOT);
+    assert(ac_automaton_next(automaton, AC_ROOT, 'a') == AC_ROOT);
     ac_automaton_free(automaton);
 }
 
@@ -165,6 +216,8 @@ int main(void) {
     RUN_TEST(test_add_overlapping_patterns);
     RUN_TEST(test_build_failure_links_simple);
     RUN_TEST(test_build_failure_links_complex);
+    RUN_TEST(test_next_follows_failure_links);
+    RUN_TEST(test_find_leftmost_longest);
     RUN_TEST(test_add_invalid_patterns);
     RUN_TEST(test_free_null_automaton);
     RUN_TEST(test_build_on_empty_automaton);
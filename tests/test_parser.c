@@ -57,6 +57,30 @@ void run_comparison_test(const char* text, regex_t* compiled_regex) {
     printf("... OK\n");
 }
 
+void test_bounded_parser(void) {
+    // The limit falls inside "world" and inside the two-byte "ő".
+    const char* text = "hello world tő";
+    struct ParserState state = parser_init_n(text, 9);
+    struct TokenSlice token;
+
+    assert(parser_next_token(&state, &token));
+    assert(token.start == text && token.length == 5);
+    assert(parser_next_token(&state, &token));
+    assert(token.start == text + 5 && token.length == 4);
+    assert(!parser_next_token(&state, &token));
+
+    state = parser_init_n(text + 11, 3);
+    assert(parser_next_token(&state, &token));
+    assert(token.length == 2);
+    assert(parser_next_token(&state, &token));
+    assert(token.length == 1);
+    assert(!parser_next_token(&state, &token));
+
+    state = parser_init_n(text, 0);
+    assert(!parser_next_token(&state, &token));
+    printf("Bounded parser ... OK\n");
+}
+
 int main(void) {
     if (setlocale(LC_ALL, "en_US.UTF-8") == NULL) {
         (void)fprintf(stderr,
@@ -116,6 +140,8 @@ int main(void) {
 
     regfree(&bpe_regex);
 
+    test_bounded_parser();
+
     puts("\nAll parser tests passed successfully!");
     return EXIT_SUCCESS;
 }
@@ -1,3 +1,4 @@
+import array
 import timeit
 import pytest
 import tiktoken
@@ -288,3 +289,245 @@ def test_morphological_analyzer_only_longest():
     expected = [['fej', 'etlen', 'ség', 'et']]
     result = hutoken.look_up_word(handle, word, True)
     assert result == expected, f"Result array differs: {expected} vs {result}"
+
+def test_encode_non_ascii_kinds_with_tiktoken():
+    tt_enc = tiktoken.get_encoding("gpt2")
+    hutoken.initialize("openai-community/gpt2")
+
+    latin1 = "Árvíztűrő tükörfúrógép".encode("latin-1", "ignore").decode("latin-1")
+    ucs2 = "Árvíztűrő tükörfúrógép €"
+    ucs4 = "Árvíztűrő tükörfúrógép 😀"
+
+    for text in (latin1, ucs2, ucs4):
+        assert hutoken.encode(text) == tt_enc.encode(text)
+        assert hutoken.batch_encode([text, sentence1], num_threads=2) \
+            == [tt_enc.encode(text), tt_enc.encode(sentence1)]
+
+def test_parallel_encode_large_document():
+    hutoken.initialize("openai-community/gpt2")
+
+    document = "\n".join([paragraph1, paragraph2, sentence1, sentence2] * 1000)
+
+    serial = hutoken.encode(document, num_threads=1)
+    assert hutoken.encode(document, num_threads=4) == serial
+    assert hutoken.decode(serial) == document
+
+def test_stream_encoder():
+    hutoken.initialize("openai-community/gpt2")
+
+    text = "\n".join([paragraph1, paragraph2, sentence1, sentence2])
+    data = text.encode("utf-8")
+
+    encoder = hutoken.Encoder()
+    tokens = []
+    for i in range(0, len(data), 7):
+        tokens += encoder.feed(data[i:i + 7])
+    tokens += encoder.finish()
+
+    assert tokens == hutoken.encode(text)
+
+    tokens = encoder.feed(sentence1) + encoder.finish()
+    assert tokens == hutoken.encode(sentence1)
+
+def test_stream_decoder():
+    hutoken.initialize("openai-community/gpt2")
+
+    text = paragraph1 + " 😀 " + paragraph2
+    tokens = hutoken.encode(text)
+
+    decoder = hutoken.Decoder()
+    pieces = [decoder.feed(token) for token in tokens]
+    pieces.append(decoder.finish())
+
+    assert "".join(pieces) == hutoken.decode(tokens)
+    assert "" in pieces  # the emoji is split across tokens
+
+def test_decode_buffers():
+    hutoken.initialize("openai-community/gpt2")
+
+    batch = [hutoken.encode(text) for text in [sentence1, paragraph1, sentence2]]
+    texts = [hutoken.decode(tokens) for tokens in batch]
+
+    assert hutoken.decode(array.array("i", batch[1])) == texts[1]
+    assert hutoken.decode(memoryview(array.array("H", batch[1]))) == texts[1]
+
+    values = array.array("i", [token for tokens in batch for token in tokens])
+    offsets = array.array("q", [0])
+    for tokens in batch:
+        offsets.append(offsets[-1] + len(tokens))
+    assert hutoken.batch_decode(values, offsets=offsets) == texts
+
+    buffer = bytearray(4096)
+    length = hutoken.decode_into(batch[1], buffer)
+    assert buffer[:length].decode("utf-8") == texts[1]
+    with pytest.raises(ValueError):
+        hutoken.decode_into(batch[1], bytearray(10))
+
+def test_decode_bytes():
+    hutoken.initialize("openai-community/gpt2")
+
+    for text in [sentence1, paragraph1, "a 😀 b"]:
+        tokens = hutoken.encode(text)
+        assert hutoken.decode(tokens) == text
+        assert hutoken.decode_bytes(tokens) == text.encode("utf-8")
+
+    # The first half of a character split across tokens.
+    tokens = hutoken.encode("😀")
+    assert "😀".encode("utf-8").startswith(hutoken.decode_bytes(tokens[:1]))
+    with pytest.raises(ValueError):
+        hutoken.decode(tokens[:1])
+
+def test_batch_decode_concat():
+    hutoken.initialize("openai-community/gpt2")
+
+    texts = [sentence1, "", paragraph1, "😀", sentence2]
+    batch = hutoken.batch_decode([hutoken.encode(text) for text in texts],
+                                 num_threads=2, concat=True)
+
+    assert len(batch) == len(texts)
+    assert list(batch) == texts
+    assert batch.data == "".join(texts).encode("utf-8")
+    offsets = batch.offsets
+    for i, text in enumerate(texts):
+        assert batch.data[offsets[i]:offsets[i + 1]] == text.encode("utf-8")
+
+def test_decode_long_sequence():
+    hutoken.initialize("openai-community/gpt2")
+
+    text = (paragraph1 + " 😀 " + paragraph2) * 1000
+    tokens = array.array("i", hutoken.encode(text))
+    assert len(tokens) > 256 * 1024
+
+    assert hutoken.decode(tokens, num_threads=4) == text
+    assert hutoken.decode_bytes(tokens, num_threads=4) == text.encode("utf-8")
+
+def test_encode_file_shards(tmp_path):
+    hutoken.initialize("openai-community/gpt2")
+
+    documents = [paragraph1, paragraph2, sentence1, sentence2]
+    input_path = tmp_path / "corpus.txt"
+    input_path.write_text("<|endoftext|>".join(documents), encoding="utf-8")
+
+    stats = hutoken.encode_file(str(input_path), str(tmp_path / "train"),
+                                doc_separator="<|endoftext|>", eos_id=50256,
+                                num_threads=2, max_shard_tokens=100)
+
+    expected = [hutoken.encode(doc) + [50256] for doc in documents]
+    assert stats["num_documents"] == len(documents)
+    assert stats["num_tokens"] == sum(len(tokens) for tokens in expected)
+    assert stats["dtype"] == "uint16"
+
+    result = []
+    for shard in stats["shards"]:
+        index = (tmp_path / shard).with_suffix(".idx").read_bytes()
+        assert index[:8] == b"HUTOKIDX"
+        num_documents = int.from_bytes(index[16:24], "little")
+        offsets = [int.from_bytes(index[24 + 8 * i:32 + 8 * i], "little")
+                   for i in range(num_documents + 1)]
+        data = (tmp_path / shard).read_bytes()
+        tokens = [int.from_bytes(data[2 * i:2 * i + 2], "little")
+                  for i in range(len(data) // 2)]
+        assert offsets[-1] == len(tokens)
+        result += [tokens[offsets[i]:offsets[i + 1]]
+                   for i in range(num_documents)]
+
+    assert result == expected
+
+def test_encode_file_nul_byte(tmp_path):
+    hutoken.initialize("openai-community/gpt2")
+
+    input_path = tmp_path / "corpus.txt"
+    input_path.write_bytes(b"alma fa<|endoftext|>szilva fa\x00 hidden text")
+
+    with pytest.raises(ValueError):
+        hutoken.encode_file(str(input_path), str(tmp_path / "train"),
+                            doc_separator="<|endoftext|>")
+
+def test_count_tokens():
+    hutoken.initialize("openai-community/gpt2")
+
+    texts = [sentence1, sentence2, paragraph1, paragraph2, ""]
+
+    for text in texts:
+        assert hutoken.count_tokens(text) == len(hutoken.encode(text))
+    assert hutoken.batch_count_tokens(texts, num_threads=2) \
+        == [len(tokens) for tokens in hutoken.batch_encode(texts)]
+
+def test_encode_max_tokens():
+    hutoken.initialize("openai-community/gpt2")
+
+    text = "\n".join([paragraph1, paragraph2] * 100)
+    expected = hutoken.encode(text)
+
+    tokens, consumed = hutoken.encode(text, max_tokens=100)
+    assert len(tokens) <= 100 and tokens == expected[:len(tokens)]
+    data = text.encode("utf-8")
+    assert hutoken.encode(data[:consumed].decode("utf-8")) == tokens
+    assert tokens + hutoken.encode(data[consumed:].decode("utf-8")) == expected
+
+    tokens, consumed = hutoken.encode(text, max_tokens=len(expected) + 1)
+    assert tokens == expected
+    assert consumed == len(text.encode("utf-8"))
+
+    assert hutoken.count_tokens(text, max_tokens=100) == 100
+
+    texts = [sentence1, sentence2, paragraph1]
+    token_lists, consumed = hutoken.batch_encode(texts, max_tokens=5)
+    for text, tokens, length in zip(texts, token_lists, consumed):
+        data = text.encode("utf-8")
+        assert len(tokens) <= 5
+        assert tokens + hutoken.encode(data[length:].decode("utf-8")) \
+            == hutoken.encode(text)
+
+def test_encode_max_tokens_mid_word():
+    hutoken.initialize("openai-community/gpt2")
+
+    # The long word takes several tokens, so most budgets run out inside it.
+    text = "Ez a szó megszentségteleníthetetlenségeskedéseitekért hosszú."
+    expected = hutoken.encode(text)
+    data = text.encode("utf-8")
+
+    for max_tokens in range(1, len(expected) + 1):
+        tokens, consumed = hutoken.encode(text, max_tokens=max_tokens)
+        rest = hutoken.encode(data[consumed:].decode("utf-8"))
+        assert len(tokens) <= max_tokens
+        assert tokens + rest == expected
+
+def test_encode_return_offsets():
+    tt_enc = tiktoken.get_encoding("gpt2")
+    hutoken.initialize("openai-community/gpt2")
+
+    for text in (sentence1, paragraph1):
+        tokens, offsets, word_ids = hutoken.encode(text, return_offsets=True)
+        assert tokens == hutoken.encode(text)
+        assert len(offsets) == 2 * len(tokens)
+        assert len(word_ids) == len(tokens)
+
+        data = text.encode("utf-8")
+        for i, token in enumerate(tokens):
+            start, end = offsets[2 * i], offsets[2 * i + 1]
+            assert data[start:end] == tt_enc.decode_single_token_bytes(token)
+        assert list(word_ids) == sorted(word_ids)
+
+    token_lists, offsets, word_ids = hutoken.batch_encode(
+        [sentence1, sentence2], return_offsets=True)
+    assert (token_lists[1], offsets[1], word_ids[1]) \
+        == hutoken.encode(sentence2, return_offsets=True)
+
+def test_encode_special_tokens():
+    tt_enc = tiktoken.get_encoding("gpt2")
+    hutoken.initialize("openai-community/gpt2")
+
+    text = f"{sentence1}<|endoftext|>{sentence2}"
+
+    with pytest.raises(ValueError):
+        hutoken.encode(text)
+
+    assert hutoken.encode(text, allowed_special="all") \
+        == tt_enc.encode(text, allowed_special="all")
+    assert hutoken.encode(text, allowed_special={"<|endoftext|>"}) \
+        == tt_enc.encode(text, allowed_special={"<|endoftext|>"})
+    assert hutoken.encode(text, disallowed_special=()) \
+        == tt_enc.encode(text, disallowed_special=())
+    assert hutoken.batch_encode([text, sentence2], allowed_special="all") \
+        == tt_enc.encode_batch([text, sentence2], allowed_special="all")
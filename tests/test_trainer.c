@@ -0,0 +1,566 @@
+// mkstemp and fdopen are POSIX, not C17.
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hutoken/bpe.h"
+#include "hutoken/trainer.h"
+
+#define RUN_TEST(test)                          \
+    do {                                        \
+        printf("Running test: %s...\n", #test); \
+        test();                                 \
+    } while (0)
+
+// Counts the pair in every word from scratch.
+static int64_t recount(const struct Trainer* trainer, int left, int right) {
+    int64_t count = 0;
+    for (size_t w = 0; w < trainer->num_words; ++w) {
+        size_t i = trainer->word_starts[w];
+        for (; trainer->next[i] != TRAINER_NONE; i = trainer->next[i]) {
+            if (trainer->symbols[i] == left &&
+                trainer->symbols[trainer->next[i]] == right) {
+                count += trainer->freqs[i];
+            }
+        }
+    }
+    return count;
+}
+
+static size_t word_len(const struct Trainer* trainer, size_t word) {
+    size_t len = 0;
+    for (size_t i = trainer->word_starts[word]; i != TRAINER_NONE;
+         i = trainer->next[i]) {
+        len++;
+    }
+    return len;
+}
+
+// Checks every kept count against a recount.
+static void check_counts(const struct Trainer* trainer) {
+    for (size_t p = 0; p < trainer->num_pairs; ++p) {
+        const struct PairStats* pair = &trainer->pairs[p];
+        assert(pair->count == recount(trainer, pair->left, pair->right));
+    }
+}
+
+// The most frequent pair in the words, the smallest one among equals.
+static int64_t best_pair(const struct Trainer* trainer,
+                         int* best_left,
+                         int* best_right) {
+    int64_t best = 0;
+    for (size_t w = 0; w < trainer->num_words; ++w) {
+        size_t i = trainer->word_starts[w];
+        for (; trainer->next[i] != TRAINER_NONE; i = trainer->next[i]) {
+            int left = trainer->symbols[i];
+            int right = trainer->symbols[trainer->next[i]];
+            int64_t count = recount(trainer, left, right);
+            bool smaller = left < *best_left ||
+                           (left == *best_left && right < *best_right);
+            if (count > best || (count == best && smaller)) {
+                best = count;
+                *best_left = left;
+                *best_right = right;
+            }
+        }
+    }
+    return best;
+}
+
+// Merges until no pair is left, checking each merge against a recount.
+static size_t train_and_check(struct Trainer* trainer, int64_t min_frequency) {
+    struct TrainerMerge merge;
+    size_t merges = 0;
+    while (true) {
+        int left = 0;
+        int right = 0;
+        int64_t best = best_pair(trainer, &left, &right);
+        if (!trainer_merge_next(trainer, min_frequency, &merge)) {
+            assert(best < min_frequency);
+            break;
+        }
+        assert(merge.left == left && merge.right == right);
+        assert(merge.count == best);
+        assert(recount(trainer, left, right) == 0);
+        check_counts(trainer);
+        merges++;
+    }
+    return merges;
+}
+
+void test_trainer_init(void) {
+    struct Trainer trainer;
+    assert(trainer_init(&trainer));
+
+    assert(trainer.num_tokens == 256);
+    assert(trainer.vocab->count == 256);
+    assert(trainer.tokens['a'][0] == 'a' && trainer.tokens['a'][1] == '\0');
+
+    trainer_free(&trainer);
+}
+
+void test_trainer_merges_within_words(void) {
+    struct Trainer trainer;
+    assert(trainer_init(&trainer));
+    assert(trainer_add_word(&trainer, "ab", 2, 1));
+    assert(trainer_add_word(&trainer, "ab", 2, 1));
+    assert(trainer_add_word(&trainer, "b", 1, 5));
+    assert(trainer_add_word(&trainer, "a", 1, 5));
+    assert(trainer_count_pairs(&trainer));
+
+    struct TrainerMerge merge;
+    assert(trainer_merge_next(&trainer, 1, &merge));
+    assert(merge.left == 'a' && merge.right == 'b');
+    assert(merge.id == 256);
+    assert(merge.count == 2);
+    assert(strcmp(trainer.tokens[256], "ab") == 0);
+
+    // "b" followed by "a" is not a pair, they are in different words.
+    assert(!trainer_merge_next(&trainer, 1, &merge));
+    assert(!trainer.oom);
+
+    trainer_free(&trainer);
+}
+
+void test_trainer_overlapping_pairs(void) {
+    struct Trainer trainer;
+    assert(trainer_init(&trainer));
+    assert(trainer_add_word(&trainer, "aaaaa", 5, 1));
+    assert(trainer_count_pairs(&trainer));
+
+    struct TrainerMerge merge;
+    assert(trainer_merge_next(&trainer, 1, &merge));
+    assert(merge.left == 'a' && merge.right == 'a' && merge.count == 4);
+    assert(word_len(&trainer, 0) == 3);
+    check_counts(&trainer);
+
+    // "aa" "aa" "a" ties with "aa" "a", the smaller pair goes first.
+    assert(trainer_merge_next(&trainer, 1, &merge));
+    assert(merge.left == 256 && merge.right == 'a' && merge.count == 1);
+    assert(strcmp(trainer.tokens[merge.id], "aaa") == 0);
+
+    // The merges are kept in the order they were learned, which is their
+    // rank in a merges file.
+    assert(trainer.num_merges == 2);
+    assert(trainer.merges[0].left == 'a' && trainer.merges[0].id == 256);
+    assert(trainer.merges[1].left == 256 && trainer.merges[1].id == 257);
+
+    trainer_free(&trainer);
+}
+
+void test_trainer_min_frequency(void) {
+    struct Trainer trainer;
+    assert(trainer_init(&trainer));
+    assert(trainer_add_word(&trainer, "xy", 2, 3));
+    assert(trainer_add_word(&trainer, "zw", 2, 1));
+    assert(trainer_count_pairs(&trainer));
+
+    struct TrainerMerge merge;
+    assert(trainer_merge_next(&trainer, 2, &merge));
+    assert(merge.left == 'x' && merge.right == 'y');
+    assert(!trainer_merge_next(&trainer, 2, &merge));
+    assert(trainer_merge_next(&trainer, 1, &merge));
+    assert(merge.left == 'z' && merge.right == 'w');
+
+    trainer_free(&trainer);
+}
+
+void test_trainer_incremental_counts(void) {
+    const char* text =
+        "the quick brown fox jumps over the lazy dog and the other dog "
+        "then the fox sleeps while the dogs bark at the brown fox there";
+    struct Trainer trainer;
+    assert(trainer_init(&trainer));
+    const char* word = text;
+    while (*word) {
+        size_t len = strcspn(word, " ");
+        assert(trainer_add_word(&trainer, word, len, 1 + (int64_t)len % 3));
+        word += len;
+        word += strspn(word, " ");
+    }
+    assert(trainer_count_pairs(&trainer));
+
+    size_t merges = train_and_check(&trainer, 1);
+    assert(!trainer.oom);
+    assert(merges > 0);
+
+    // Every word ends up as a single token.
+    for (size_t w = 0; w < trainer.num_words; ++w) {
+        assert(word_len(&trainer, w) == 1);
+    }
+
+    trainer_free(&trainer);
+}
+
+void test_trainer_single_word(void) {
+    const char* text =
+        "abababcabcabcaaaabbbbababab abcabc aaaaaa bcbcbcbc abababab";
+    struct Trainer trainer;
+    assert(trainer_init(&trainer));
+    assert(trainer_add_word(&trainer, text, strlen(text), 1));
+    assert(trainer_count_pairs(&trainer));
+
+    size_t merges = train_and_check(&trainer, 2);
+    assert(!trainer.oom);
+    assert(merges > 0);
+
+    trainer_free(&trainer);
+}
+
+void test_trainer_word_counts(void) {
+    const char* words[] = {"alma", "fa", "alma", "almafa", "fa", "alma"};
+    size_t num_words = sizeof(words) / sizeof(words[0]);
+    struct Trainer each;
+    struct Trainer counted;
+    struct WordCounts counts;
+    assert(trainer_init(&each));
+    assert(trainer_init(&counted));
+    assert(word_counts_init(&counts));
+    for (size_t i = 0; i < num_words; ++i) {
+        size_t len = strlen(words[i]);
+        assert(trainer_add_word(&each, words[i], len, 1));
+        assert(word_counts_add(&counts, words[i], len, 1));
+    }
+    assert(trainer_add_word_counts(&counted, &counts));
+    assert(counted.num_words == 3);
+    assert(trainer_count_pairs(&each));
+    assert(trainer_count_pairs(&counted));
+
+    // Distinct words weighted by their count learn the same merges.
+    struct TrainerMerge a;
+    struct TrainerMerge b;
+    while (trainer_merge_next(&each, 1, &a)) {
+        assert(trainer_merge_next(&counted, 1, &b));
+        assert(a.left == b.left && a.right == b.right);
+        assert(a.id == b.id && a.count == b.count);
+    }
+    assert(!trainer_merge_next(&counted, 1, &b));
+
+    word_counts_free(&counts);
+    trainer_free(&each);
+    trainer_free(&counted);
+}
+
+void test_trainer_threads(void) {
+    // Long enough for the first merges to be split between threads.
+    size_t len = 400000;
+    char* text = malloc(len);
+    assert(text != NULL);
+    uint32_t state = 1;
+    for (size_t i = 0; i < len; ++i) {
+        state = state * 1103515245 + 12345;
+        text[i] = "aab ba"[(state >> 16) % 6];
+    }
+
+    struct Trainer serial;
+    struct Trainer threaded;
+    assert(trainer_init(&serial));
+    assert(trainer_init(&threaded));
+    threaded.num_threads = 4;
+    assert(trainer_add_word(&serial, text, len, 1));
+    assert(trainer_add_word(&threaded, text, len, 1));
+    assert(trainer_count_pairs(&serial));
+    assert(trainer_count_pairs(&threaded));
+
+    struct TrainerMerge a;
+    struct TrainerMerge b;
+    for (int i = 0; i < 200 && trainer_merge_next(&serial, 2, &a); ++i) {
+        assert(trainer_merge_next(&threaded, 2, &b));
+        assert(a.left == b.left && a.right == b.right);
+        assert(a.id == b.id && a.count == b.count);
+    }
+    assert(memcmp(serial.symbols, threaded.symbols, len * sizeof(int)) == 0);
+    for (size_t p = 0; p < threaded.num_pairs; ++p) {
+        const struct PairStats* pair = &threaded.pairs[p];
+        if (pair->count > 0 && pair->left < 260 && pair->right < 260) {
+            assert(pair->count == recount(&threaded, pair->left, pair->right));
+        }
+    }
+
+    trainer_free(&serial);
+    trainer_free(&threaded);
+    free(text);
+}
+
+void test_trainer_checkpoint(void) {
+    const char* words[] = {"abcab", "bcabc", "cabca", "abab", "x"};
+    struct Trainer full;
+    struct Trainer stopped;
+    assert(trainer_init(&full));
+    assert(trainer_init(&stopped));
+    for (int w = 0; w < 5; ++w) {
+        assert(trainer_add_word(&full, words[w], strlen(words[w]), w + 1));
+        assert(trainer_add_word(&stopped, words[w], strlen(words[w]), w + 1));
+    }
+    assert(trainer_count_pairs(&full));
+    assert(trainer_count_pairs(&stopped));
+
+    struct TrainerMerge a;
+    struct TrainerMerge b;
+    assert(trainer_merge_next(&full, 1, &a));
+    assert(trainer_merge_next(&full, 1, &a));
+    assert(trainer_merge_next(&stopped, 1, &b));
+    assert(trainer_merge_next(&stopped, 1, &b));
+
+    FILE* file = tmpfile();
+    assert(file != NULL);
+    assert(trainer_write_checkpoint(&stopped, file));
+    trainer_free(&stopped);
+    rewind(file);
+
+    struct Trainer resumed;
+    assert(trainer_init(&resumed));
+    assert(trainer_read_checkpoint(&resumed, file));
+    assert(trainer_count_pairs(&resumed));
+    assert(resumed.num_merges == 2 && resumed.num_tokens == full.num_tokens);
+    assert(resumed.merges[1].id == full.merges[1].id);
+    // "x" has no pair left, so it is not kept.
+    assert(resumed.num_words == 4);
+
+    // The rest of the merges are the same as if training had not stopped.
+    while (trainer_merge_next(&full, 1, &a)) {
+        assert(trainer_merge_next(&resumed, 1, &b));
+        assert(a.left == b.left && a.right == b.right);
+        assert(a.id == b.id && a.count == b.count);
+    }
+    assert(!trainer_merge_next(&resumed, 1, &b));
+    assert(strcmp(resumed.tokens[resumed.num_tokens - 1],
+                  full.tokens[full.num_tokens - 1]) == 0);
+
+    // Anything else is rejected.
+    rewind(file);
+    assert(fputs("not a checkpoint", file) >= 0);
+    rewind(file);
+    struct Trainer invalid;
+    assert(trainer_init(&invalid));
+    assert(!trainer_read_checkpoint(&invalid, file));
+    assert(!invalid.oom);
+
+    trainer_free(&invalid);
+    (void)fclose(file);
+    trainer_free(&full);
+    trainer_free(&resumed);
+}
+
+// Reads a checkpoint from the first `len` bytes of `data`.
+static bool read_checkpoint_bytes(struct Trainer* trainer,
+                                  const char* data,
+                                  size_t len) {
+    FILE* file = tmpfile();
+    assert(file != NULL);
+    assert(fwrite(data, 1, len, file) == len);
+    rewind(file);
+    bool ok = trainer_read_checkpoint(trainer, file);
+    (void)fclose(file);
+    return ok;
+}
+
+void test_trainer_checkpoint_corrupt(void) {
+    const char* words[] = {"abcab", "bcabc", "cabca", "abab"};
+    struct Trainer trainer;
+    assert(trainer_init(&trainer));
+    for (int w = 0; w < 4; ++w) {
+        assert(trainer_add_word(&trainer, words[w], strlen(words[w]), w + 1));
+    }
+    assert(trainer_count_pairs(&trainer));
+    struct TrainerMerge merge;
+    assert(trainer_merge_next(&trainer, 1, &merge));
+    assert(trainer_merge_next(&trainer, 1, &merge));
+
+    FILE* file = tmpfile();
+    assert(file != NULL);
+    assert(trainer_write_checkpoint(&trainer, file));
+    long size = ftell(file);
+    assert(size > 0);
+    char data[4096];
+    assert((size_t)size + 3 <= sizeof(data));
+    rewind(file);
+    assert(fread(data, 1, size, file) == (size_t)size);
+    (void)fclose(file);
+
+    struct Trainer resumed;
+    assert(trainer_init(&resumed));
+    assert(read_checkpoint_bytes(&resumed, data, size));
+    trainer_free(&resumed);
+
+    // A file cut within a word, or with part of another word after the last
+    // one, is rejected.
+    memset(data + size, 1, 3);
+    for (long len = size - 2; len <= size + 3; len += 5) {
+        assert(trainer_init(&resumed));
+        assert(!read_checkpoint_bytes(&resumed, data, len));
+        assert(!resumed.oom);
+        trainer_free(&resumed);
+    }
+
+    // The number of merges follows the magic, version, token count and the
+    // tokens after the 256 bytes. A corrupt one is not allocated for.
+    size_t offset = 8 + 4 + 8;
+    for (size_t i = 256; i < trainer.num_tokens; ++i) {
+        offset += 4 + strlen(trainer.tokens[i]);
+    }
+    uint64_t num_merges = 0;
+    memcpy(&num_merges, data + offset, sizeof(num_merges));
+    assert(num_merges == 2);
+    num_merges = (uint64_t)1 << 40;
+    memcpy(data + offset, &num_merges, sizeof(num_merges));
+    assert(trainer_init(&resumed));
+    assert(!read_checkpoint_bytes(&resumed, data, size));
+    assert(!resumed.oom);
+    trainer_free(&resumed);
+
+    trainer_free(&trainer);
+}
+
+static bool count_report(const struct TrainProgress* progress, void* data) {
+    size_t* reports = data;
+    assert(progress->num_merges % 2 == 0 || progress->done);
+    assert(progress->memory_bytes > 0 && progress->elapsed_seconds >= 0.0);
+    ++*reports;
+    return *reports < 3;
+}
+
+void test_trainer_progress(void) {
+    struct Trainer trainer;
+    assert(trainer_init(&trainer));
+    assert(trainer_add_word(&trainer, "abcdefgh", 8, 3));
+    assert(trainer_count_pairs(&trainer));
+
+    size_t reports = 0;
+    struct TrainProgressHook progress = {
+        .report = count_report, .data = &reports, .every = 2};
+    bpe_start_progress(&trainer, &progress);
+    struct TrainerMerge merge;
+    bool ok = true;
+    while (ok && trainer_merge_next(&trainer, 1, &merge)) {
+        ok = bpe_report_progress(&trainer, &progress, false);
+    }
+    // Reported every second merge, until the hook asked to stop.
+    assert(!ok && reports == 3 && trainer.num_merges == 6);
+
+    // Without a hook there is nothing to report.
+    assert(bpe_report_progress(&trainer, NULL, true));
+
+    trainer_free(&trainer);
+}
+
+static bool same_counts(const struct WordCounts* a,
+                        const struct WordCounts* b) {
+    if (a->total != b->total || a->words->count != b->words->count) {
+        return false;
+    }
+    size_t iter = 0;
+    void* item = NULL;
+    while (hashmap_iter(a->words, &iter, &item)) {
+        const struct WordCount* expected = item;
+        const struct WordCount* word = hashmap_get(b->words, expected);
+        if (!word || word->count != expected->count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void test_trainer_word_stream(void) {
+    const char* text =
+        "alma  fa\tkorte\n\nalma almafa  \t fa  fa körte, 12 alma\n fa";
+    size_t len = strlen(text);
+    struct WordCounts whole;
+    assert(word_counts_init(&whole));
+    assert(word_counts_add_text(&whole, text, len, NULL));
+
+    // Chunks of any size, even splitting a character, count the same words.
+    for (size_t size = 1; size <= len; ++size) {
+        struct WordStream stream;
+        assert(word_stream_init(&stream, NULL, 1));
+        for (size_t i = 0; i < len; i += size) {
+            size_t n = len - i < size ? len - i : size;
+            assert(word_stream_feed(&stream, text + i, n));
+            assert(stream.pending_len < 16);
+        }
+        assert(word_stream_finish(&stream));
+        assert(same_counts(&whole, &stream.counts));
+        word_stream_free(&stream);
+    }
+
+    word_counts_free(&whole);
+}
+
+void test_trainer_sample_files(void) {
+    char path[] = "/tmp/hutoken_sample_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    FILE* file = fdopen(fd, "w");
+    assert(file != NULL);
+    const char* words[] = {"alma", "fa", "körte", "szilva", "\n", "x"};
+    uint32_t state = 1;
+    for (size_t i = 0; i < 200000; ++i) {
+        state = state * 1103515245 + 12345;
+        fprintf(file, "%s ", words[(state >> 16) % 6]);
+    }
+    fclose(file);
+    const char* paths[] = {path};
+
+    struct WordStream whole;
+    struct WordStream all;
+    assert(word_stream_init(&whole, NULL, 2));
+    assert(word_stream_init(&all, NULL, 2));
+    assert(word_stream_feed_file(&whole, path));
+    struct TrainSample sample = {.max_bytes = 0};
+    assert(word_stream_sample_files(&all, paths, 1, &sample));
+    assert(sample.sampled_bytes == sample.total_bytes);
+    assert(same_counts(&whole.counts, &all.counts));
+
+    // The same seed picks the same blocks, another one other blocks.
+    struct WordStream first;
+    struct WordStream second;
+    struct WordStream other;
+    assert(word_stream_init(&first, NULL, 2));
+    assert(word_stream_init(&second, NULL, 1));
+    assert(word_stream_init(&other, NULL, 2));
+    sample = (struct TrainSample){.max_bytes = 300000, .seed = 42};
+    assert(word_stream_sample_files(&first, paths, 1, &sample));
+    assert(sample.sampled_bytes <= 300000 + 65536);
+    assert(sample.sampled_bytes >= 300000 - 65536);
+    assert(word_stream_sample_files(&second, paths, 1, &sample));
+    sample.seed = 43;
+    assert(word_stream_sample_files(&other, paths, 1, &sample));
+    assert(same_counts(&first.counts, &second.counts));
+    assert(!same_counts(&first.counts, &other.counts));
+    assert(first.counts.words->count <= whole.counts.words->count);
+
+    word_stream_free(&whole);
+    word_stream_free(&all);
+    word_stream_free(&first);
+    word_stream_free(&second);
+    word_stream_free(&other);
+    unlink(path);
+}
+
+int main(void) {
+    puts("Starting Trainer tests.\n");
+
+    RUN_TEST(test_trainer_init);
+    RUN_TEST(test_trainer_merges_within_words);
+    RUN_TEST(test_trainer_overlapping_pairs);
+    RUN_TEST(test_trainer_min_frequency);
+    RUN_TEST(test_trainer_incremental_counts);
+    RUN_TEST(test_trainer_single_word);
+    RUN_TEST(test_trainer_word_counts);
+    RUN_TEST(test_trainer_threads);
+    RUN_TEST(test_trainer_checkpoint);
+    RUN_TEST(test_trainer_checkpoint_corrupt);
+    RUN_TEST(test_trainer_progress);
+    RUN_TEST(test_trainer_word_stream);
+    RUN_TEST(test_trainer_sample_files);
+
+    puts("\nAll Trainer tests passed successfully!");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,118 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hutoken/unicode.h"
+
+#define RUN_TEST(test)                          \
+    do {                                        \
+        printf("Running test: %s...\n", #test); \
+        test();                                 \
+    } while (0)
+
+static void assert_transcodes_to(const void* data,
+                                 size_t length,
+                                 enum UnicodeKind kind,
+                                 const char* expected) {
+    size_t utf8_len = 0;
+    assert(unicode_utf8_len(data, length, kind, &utf8_len) == UNICODE_SUCCESS);
+    assert(utf8_len == strlen(expected));
+
+    char* buffer = malloc(utf8_len + 1);
+    assert(buffer != NULL);
+    assert(unicode_to_utf8(data, length, kind, buffer) == UNICODE_SUCCESS);
+    assert(strcmp(buffer, expected) == 0);
+    free(buffer);
+}
+
+void test_invalid_arguments(void) {
+    size_t utf8_len = 0;
+    char buffer[4];
+    const uint8_t text[] = {'a'};
+
+    assert(unicode_utf8_len(NULL, 1, UNICODE_KIND_UCS1, &utf8_len) ==
+           UNICODE_INVALID_ARGUMENT);
+    assert(unicode_utf8_len(text, 1, UNICODE_KIND_UCS1, NULL) ==
+           UNICODE_INVALID_ARGUMENT);
+    assert(unicode_to_utf8(NULL, 1, UNICODE_KIND_UCS1, buffer) ==
+           UNICODE_INVALID_ARGUMENT);
+    assert(unicode_to_utf8(text, 1, UNICODE_KIND_UCS1, NULL) ==
+           UNICODE_INVALID_ARGUMENT);
+}
+
+void test_empty_string(void) {
+    const uint8_t text[] = {0};
+    assert_transcodes_to(text, 0, UNICODE_KIND_UCS1, "");
+}
+
+void test_ucs1_ascii(void) {
+    const uint8_t text[] = {'h', 'e', 'l', 'l', 'o'};
+    assert_transcodes_to(text, 5, UNICODE_KIND_UCS1, "hello");
+}
+
+void test_ucs1_latin1(void) {
+    // "Árvíz"
+    const uint8_t text[] = {0xC1, 'r', 'v', 0xED, 'z'};
+    assert_transcodes_to(text, 5, UNICODE_KIND_UCS1, "\xC3\x81rv\xC3\xADz");
+}
+
+void test_ucs2(void) {
+    // "tűrő €"
+    const uint16_t text[] = {'t', 0x0171, 'r', 0x0151, ' ', 0x20AC};
+    assert_transcodes_to(text, 6, UNICODE_KIND_UCS2,
+                         "t\xC5\xB1r\xC5\x91 \xE2\x82\xAC");
+}
+
+void test_ucs4(void) {
+    // "a😀ő"
+    const uint32_t text[] = {'a', 0x1F600, 0x0151};
+    assert_transcodes_to(text, 3, UNICODE_KIND_UCS4,
+                         "a\xF0\x9F\x98\x80\xC5\x91");
+}
+
+void test_nul_character_rejected(void) {
+    size_t utf8_len = 0;
+    const uint8_t ucs1[] = {'a', 0, 'b'};
+    const uint16_t ucs2[] = {0x0151, 0};
+    const uint32_t ucs4[] = {0, 0x1F600};
+
+    assert(unicode_utf8_len(ucs1, 3, UNICODE_KIND_UCS1, &utf8_len) ==
+           UNICODE_NUL_CHARACTER);
+    assert(unicode_utf8_len(ucs2, 2, UNICODE_KIND_UCS2, &utf8_len) ==
+           UNICODE_NUL_CHARACTER);
+    assert(unicode_utf8_len(ucs4, 2, UNICODE_KIND_UCS4, &utf8_len) ==
+           UNICODE_NUL_CHARACTER);
+}
+
+void test_surrogate_rejected(void) {
+    size_t utf8_len = 0;
+    char buffer[16];
+    const uint16_t ucs2[] = {'a', 0xD800};
+    const uint32_t ucs4[] = {0xDFFF, 'b'};
+
+    assert(unicode_utf8_len(ucs2, 2, UNICODE_KIND_UCS2, &utf8_len) ==
+           UNICODE_SURROGATE);
+    assert(unicode_utf8_len(ucs4, 2, UNICODE_KIND_UCS4, &utf8_len) ==
+           UNICODE_SURROGATE);
+    assert(unicode_to_utf8(ucs2, 2, UNICODE_KIND_UCS2, buffer) ==
+           UNICODE_SURROGATE);
+}
+
+int main(void) {
+    puts("Starting unicode tests.\n");
+
+    RUN_TEST(test_invalid_arguments);
+    RUN_TEST(test_empty_string);
+    RUN_TEST(test_ucs1_ascii);
+    RUN_TEST(test_ucs1_latin1);
+    RUN_TEST(test_ucs2);
+    RUN_TEST(test_ucs4);
+    RUN_TEST(test_nul_character_rejected);
+    RUN_TEST(test_surrogate_rejected);
+
+    puts("\nAll unicode tests passed successfully!");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hutoken/wordcount.h"
+
+#define RUN_TEST(test)                          \
+    do {                                        \
+        printf("Running test: %s...\n", #test); \
+        test();                                 \
+    } while (0)
+
+static int64_t count_of(struct WordCounts* counts, const char* word) {
+    struct WordCount key = {.bytes = (char*)word, .len = strlen(word)};
+    const struct WordCount* found = hashmap_get(counts->words, &key);
+    return found ? found->count : 0;
+}
+
+void test_word_counts_add(void) {
+    struct WordCounts counts;
+    assert(word_counts_init(&counts));
+
+    assert(word_counts_add(&counts, "alma", 4, 1));
+    assert(word_counts_add(&counts, "almafa", 4, 2));
+    assert(word_counts_add(&counts, "almafa", 6, 1));
+    assert(word_counts_add(&counts, "", 0, 5));
+
+    assert(counts.words->count == 2);
+    assert(count_of(&counts, "alma") == 3);
+    assert(count_of(&counts, "almafa") == 1);
+    assert(counts.total == 4);
+
+    word_counts_free(&counts);
+    assert(counts.words == NULL);
+}
+
+void test_word_counts_add_text(void) {
+    struct WordCounts counts;
+    assert(word_counts_init(&counts));
+
+    assert(word_counts_add_text(&counts, "a fa a fa a ház", 16, NULL));
+
+    assert(count_of(&counts, "a") == 1);
+    assert(count_of(&counts, " a") == 2);
+    assert(count_of(&counts, " fa") == 2);
+    assert(count_of(&counts, " ház") == 1);
+    assert(counts.total == 6);
+
+    word_counts_free(&counts);
+}
+
+void test_word_counts_add_text_regex(void) {
+    struct WordCounts counts;
+    assert(word_counts_init(&counts));
+    regex_t regex;
+    assert(regcomp(&regex, "[a-z]+", REG_EXTENDED) == 0);
+
+    assert(word_counts_add_text(&counts, "ab, ab; cd", 10, &regex));
+
+    assert(counts.words->count == 2);
+    assert(count_of(&counts, "ab") == 2);
+    assert(count_of(&counts, "cd") == 1);
+
+    regfree(&regex);
+    word_counts_free(&counts);
+}
+
+void test_word_counts_add_text_nul(void) {
+    struct WordCounts counts;
+    assert(word_counts_init(&counts));
+    regex_t regex;
+    assert(regcomp(&regex, "[a-z]+", REG_EXTENDED) == 0);
+
+    assert(word_counts_add_text(&counts, "a\0b a\0\0b", 8, NULL));
+    assert(word_counts_add_text(&counts, "ab\0cd ab", 8, &regex));
+
+    assert(count_of(&counts, "a") == 1);
+    assert(count_of(&counts, "b") == 2);
+    assert(count_of(&counts, " a") == 1);
+    assert(count_of(&counts, "ab") == 2);
+    assert(count_of(&counts, "cd") == 1);
+    assert(counts.total == 7);
+
+    regfree(&regex);
+    word_counts_free(&counts);
+}
+
+void test_word_counts_merge(void) {
+    struct WordCounts counts;
+    struct WordCounts other;
+    assert(word_counts_init(&counts));
+    assert(word_counts_init(&other));
+
+    assert(word_counts_add_text(&counts, "a fa a", 6, NULL));
+    assert(word_counts_add_text(&other, " fa a ház", 10, NULL));
+    assert(word_counts_merge(&counts, &other));
+
+    assert(count_of(&counts, "a") == 1);
+    assert(count_of(&counts, " a") == 2);
+    assert(count_of(&counts, " fa") == 2);
+    assert(count_of(&counts, " ház") == 1);
+    assert(counts.total == 6);
+
+    word_counts_free(&other);
+    word_counts_free(&counts);
+}
+
+int main(void) {
+    puts("Starting WordCounts tests.\n");
+
+    RUN_TEST(test_word_counts_add);
+    RUN_TEST(test_word_counts_add_text);
+    RUN_TEST(test_word_counts_add_text_regex);
+    RUN_TEST(test_word_counts_add_text_nul);
+    RUN_TEST(test_word_counts_merge);
+
+    puts("\nAll WordCounts tests passed successfully!");
+
+    return EXIT_SUCCESS;
+}